@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Per-call latency tracing for the sync-to-async bridge.
+//
+// Every call through js_executor or queued_js_executor is split into phases
+// and each phase is added to a histogram kept per Javascript function. Build
+// with -DSYNC_TO_ASYNC_TRACING=1 (CMake option SYNC_TO_ASYNC_TRACING) to turn
+// it on. Without it the timestamps are not taken and snapshot() is empty.
+//
+// eg:
+//  Utils::trace::set_name(log_data, "log_data");
+//  ...
+//  Utils::trace::dump(std::cout);
+#ifndef SYNC_TO_ASYNC_TRACING
+#define SYNC_TO_ASYNC_TRACING 0
+#endif
+
+#if SYNC_TO_ASYNC_TRACING
+#define SYNC_TO_ASYNC_TRACE(...) __VA_ARGS__
+#else
+#define SYNC_TO_ASYNC_TRACE(...)
+#endif
+
+namespace Utils {
+    namespace trace {
+
+        enum Phase : int {
+            // Waiting for a free worker or completion slot.
+            QUEUE_WAIT = 0,
+            // From getting a worker until the Javascript function starts running
+            // (lane queue and hop to the returner, or the worker's Dispatch).
+            DISPATCH,
+            // Javascript running, until it calls Module._resume_execution.
+            JS,
+            // From resume_execution until the caller is running again.
+            WAKE,
+            // The whole call as seen by the caller.
+            TOTAL,
+            PHASE_COUNT
+        };
+
+        const char *phase_name(Phase phase);
+
+        inline std::uint64_t now_ns() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+        }
+
+        // Timestamps of one call. Filled in by the executors as the call moves
+        // through the bridge, then handed to record().
+        struct CallTrace {
+            const void *key = nullptr;
+            std::uint64_t start = 0;
+            std::uint64_t acquired = 0;
+            std::uint64_t jsStarted = 0;
+            std::uint64_t resumed = 0;
+            std::uint64_t woken = 0;
+        };
+
+        // Lock-free log-linear histogram of nanosecond durations. Each power of
+        // two is split into four buckets, so quantiles are within 25%.
+        class LatencyHistogram {
+        public:
+            static constexpr std::size_t kBucketCount = 192;
+
+            void add(std::uint64_t ns);
+            void reset();
+            std::uint64_t count() const { return mCount.load(std::memory_order_relaxed); }
+            std::uint64_t max() const { return mMax.load(std::memory_order_relaxed); }
+            // Upper bound of the bucket holding the given quantile (0..1).
+            std::uint64_t quantile(double q) const;
+
+            static std::size_t bucketFor(std::uint64_t ns);
+            static std::uint64_t bucketUpperBound(std::size_t bucket);
+
+        private:
+            std::array<std::atomic<std::uint64_t>, kBucketCount> mBuckets{};
+            std::atomic<std::uint64_t> mCount{0};
+            std::atomic<std::uint64_t> mMax{0};
+        };
+
+        struct PhaseStats {
+            std::uint64_t count;
+            std::uint64_t p50_ns;
+            std::uint64_t p99_ns;
+            std::uint64_t max_ns;
+        };
+
+        struct FunctionStats {
+            const void *key;
+            // nullptr unless set_name was called for the key.
+            const char *name;
+            std::array<PhaseStats, PHASE_COUNT> phases;
+        };
+
+        namespace detail {
+            template<typename Func>
+            const void *key_of(Func &&func, std::true_type /* function */) {
+                typename std::decay<Func>::type pointer = func;
+                return reinterpret_cast<const void *>(pointer);
+            }
+            template<typename Func>
+            const void *key_of(Func &&func, std::false_type /* function object */) {
+                return static_cast<const void *>(std::addressof(func));
+            }
+        }// namespace detail
+
+        // Functions and function pointers are keyed by their address, function
+        // objects by the address of the object.
+        template<typename Func>
+        const void *key_of(Func &&func) {
+            using Decayed = typename std::decay<Func>::type;
+            return detail::key_of(std::forward<Func>(func),
+                                  std::is_function<typename std::remove_pointer<Decayed>::type>{});
+        }
+
+        // Add a finished call to the histograms of its function.
+        void record(const CallTrace &call);
+
+        // Label a function in snapshot() and dump(). name must outlive the program.
+        void set_name(const void *key, const char *name);
+        template<typename Func>
+        void set_name(Func &&func, const char *name) { set_name(key_of(std::forward<Func>(func)), name); }
+
+        std::vector<FunctionStats> snapshot();
+        void dump(std::ostream &out);
+        void reset();
+
+    }// namespace trace
+}// namespace Utils
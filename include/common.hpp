@@ -1,9 +1,64 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 namespace Utils {
     enum JsResultStatus : int {
         OK = 0,
         ERROR = 1,
-        NOT_STARTED = 2
+        NOT_STARTED = 2,
+        // The deadline of a *_for / *_until call passed before Javascript resumed it
+        TIMEOUT = 3,
+        // The executor was full and turned the call away without running it,
+        // see try_invoke and the waiting limits
+        BUSY = 4
+    };
+
+    // Load of an executor: QueuedSyncToAsync::queueStats or SyncToAsyncPool::stats.
+    struct QueueStats {
+        // Calls running, i.e. holding a completion slot or a worker.
+        std::size_t inFlight = 0;
+        // Callers blocked until a call finishes, and the most seen at once.
+        std::size_t waiting = 0;
+        std::size_t peakWaiting = 0;
+        // Calls turned away with BUSY.
+        std::uint64_t rejected = 0;
+    };
+
+    // What Javascript gets as `callback` and hands back to resume_execution:
+    // a plain function and its context, so that completing a call needs no
+    // std::function and no allocation.
+    struct Completion {
+        void (*func)(void *context);
+        void *context;
+
+        void operator()() const { func(context); }
+    };
+
+    // Kind of value a Javascript function returned in JsReturn.
+    enum JsReturnKind : int {
+        NONE = 0,
+        I64 = 1,
+        F64 = 2,
+        BYTES = 3
+    };
+
+    // What a Javascript function that returns a value gets instead of the
+    // status pointer. `status` comes first, so a pointer to a JsReturn is
+    // also a valid status pointer for resume_execution.
+    //
+    // The layout up to `size` is read by js_resume_bytes in js_functions.js.
+    struct JsReturn {
+        int status = NOT_STARTED;
+        int kind = NONE;
+        // Caller owned buffer for byte and string payloads, see JsArena.
+        unsigned char *arena = nullptr;
+        std::uint32_t capacity = 0;
+        // Size of the payload. Larger than capacity if it did not fit, in
+        // which case nothing was copied.
+        std::uint32_t size = 0;
+        std::int64_t i64 = 0;
+        double f64 = 0;
     };
 }
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// How long a caller spins on its completion word before it goes to sleep, in
+// microseconds. See set_wait_spin.
+#ifndef SYNC_TO_ASYNC_WAIT_SPIN_US
+#define SYNC_TO_ASYNC_WAIT_SPIN_US 0
+#endif
+
+namespace Utils {
+
+    // Spinning saves the sleep and wake up for calls that resume within a few
+    // microseconds, at the cost of a busy core while it lasts. Zero sleeps
+    // right away. Applies to every executor and can be changed at any time.
+    void set_wait_spin(std::chrono::microseconds spin);
+    std::chrono::microseconds wait_spin();
+
+    namespace detail {
+        // Completion signals on a 32 bit word, through emscripten_futex_wait
+        // and emscripten_futex_wake (a futex on the host). Only the threads
+        // waiting on a word are woken when it changes, and taking no lock
+        // means a completion never waits for a caller that is still waking.
+
+        // Block while word == value, after spinning for wait_spin().
+        void wait_while(const std::atomic<std::uint32_t> &word, std::uint32_t value);
+        // Same with a deadline. Returns false if word still equals value at the deadline.
+        bool wait_while_until(const std::atomic<std::uint32_t> &word, std::uint32_t value,
+                              std::chrono::steady_clock::time_point deadline);
+
+        // Wake one or every thread blocked in wait_while on word, after changing it.
+        void wake_one(std::atomic<std::uint32_t> &word);
+        void wake_all(std::atomic<std::uint32_t> &word);
+    }// namespace detail
+
+}// namespace Utils
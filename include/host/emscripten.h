@@ -0,0 +1,24 @@
+#pragma once
+// Host (non-Emscripten) replacement for <emscripten.h>, see host/event_loop.hpp.
+// Only the subset used by this repository is provided.
+
+#define EMSCRIPTEN_KEEPALIVE __attribute__((used))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*em_arg_callback_func)(void *);
+
+// Runs func(arg) on the calling thread's event loop after `millis`.
+void emscripten_async_call(em_arg_callback_func func, void *arg, int millis);
+
+// Hands the calling thread over to its event loop. Does not return.
+void emscripten_exit_with_live_runtime(void) __attribute__((noreturn));
+
+// Milliseconds from a monotonic clock.
+double emscripten_get_now(void);
+
+#ifdef __cplusplus
+}
+#endif
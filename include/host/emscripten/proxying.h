@@ -0,0 +1,48 @@
+#pragma once
+// Host replacement for <emscripten/proxying.h>. Work is proxied by posting it
+// to the target thread's host::EventLoop.
+#include <functional>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct em_proxying_queue em_proxying_queue;
+
+em_proxying_queue *em_proxying_queue_create(void);
+void em_proxying_queue_destroy(em_proxying_queue *q);
+// Queue that every thread runs from its event loop without being asked to.
+em_proxying_queue *emscripten_proxy_get_system_queue(void);
+// Runs the work that is pending for the calling thread.
+void emscripten_proxy_execute_queue(em_proxying_queue *q);
+// Returns 1 if the work was queued (async) or executed (sync), 0 otherwise.
+int emscripten_proxy_async(em_proxying_queue *q, pthread_t target_thread, void (*func)(void *), void *arg);
+int emscripten_proxy_sync(em_proxying_queue *q, pthread_t target_thread, void (*func)(void *), void *arg);
+
+#ifdef __cplusplus
+}
+
+namespace emscripten {
+
+    class ProxyingQueue {
+    public:
+        em_proxying_queue *queue = em_proxying_queue_create();
+
+        ProxyingQueue() = default;
+        ProxyingQueue(const ProxyingQueue &) = delete;
+        ProxyingQueue &operator=(const ProxyingQueue &) = delete;
+        ~ProxyingQueue() {
+            if (queue) {
+                em_proxying_queue_destroy(queue);
+            }
+        }
+
+        void execute() { emscripten_proxy_execute_queue(queue); }
+
+        bool proxyAsync(const pthread_t target, std::function<void()> &&func);
+        bool proxySync(const pthread_t target, const std::function<void()> &func);
+    };
+
+}// namespace emscripten
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+// Host replacement for <emscripten/threading.h>.
+#include <emscripten.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Sleeps while *addr == val, for at most maxWaitMilliseconds (INFINITY for no
+// limit). Returns 0 when woken, -EWOULDBLOCK if *addr != val, or -ETIMEDOUT.
+// Wake ups can be spurious, as in Emscripten.
+int emscripten_futex_wait(volatile void *addr, uint32_t val, double maxWaitMilliseconds);
+
+// Wakes up to `count` threads sleeping on addr. Returns how many were woken.
+int emscripten_futex_wake(volatile void *addr, int count);
+
+#ifdef __cplusplus
+}
+#endif
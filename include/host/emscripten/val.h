@@ -0,0 +1,3 @@
+#pragma once
+// Host replacement for <emscripten/val.h>. There is no Javascript on the host,
+// so nothing from embind is available.
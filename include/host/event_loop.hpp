@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <pthread.h>
+#include <vector>
+
+// Native stand-in for the browser/Node event loop of a pthread.
+//
+// In Emscripten every pthread has a Javascript event loop that runs once the
+// thread's start routine returns or calls emscripten_exit_with_live_runtime().
+// emscripten_async_call() and the proxying queue deliver work through it, and
+// async Javascript (promises, setTimeout) finishes on it. On the host each
+// pthread gets an EventLoop instead, so the executors in this repository can
+// run unchanged under g++/clang, perf and ThreadSanitizer.
+namespace host {
+
+    class EventLoop {
+    public:
+        using Task = std::function<void()>;
+        using TaskFunc = void (*)(void *);
+        using Clock = std::chrono::steady_clock;
+
+        // Queue `func(arg)` to run on the loop's thread after `delay`. Tasks
+        // with the same due time run in the order they were posted. Does not
+        // allocate once the loop has seen as many pending tasks before.
+        void post(TaskFunc func, void *arg, Clock::duration delay = Clock::duration::zero());
+        // Same for a std::function, which is moved to the heap until it ran.
+        void post(Task task, Clock::duration delay = Clock::duration::zero());
+
+        // Run tasks forever. Called by emscripten_exit_with_live_runtime(). The
+        // thread leaves the loop through pthread_exit (e.g. from a task).
+        [[noreturn]] void run();
+
+        // Run the tasks that are due right now and return.
+        void runPending();
+
+        // Loop of the calling thread.
+        static EventLoop &current();
+        // Loop of the given thread. Created on first use, so work can be posted
+        // to a thread before it started running its loop.
+        static EventLoop &of(pthread_t thread);
+
+    private:
+        struct Entry {
+            Clock::time_point due;
+            std::uint64_t sequence;
+            TaskFunc func;
+            void *arg;
+        };
+        // Orders the heap so that the earliest (due, sequence) is on top.
+        struct Later {
+            bool operator()(const Entry &a, const Entry &b) const {
+                return a.due != b.due ? a.due > b.due : a.sequence > b.sequence;
+            }
+        };
+
+        // Pops the next due task, waiting for one if `block` is set.
+        bool next(Entry &task, bool block);
+
+        std::mutex mMutex;
+        std::condition_variable mWakeup;
+        // Binary heap. Keeps its capacity, so posting is allocation free in
+        // steady state.
+        std::vector<Entry> mTasks;
+        std::uint64_t mSequence = 0;
+    };
+
+}// namespace host
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "common.hpp"
+#include <cstddef>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Compile time bindings for Javascript functions declared in C++.
+//
+// A Javascript function is declared as an extern "C" function whose last two
+// parameters are the callback and the status pointer:
+//
+//  extern "C" void log_data(const char *data, Utils::Completion *callback, int *statusPointer);
+//
+// A function that returns a value takes a Utils::JsReturn * in place of the
+// status pointer and resumes with one of the typed resume_execution_* entry
+// points instead.
+//
+// JsCall derives everything else from that declaration. The arguments given
+// at the call site are converted to the declared parameter types when the
+// call is built, so a wrong argument fails to compile instead of reaching
+// Javascript, and the converted values are stored inline in the JsCall, which
+// lives on the caller's stack. Nothing is allocated.
+namespace Utils {
+
+    namespace binding {
+
+        // Converts a call site argument to the type the function declares.
+        // Specialise it to accept more argument types for a parameter type.
+        template<typename Param>
+        struct Marshal {
+            template<typename Arg>
+            static Param to(Arg &&arg) { return std::forward<Arg>(arg); }
+        };
+
+        // Strings can be passed as std::string. The string must outlive the
+        // call, which it does for the blocking executors.
+        template<>
+        struct Marshal<const char *> {
+            static const char *to(const char *arg) { return arg; }
+            static const char *to(const std::string &arg) { return arg.c_str(); }
+        };
+
+        template<typename Tuple, typename Indices>
+        struct TupleHead;
+
+        template<typename Tuple, std::size_t... I>
+        struct TupleHead<Tuple, std::index_sequence<I...>> {
+            using type = std::tuple<std::remove_cv_t<std::tuple_element_t<I, Tuple>>...>;
+        };
+
+        // What the executors hand to the last parameter, given a JsReturn.
+        template<typename Last>
+        struct ReturnParam;
+
+        template<>
+        struct ReturnParam<int *> {
+            static int *from(JsReturn *ret) { return &ret->status; }
+        };
+
+        template<>
+        struct ReturnParam<JsReturn *> {
+            static JsReturn *from(JsReturn *ret) { return ret; }
+        };
+
+        template<typename Signature>
+        struct Traits;
+
+        template<typename... Params>
+        struct Traits<void(Params...)> {
+            static constexpr std::size_t kParams = sizeof...(Params);
+            static_assert(kParams >= 2,
+                          "a js function takes the callback and the status pointer as its last parameters");
+            using All = std::tuple<Params...>;
+            static_assert(std::is_same<std::remove_cv_t<std::tuple_element_t<kParams - 2, All>>, Completion *>::value,
+                          "the second to last parameter of a js function must be the callback (Utils::Completion *)");
+            using Last = std::remove_cv_t<std::tuple_element_t<kParams - 1, All>>;
+            static_assert(std::is_same<Last, int *>::value || std::is_same<Last, JsReturn *>::value,
+                          "the last parameter of a js function must be the status pointer (int *) or a Utils::JsReturn *");
+            // Whether the function returns a value through JsReturn.
+            static constexpr bool kReturnsValue = std::is_same<Last, JsReturn *>::value;
+
+            // The parameters the caller provides.
+            using Arguments = typename TupleHead<All, std::make_index_sequence<kParams - 2>>::type;
+            static constexpr std::size_t kArguments = kParams - 2;
+        };
+
+        // Function type of whatever is passed as the js function: a function,
+        // a reference to one or a pointer to one.
+        template<typename Func>
+        using SignatureOf = std::remove_pointer_t<std::decay_t<Func>>;
+
+    }// namespace binding
+
+    // One call of a Javascript function, with its arguments converted to the
+    // declared types.
+    template<typename Signature>
+    class JsCall {
+        using Traits = binding::Traits<Signature>;
+        using Arguments = typename Traits::Arguments;
+
+        Signature *mFunction;
+        Arguments mArguments;
+
+        template<std::size_t... I, typename... Args>
+        static Arguments marshalEach(std::index_sequence<I...>, Args &&...args) {
+            return Arguments(binding::Marshal<std::tuple_element_t<I, Arguments>>::to(std::forward<Args>(args))...);
+        }
+
+        template<typename... Args>
+        static Arguments marshal(Args &&...args) {
+            static_assert(sizeof...(Args) == Traits::kArguments,
+                          "wrong number of arguments for this js function");
+            return marshalEach(std::make_index_sequence<sizeof...(Args)>(), std::forward<Args>(args)...);
+        }
+
+        template<std::size_t... I>
+        void call(std::index_sequence<I...>, Completion *resume, JsReturn *ret) const {
+            mFunction(std::get<I>(mArguments)..., resume, binding::ReturnParam<typename Traits::Last>::from(ret));
+        }
+
+    public:
+        template<typename... Args>
+        explicit JsCall(Signature *function, Args &&...args)
+            : mFunction{function}, mArguments(marshal(std::forward<Args>(args)...)) {}
+
+        static constexpr bool kReturnsValue = Traits::kReturnsValue;
+
+        // Start the Javascript function. It resumes with `resume` once it is
+        // done, after writing its status, and value if it returns one, to `ret`.
+        void operator()(Completion *resume, JsReturn *ret) const {
+            call(std::make_index_sequence<Traits::kArguments>(), resume, ret);
+        }
+    };
+
+    // JsCall for the function passed to the executors.
+    template<typename Func>
+    using JsCallOf = JsCall<binding::SignatureOf<Func>>;
+
+}// namespace Utils
@@ -0,0 +1,279 @@
+#pragma once
+
+#include "common.hpp"
+#include "js_binding.hpp"
+#include "js_result.hpp"
+#include <atomic>
+#include <cassert>
+#include <coroutine>
+#include <cstddef>
+#include <emscripten/proxying.h>
+#include <exception>
+#include <future>
+#include <optional>
+#include <pthread.h>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+// Coroutines that await Javascript calls without holding a pthread each.
+//
+// Every coroutine runs on the pthread of a JsScheduler, which is also where the
+// Javascript functions they call run. An awaited call suspends the coroutine,
+// and resume_execution resumes it from that thread's event loop, so a single
+// pthread can have hundreds of calls outstanding:
+//
+//  Utils::coro::Task<std::int64_t> sizeOf(const char *key) {
+//      auto status = co_await Utils::coro::js_call(log_data, key);
+//      auto size = co_await Utils::coro::js_call<std::int64_t>(get_size, key);
+//      co_return status == Utils::OK && size ? size.value : -1;
+//  }
+//
+//  auto size = Utils::coro::JsScheduler::getScheduler().run(sizeOf("key"));
+//
+// Javascript state is per pthread. tf.js and the models loaded through tfjs.hpp
+// live on the QueuedSyncToAsync returner, not on the scheduler.
+namespace Utils::coro {
+
+    template<typename T>
+    class Task;
+
+    namespace detail {
+
+        struct PromiseBase {
+            std::coroutine_handle<> continuation = std::noop_coroutine();
+
+            // Hands control back to whoever awaited the task.
+            struct FinalAwaiter {
+                bool await_ready() const noexcept { return false; }
+                template<typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                    return handle.promise().continuation;
+                }
+                void await_resume() const noexcept {}
+            };
+
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+            FinalAwaiter final_suspend() const noexcept { return {}; }
+            void unhandled_exception() const noexcept { std::terminate(); }
+        };
+
+        template<typename T>
+        struct Promise : PromiseBase {
+            std::optional<T> value;
+
+            Task<T> get_return_object();
+            template<typename U>
+            void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
+            T take() { return std::move(*value); }
+        };
+
+        template<>
+        struct Promise<void> : PromiseBase {
+            Task<void> get_return_object();
+            void return_void() const noexcept {}
+            void take() const noexcept {}
+        };
+
+        // Started by JsScheduler::spawn. Owns itself and goes away when done.
+        struct Detached {
+            struct promise_type {
+                Detached get_return_object() {
+                    return Detached{std::coroutine_handle<promise_type>::from_promise(*this)};
+                }
+                std::suspend_always initial_suspend() const noexcept { return {}; }
+                std::suspend_never final_suspend() const noexcept { return {}; }
+                void return_void() const noexcept {}
+                void unhandled_exception() const noexcept { std::terminate(); }
+            };
+            std::coroutine_handle<promise_type> handle;
+        };
+
+    }// namespace detail
+
+    // Lazily started coroutine returning T. Runs when it is awaited, or when it
+    // is handed to JsScheduler::spawn or run.
+    template<typename T = void>
+    class [[nodiscard]] Task {
+    public:
+        using promise_type = detail::Promise<T>;
+
+        Task() = default;
+        explicit Task(std::coroutine_handle<promise_type> handle) : mHandle{handle} {}
+        Task(Task &&other) noexcept : mHandle{std::exchange(other.mHandle, {})} {}
+        Task &operator=(Task &&other) noexcept {
+            if (this != &other) {
+                if (mHandle) {
+                    mHandle.destroy();
+                }
+                mHandle = std::exchange(other.mHandle, {});
+            }
+            return *this;
+        }
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+        ~Task() {
+            if (mHandle) {
+                mHandle.destroy();
+            }
+        }
+
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            mHandle.promise().continuation = awaiting;
+            return mHandle;
+        }
+        T await_resume() { return mHandle.promise().take(); }
+
+    private:
+        std::coroutine_handle<promise_type> mHandle;
+    };
+
+    template<typename T>
+    Task<T> detail::Promise<T>::get_return_object() {
+        return Task<T>{std::coroutine_handle<Promise<T>>::from_promise(*this)};
+    }
+
+    inline Task<void> detail::Promise<void>::get_return_object() {
+        return Task<void>{std::coroutine_handle<Promise<void>>::from_promise(*this)};
+    }
+
+    // Awaitable call of a Javascript function, see js_call. The call and its
+    // return value live in the awaiting coroutine's frame.
+    template<typename Call, typename T>
+    class JsAwaitable {
+    public:
+        template<typename Func, typename... Args>
+        JsAwaitable(JsArena *arena, Func &&func, Args &&...args)
+            : mCall(func, std::forward<Args>(args)...), mArena{arena} {}
+        JsAwaitable(const JsAwaitable &) = delete;
+        JsAwaitable &operator=(const JsAwaitable &) = delete;
+
+        bool await_ready() const noexcept { return false; }
+
+        // Returns false, so the coroutine carries on right away, if
+        // Javascript resumed before the call returned.
+        bool await_suspend(std::coroutine_handle<> handle) {
+            mHandle = handle;
+            if (mArena != nullptr) {
+                mArena->attach(mReturn);
+            }
+            mStarting = true;
+            mCall(&mResume, &mReturn);
+            mStarting = false;
+            return !mResumedEarly;
+        }
+
+        auto await_resume() {
+            if constexpr (std::is_void_v<T>) {
+                return static_cast<JsResultStatus>(mReturn.status);
+            } else {
+                return Utils::detail::result_of<T>(mReturn, mArena);
+            }
+        }
+
+    private:
+        static void resume(void *context) {
+            auto *self = static_cast<JsAwaitable *>(context);
+            if (self->mStarting) {
+                self->mResumedEarly = true;
+                return;
+            }
+            self->mHandle.resume();
+        }
+
+        Call mCall;
+        JsArena *mArena;
+        JsReturn mReturn;
+        Completion mResume{&JsAwaitable::resume, this};
+        std::coroutine_handle<> mHandle;
+        bool mStarting = false;
+        bool mResumedEarly = false;
+    };
+
+    // Call a Javascript function from a coroutine running on a JsScheduler.
+    // Without T the result is the JsResultStatus, with T the function must
+    // return a value (see js_result.hpp) and the result is a JsResult<T>.
+    //
+    //  auto status = co_await js_call(long_running_func, 100);
+    //  auto half = co_await js_call<double>(half_f64, 7);
+    template<typename T = void, typename Func, typename... Args>
+    JsAwaitable<JsCallOf<Func>, T> js_call(Func &&func, Args &&...args) {
+        if constexpr (!std::is_void_v<T>) {
+            static_assert(!Utils::detail::ReturnValue<T>::kPayload, "pass a JsArena to receive bytes or strings");
+            static_assert(JsCallOf<Func>::kReturnsValue, "the js function does not return a value");
+        }
+        return {nullptr, func, std::forward<Args>(args)...};
+    }
+
+    // js_call for a byte or string payload, which is written to `arena`. The
+    // arena must not be shared by calls that are outstanding at the same time.
+    template<typename T, typename Func, typename... Args>
+    JsAwaitable<JsCallOf<Func>, T> js_call(JsArena &arena, Func &&func, Args &&...args) {
+        static_assert(JsCallOf<Func>::kReturnsValue, "the js function does not return a value");
+        return {&arena, func, std::forward<Args>(args)...};
+    }
+
+    // One pthread that runs coroutines and the Javascript calls they await.
+    class JsScheduler {
+    public:
+        JsScheduler();
+        // Tasks that are still waiting for Javascript are leaked.
+        ~JsScheduler();
+        JsScheduler(const JsScheduler &) = delete;
+        JsScheduler &operator=(const JsScheduler &) = delete;
+
+        // Start the task on the scheduler thread and return right away.
+        void spawn(Task<void> task);
+
+        // Run the task on the scheduler thread and wait for its result. Must
+        // not be called from the scheduler thread.
+        template<typename T>
+        T run(Task<T> task);
+
+        // Number of spawned tasks that did not finish yet.
+        std::size_t active() const { return mActive.load(); }
+
+        bool onSchedulerThread() const { return std::this_thread::get_id() == mThread.get_id(); }
+
+        // Shared scheduler, created on first use.
+        static JsScheduler &getScheduler();
+
+    private:
+        static detail::Detached drive(Task<void> task, JsScheduler *scheduler);
+        template<typename T>
+        static Task<void> deliver(Task<T> task, std::promise<T> &result);
+        static void start(void *handle);
+
+        static void *threadMain(void *typeErasedMe) {
+            auto *typedMe = static_cast<JsScheduler *>(typeErasedMe);
+            typedMe->mQueue.execute();
+            emscripten_exit_with_live_runtime();
+        }
+
+        emscripten::ProxyingQueue mQueue;
+        std::atomic<std::size_t> mActive{0};
+        // Declared last so that the queue exists before the thread runs.
+        std::thread mThread;
+    };
+
+    template<typename T>
+    Task<void> JsScheduler::deliver(Task<T> task, std::promise<T> &result) {
+        if constexpr (std::is_void_v<T>) {
+            co_await task;
+            result.set_value();
+        } else {
+            result.set_value(co_await task);
+        }
+    }
+
+    template<typename T>
+    T JsScheduler::run(Task<T> task) {
+        assert(!onSchedulerThread());
+        std::promise<T> result;
+        auto future = result.get_future();
+        spawn(deliver(std::move(task), result));
+        return future.get();
+    }
+
+}// namespace Utils::coro
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <emscripten.h>
+#include "common.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Values returned by Javascript functions.
+//
+// A Javascript function that returns a value is declared with a
+// Utils::JsReturn * in place of the status pointer
+//
+//  extern "C" void model_output_shape(int modelId, Utils::Completion *callback, Utils::JsReturn *ret);
+//
+// and resumes through one of the js_resume_* helpers of js_functions.js,
+// which pass the value along with the status in the same crossing:
+//
+//  js_resume_i64(callback, ret, 0, 42);
+//  js_resume_f64(callback, ret, 0, 0.5);
+//  js_resume_bytes(callback, ret, 0, new Int32Array([1, 2, 3]));
+//  js_resume_string(callback, ret, 0, 'text');
+//
+// Scalars travel inside JsReturn. Byte and string payloads are copied by the
+// Javascript side into a caller owned JsArena, so the executors don't allocate
+// for them either.
+namespace Utils {
+
+#ifdef __EMSCRIPTEN__
+    static_assert(offsetof(JsReturn, arena) == 8 && offsetof(JsReturn, capacity) == 12,
+                  "js_resume_bytes in js_functions.js reads the arena at these offsets");
+#endif
+
+    // Buffer that byte and string results are written to. Keep one per thread
+    // or per call site and reuse it, it is only read and written by the call
+    // it is passed to.
+    class JsArena {
+    public:
+        static constexpr std::size_t kDefaultCapacity = 4096;
+
+        explicit JsArena(std::size_t capacity = kDefaultCapacity) : mBuffer(capacity) {}
+
+        // Grow the arena to hold at least `capacity` bytes.
+        void reserve(std::size_t capacity) {
+            if (capacity > mBuffer.size()) {
+                mBuffer.resize(capacity);
+            }
+        }
+
+        const unsigned char *data() const { return mBuffer.data(); }
+        std::size_t capacity() const { return mBuffer.size(); }
+
+        // Size of the last payload that did not fit, 0 if it did. Reserve
+        // that much and call again.
+        std::size_t required() const { return mRequired; }
+
+        // Point `ret` at this arena, before the call.
+        void attach(JsReturn &ret) {
+            mRequired = 0;
+            ret.arena = mBuffer.data();
+            ret.capacity = static_cast<std::uint32_t>(
+                    std::min<std::size_t>(mBuffer.size(), std::numeric_limits<std::uint32_t>::max()));
+        }
+
+        // Take note of what the call returned.
+        void settle(const JsReturn &ret) {
+            if (ret.kind == BYTES && ret.size > ret.capacity) {
+                mRequired = ret.size;
+            }
+        }
+
+    private:
+        std::vector<unsigned char> mBuffer;
+        std::size_t mRequired = 0;
+    };
+
+    // Byte payload returned by a Javascript function. Points into the JsArena
+    // it was returned in and is valid until the arena is used again.
+    struct JsBytes {
+        const unsigned char *data = nullptr;
+        std::size_t size = 0;
+    };
+
+    // Status and value of a call to a Javascript function that returns a
+    // value. The value is only set if the status is OK.
+    //
+    // T is std::int64_t or double for scalars, JsBytes or std::string for
+    // payloads.
+    template<typename T>
+    struct JsResult {
+        JsResultStatus status = JsResultStatus::NOT_STARTED;
+        T value{};
+
+        bool ok() const { return status == JsResultStatus::OK; }
+        explicit operator bool() const { return ok(); }
+    };
+
+    namespace detail {
+
+        // Reads a T out of a JsReturn. Returns false if the function returned
+        // another kind of value, or a payload that did not fit.
+        template<typename T>
+        struct ReturnValue;
+
+        template<>
+        struct ReturnValue<std::int64_t> {
+            static constexpr bool kPayload = false;
+            static bool read(const JsReturn &ret, std::int64_t &value) {
+                if (ret.kind != I64) {
+                    return false;
+                }
+                value = ret.i64;
+                return true;
+            }
+        };
+
+        template<>
+        struct ReturnValue<double> {
+            static constexpr bool kPayload = false;
+            static bool read(const JsReturn &ret, double &value) {
+                if (ret.kind == F64) {
+                    value = ret.f64;
+                    return true;
+                }
+                if (ret.kind == I64) {
+                    value = static_cast<double>(ret.i64);
+                    return true;
+                }
+                return false;
+            }
+        };
+
+        template<>
+        struct ReturnValue<JsBytes> {
+            static constexpr bool kPayload = true;
+            static bool read(const JsReturn &ret, JsBytes &value) {
+                if (ret.kind != BYTES || ret.size > ret.capacity) {
+                    return false;
+                }
+                value = JsBytes{ret.arena, ret.size};
+                return true;
+            }
+        };
+
+        template<>
+        struct ReturnValue<std::string> {
+            static constexpr bool kPayload = true;
+            static bool read(const JsReturn &ret, std::string &value) {
+                JsBytes bytes;
+                if (!ReturnValue<JsBytes>::read(ret, bytes)) {
+                    return false;
+                }
+                value.assign(reinterpret_cast<const char *>(bytes.data), bytes.size);
+                return true;
+            }
+        };
+
+        template<typename T>
+        JsResult<T> result_of(const JsReturn &ret, JsArena *arena) {
+            if (arena != nullptr) {
+                arena->settle(ret);
+            }
+            JsResult<T> result;
+            result.status = static_cast<JsResultStatus>(ret.status);
+            if (result.status == JsResultStatus::OK && !ReturnValue<T>::read(ret, result.value)) {
+                result.status = JsResultStatus::ERROR;
+            }
+            return result;
+        }
+
+    }// namespace detail
+
+}// namespace Utils
+
+extern "C" {
+// Typed variants of resume_execution, called through the js_resume_* helpers
+// in js_functions.js. Each stores the value in `ret` along with the status and
+// then resumes like resume_execution.
+//
+// The 64 bit integer is passed as two 32 bit halves, which works with and
+// without WASM_BIGINT.
+void EMSCRIPTEN_KEEPALIVE resume_execution_i64(
+        Utils::Completion *callback,
+        Utils::JsReturn *ret,
+        int status,
+        std::uint32_t low,
+        std::uint32_t high);
+
+void EMSCRIPTEN_KEEPALIVE resume_execution_f64(
+        Utils::Completion *callback,
+        Utils::JsReturn *ret,
+        int status,
+        double value);
+
+// The payload was already copied to ret->arena, if it fit in ret->capacity.
+void EMSCRIPTEN_KEEPALIVE resume_execution_bytes(
+        Utils::Completion *callback,
+        Utils::JsReturn *ret,
+        int status,
+        std::uint32_t size);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Image preprocessing ahead of tfjs::predict. The kernels write float32
+// straight into the buffer that is handed to predict, e.g. the input of a
+// tfjs::StagingArena slot, so the frame is converted once and tf.js gets the
+// values as they are:
+//
+//  auto slot = tfjs::staging().borrow();
+//  tfjs::preprocess::resize_bilinear(frame, 480, 640, 3, resized, 224, 224);
+//  tfjs::preprocess::normalize(resized, 224 * 224, 3, mean, stddev, resized);
+//  tfjs::preprocess::hwc_to_chw(resized, 224, 224, 3, slot.input());
+//
+// Images are interleaved (HWC) unless the name says otherwise. The kernels use
+// wasm simd128 (built with -msimd128) or SSE2, and fall back to the scalar
+// versions in tfjs::preprocess::scalar elsewhere or with
+// TFJS_PREPROCESS_SIMD=OFF.
+namespace tfjs::preprocess {
+
+    // True if the kernels below were built with SIMD.
+    bool simd();
+
+    // dst[i] = src[i] * scale + offset, e.g. the default maps 0..255 to 0..1.
+    void convert(const std::uint8_t *src, std::size_t count, float *dst, float scale = 1.0f / 255.0f, float offset = 0.0f);
+
+    // dst = (src - mean[c]) / stddev[c] for every channel c of `pixels`
+    // interleaved pixels. dst may be src.
+    void normalize(const float *src, std::size_t pixels, int channels, const float *mean, const float *stddev, float *dst);
+    // Same from 8 bit pixels in one pass, with mean and stddev on the 0..255 scale.
+    void normalize(const std::uint8_t *src, std::size_t pixels, int channels, const float *mean, const float *stddev, float *dst);
+
+    // Bilinear resize to dstHeight x dstWidth, sampled like tf.image.resizeBilinear
+    // without alignCorners and halfPixelCenters, so the result matches tf.js.
+    void resize_bilinear(const std::uint8_t *src, int srcHeight, int srcWidth, int channels,
+                         float *dst, int dstHeight, int dstWidth);
+
+    // Reorder HWC into planar CHW, as NCHW models expect.
+    void hwc_to_chw(const float *src, int height, int width, int channels, float *dst);
+
+    // Plain C++ versions of the kernels, the reference the SIMD ones are
+    // tested against.
+    namespace scalar {
+        void convert(const std::uint8_t *src, std::size_t count, float *dst, float scale = 1.0f / 255.0f, float offset = 0.0f);
+        void normalize(const float *src, std::size_t pixels, int channels, const float *mean, const float *stddev, float *dst);
+        void normalize(const std::uint8_t *src, std::size_t pixels, int channels, const float *mean, const float *stddev, float *dst);
+        void resize_bilinear(const std::uint8_t *src, int srcHeight, int srcWidth, int channels,
+                             float *dst, int dstHeight, int dstWidth);
+        void hwc_to_chw(const float *src, int height, int width, int channels, float *dst);
+    }// namespace scalar
+
+}// namespace tfjs::preprocess
@@ -1,30 +1,219 @@
 #pragma once
 
+#include "bridge_trace.hpp"
 #include "common.hpp"
+#include "completion_wait.hpp"
 #include "sync_to_async.hpp"
+#include <array>
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <emscripten/proxying.h>
 // https://github.com/emscripten-core/emscripten/blob/main/tests/pthread/test_pthread_proxying_cpp.cpp
 // https://emscripten.org/docs/api_reference/proxying.h.html
 #include <functional>
 #include <iostream>
 #include <mutex>
+#include <vector>
+
+// Maximum number of calls that can be waiting for Javascript at the same time.
+// Further callers block until one of the outstanding calls completes.
+#ifndef QUEUED_SYNC_TO_ASYNC_MAX_IN_FLIGHT
+#define QUEUED_SYNC_TO_ASYNC_MAX_IN_FLIGHT 64
+#endif
+
+// Default for QueuedSyncToAsync::setBulkAging.
+#ifndef QUEUED_SYNC_TO_ASYNC_BULK_AGING_MS
+#define QUEUED_SYNC_TO_ASYNC_BULK_AGING_MS 50
+#endif
+
+// Calls the returner starts before it goes back to its event loop, so a long
+// lane doesn't keep other work on the returner waiting.
+#ifndef QUEUED_SYNC_TO_ASYNC_DRAIN_BATCH
+#define QUEUED_SYNC_TO_ASYNC_DRAIN_BATCH 32
+#endif
 
 // See tests/test_tfjs.cpp for usages and tests/js_includes.cpp / tests/js_functions.js for example functions
 namespace Utils {
 
+    class QueuedSyncToAsync;
+
+    // Priority class of a call on a QueuedSyncToAsync. Calls start on the
+    // returner one at a time, and waiting INTERACTIVE calls go before waiting
+    // BULK ones, unless the oldest BULK call has waited past the bulk aging
+    // limit. Model loads and imports are BULK, everything else INTERACTIVE.
+    enum class Lane : int {
+        INTERACTIVE = 0,
+        BULK = 1
+    };
+
+    // Calls from the constructing thread go through `lane` until the scope ends.
+    //
+    // eg:
+    //  {
+    //      Utils::ScopedLane bulk(Utils::Lane::BULK);
+    //      queued_js_executor(load_graph_model_from_path, id, "model.json");
+    //  }
+    class ScopedLane {
+        Lane mPrevious;
+
+    public:
+        explicit ScopedLane(Lane lane);
+        ~ScopedLane();
+        ScopedLane(const ScopedLane &) = delete;
+        void operator=(const ScopedLane &) = delete;
+    };
+
+    // Lane of the calls made by this thread.
+    Lane current_lane();
+
+    // Queue statistics of one lane of a QueuedSyncToAsync.
+    struct LaneStats {
+        // Calls waiting to start right now.
+        std::size_t depth = 0;
+        // Largest depth seen.
+        std::size_t maxDepth = 0;
+        // Calls started.
+        std::uint64_t started = 0;
+        // BULK calls that started ahead of waiting INTERACTIVE ones because they aged.
+        std::uint64_t aged = 0;
+        // Calls whose deadline passed while they waited, finished with TIMEOUT.
+        std::uint64_t expired = 0;
+        // Longest time a call waited to start.
+        std::chrono::microseconds maxWait{0};
+    };
+
+    // Handle to a Javascript call started with queued_js_submit. The call keeps
+    // running on the returner whether or not anybody waits for it. Waiting hands
+    // the completion slot back, and so does destroying a handle whose call has
+    // not finished yet, as soon as Javascript resumes it.
+    //
+    // Handles are move only and must not be waited on from several threads at once.
+    class JsCallHandle {
+        friend class QueuedSyncToAsync;
+        friend std::size_t wait_any(std::vector<JsCallHandle> &handles);
+
+        QueuedSyncToAsync *mInvoker = nullptr;
+        std::size_t mSlot = 0;
+        // Status and value, copied out of the slot when it is collected.
+        JsReturn mReturn;
+
+        JsCallHandle(QueuedSyncToAsync *invoker, std::size_t slot) : mInvoker{invoker}, mSlot{slot} {}
+        // A call that never started, e.g. one turned away with BUSY.
+        explicit JsCallHandle(JsResultStatus status) { mReturn.status = status; }
+        // Give the slot back and remember its status and value.
+        void collect();
+        const JsReturn &returned() const { return mReturn; }
+
+    public:
+        JsCallHandle() = default;
+        JsCallHandle(JsCallHandle &&other) noexcept;
+        JsCallHandle &operator=(JsCallHandle &&other) noexcept;
+        JsCallHandle(const JsCallHandle &) = delete;
+        JsCallHandle &operator=(const JsCallHandle &) = delete;
+        ~JsCallHandle();
+
+        // True once Javascript resumed the call (or it could not be started).
+        bool ready() const;
+
+        // Block until the call finished and return its status. Can be called
+        // repeatedly, later calls return the same status.
+        JsResultStatus wait();
+
+        // Block until the call finished or the timeout expired. Returns ready().
+        template<typename Rep, typename Period>
+        bool wait_for(const std::chrono::duration<Rep, Period> &timeout);
+        bool wait_until(std::chrono::steady_clock::time_point deadline);
+    };
+
     class QueuedSyncToAsync {
-        std::thread mReturner;
+        friend class JsCallHandle;
+
+        // Everything a single invocation needs to get its own result back.
+        // Javascript is handed pointers to `resume` and `ret`, so a resume
+        // only ever wakes the caller that owns the slot.
+        enum SlotState : std::uint32_t {
+            PENDING = 0,
+            // Javascript is done, or the call could not be started.
+            DONE,
+            // The handle went away before the call finished. The slot is then
+            // released by `resume`.
+            DETACHED
+        };
+
+        struct CompletionSlot {
+            // Status, and value for functions that return one. Javascript is
+            // handed &ret.status or &ret, depending on the declaration.
+            JsReturn ret;
+            // The caller sleeps on this word until `resume` moves it to DONE,
+            // and is the only thread it wakes.
+            std::atomic<std::uint32_t> state{PENDING};
+            // Completes this slot, see resumeSlot.
+            Completion resume;
+            QueuedSyncToAsync *owner = nullptr;
+            std::size_t index = 0;
+#if SYNC_TO_ASYNC_TRACING
+            trace::CallTrace trace;
+#endif
+        };
+
+        enum StartPhase : std::uint32_t {
+            WAITING = 0,
+            STARTED,
+            FAILED,
+            EXPIRED
+        };
+
+        // A call waiting for its turn on the returner. Lives on the caller's
+        // stack and is linked into the queue of its lane, so queueing does
+        // not allocate.
+        struct PendingStart {
+            void (*run)(void *);
+            void *arg;
+            Lane lane;
+            std::chrono::steady_clock::time_point queued;
+            // Not started once this passed.
+            std::chrono::steady_clock::time_point deadline;
+            PendingStart *next = nullptr;
+            // WAITING until `run` returned (STARTED), the returner could not
+            // be reached (FAILED) or the deadline passed first (EXPIRED). The
+            // caller sleeps on it.
+            std::atomic<std::uint32_t> phase{WAITING};
+        };
+
+        struct LaneQueue {
+            PendingStart *head = nullptr;
+            PendingStart *tail = nullptr;
+            LaneStats stats;
+        };
+
         emscripten::ProxyingQueue mQueue;
+        // Guards the lanes, the aging limit and mDraining.
+        std::mutex mLaneMutex;
+        std::array<LaneQueue, 2> mLanes;
+        std::chrono::steady_clock::duration mBulkAging = std::chrono::milliseconds(QUEUED_SYNC_TO_ASYNC_BULK_AGING_MS);
+        // A drainLanes task is queued or running on the returner.
+        bool mDraining = false;
+        // Guards the slot table.
         std::mutex mMutex;
-        std::condition_variable mCond;
-        std::function<void()> mResume;
-
-        // We are making this int instead of JsResultStatus to pass the reference
-        // to Javascript
-        int mStatus;
+        std::condition_variable mSlotFreed;
+        std::array<CompletionSlot, QUEUED_SYNC_TO_ASYNC_MAX_IN_FLIGHT> mSlots;
+        std::vector<std::size_t> mFreeSlots;
+        // Slots in use, readable without the lock.
+        std::atomic<std::size_t> mOutstanding{0};
+        // Limits, see setMaxInFlight and setMaxWaiting, and the counters of
+        // queueStats. Guarded by mMutex.
+        std::size_t mMaxInFlight = QUEUED_SYNC_TO_ASYNC_MAX_IN_FLIGHT;
+        std::size_t mMaxWaiting = SIZE_MAX;
+        std::size_t mWaiting = 0;
+        std::size_t mPeakWaiting = 0;
+        std::uint64_t mRejected = 0;
+        // Declared last so that the queue and the slots exist before the
+        // returner starts executing work.
+        std::thread mReturner;
 
         // This will be the function that's running in the thread.
         // We pass a reference to ourselves as argument.
@@ -34,20 +223,117 @@ namespace Utils {
             emscripten_exit_with_live_runtime();
         }
 
-        bool funcProducedResult() const { return mStatus == OK || mStatus == ERROR; }
+        // Reserve a completion slot. If all of them are in use, wait for one
+        // until the deadline, unless `wait` is false or the waiting limit is
+        // reached. Returns OK, BUSY or TIMEOUT.
+        JsResultStatus acquireSlot(std::size_t &index, bool wait = true,
+                                   std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+        // A slot is free within the in flight limit. Called with mMutex held.
+        bool slotAvailable() const;
+        void releaseSlot(std::size_t index);
+        // Called through the slot's `resume` once Javascript is done.
+        void completeSlot(std::size_t index);
+        static void resumeSlot(void *slot);
+        // Mark a slot that could not be started as finished with `status`.
+        void abandonSlot(std::size_t index, JsResultStatus status);
+        bool slotDone(std::size_t index);
+        // Block until Javascript resumed the given slot, or until the deadline.
+        void waitForSlot(std::size_t index);
+        bool waitForSlotUntil(std::size_t index, std::chrono::steady_clock::time_point deadline);
+        // Release the slot now if it is done, else once Javascript resumes it.
+        void detachSlot(std::size_t index);
 
-        QueuedSyncToAsync();
-        ~QueuedSyncToAsync();
+        // Run `run(arg)` on the returner, in lane order behind the calls that
+        // are already waiting. Returns OK once it ran, TIMEOUT if the deadline
+        // passed before its turn came, or NOT_STARTED if the returner could
+        // not be reached.
+        JsResultStatus runOnReturner(void (*run)(void *), void *arg, std::chrono::steady_clock::time_point deadline);
+        // Queue a drainLanes task. Called with mLaneMutex held and mDraining set.
+        void postDrain(std::unique_lock<std::mutex> &lock);
+        // Next call to start, or nullptr. Called with mLaneMutex held.
+        PendingStart *popPending();
+        // Starts the waiting calls one after the other, on the returner, up
+        // to QUEUED_SYNC_TO_ASYNC_DRAIN_BATCH of them per task.
+        static void drainLanes(void *me);
+
+        // Run the function on the returner with the given slot, unless the
+        // deadline passes while it waits for its turn.
+        template<typename Func, typename... Args>
+        JsCallHandle start(std::size_t index, std::uint64_t traceStart, std::chrono::steady_clock::time_point deadline,
+                           Func &&func, Args... args);
+        // Blocking call of a function that returns a value.
+        template<typename T, typename Func, typename... Args>
+        JsResult<T> callInto(JsArena *arena, Func &&func, Args... args);
 
     public:
+        // Starts a returner thread with its own Javascript scope. Most code
+        // should use getInvoker(); extra instances are for spreading work over
+        // more threads, see ShardedSyncToAsync.
+        QueuedSyncToAsync();
+        ~QueuedSyncToAsync();
         QueuedSyncToAsync(const QueuedSyncToAsync &) = delete;
         void operator=(const QueuedSyncToAsync &) = delete;
-        using Callback = std::function<void()> *;
+        using Callback = Completion *;
 
-        // We pass our function and arguments to this function
+        // We pass our function and arguments to this function.
+        // It is safe to call this from multiple threads. Every call gets its own
+        // completion slot, so many Javascript operations can be outstanding on the
+        // returner at once.
         template<typename Func, typename... Args>
         JsResultStatus invoke(Func &&func, Args... args);
 
+        // invoke with a deadline. Returns JsResultStatus::TIMEOUT if no slot
+        // was free or Javascript did not resume the call in time. The call then
+        // keeps its slot until Javascript resumes it, and that late resume only
+        // hands the slot back. Pointer arguments the function writes to
+        // asynchronously must stay valid until it settles.
+        template<typename Func, typename... Args>
+        JsResultStatus invoke_until(std::chrono::steady_clock::time_point deadline, Func &&func, Args... args);
+
+        template<typename Rep, typename Period, typename Func, typename... Args>
+        JsResultStatus invoke_for(const std::chrono::duration<Rep, Period> &timeout, Func &&func, Args... args);
+
+        // Start the function and return as soon as it began executing on the
+        // returner, without waiting for it to resume. Pointer arguments only
+        // need to stay valid until submit returns, the same as for invoke.
+        template<typename Func, typename... Args>
+        JsCallHandle submit(Func &&func, Args... args);
+
+        // invoke that does not wait for a completion slot. Returns
+        // JsResultStatus::BUSY right away if every slot allowed by
+        // setMaxInFlight is taken, so the caller can shed the call or fall
+        // back to something else.
+        template<typename Func, typename... Args>
+        JsResultStatus try_invoke(Func &&func, Args... args);
+
+        // invoke for a function that returns a scalar, declared with a
+        // Utils::JsReturn * as its last parameter (see js_result.hpp). The
+        // value comes back with the status, in the same crossing.
+        template<typename T, typename Func, typename... Args>
+        JsResult<T> call(Func &&func, Args... args);
+
+        // call for a byte or string payload, which Javascript writes to `arena`.
+        template<typename T, typename Func, typename... Args>
+        JsResult<T> call(JsArena &arena, Func &&func, Args... args);
+
+        // Number of calls holding a completion slot, finished or not.
+        std::size_t outstanding() const { return mOutstanding.load(std::memory_order_relaxed); }
+
+        // Calls that may hold a completion slot at once, 1 to
+        // QUEUED_SYNC_TO_ASYNC_MAX_IN_FLIGHT (the default).
+        void setMaxInFlight(std::size_t count);
+        // Callers that may wait for a slot at once. Calls beyond it return
+        // JsResultStatus::BUSY (or a handle that does) instead of blocking.
+        // Unlimited by default.
+        void setMaxWaiting(std::size_t count);
+        QueueStats queueStats();
+
+        // BULK calls that waited this long start ahead of INTERACTIVE ones, so
+        // bulk work keeps moving under a steady interactive load.
+        void setBulkAging(std::chrono::steady_clock::duration aging);
+
+        LaneStats laneStats(Lane lane);
+
         // We use a static instance to reuse thread throughout the application
         // Else deadlock is oberved if new instances are created in rapid succession
         // for example in a loop
@@ -59,29 +345,201 @@ namespace Utils {
         return QueuedSyncToAsync::getInvoker().template invoke(std::forward<Func &&>(func), std::forward<Args>(args)...);
     }
 
+    // queued_js_executor that returns JsResultStatus::BUSY instead of waiting
+    // when the invoker is full.
+    //
+    // eg:
+    //  if (try_queued_js_executor(log_data, "frame done") == Utils::BUSY) { dropped++; }
+    template<typename Func, typename... Args>
+    JsResultStatus try_queued_js_executor(Func &&func, Args... args) {
+        return QueuedSyncToAsync::getInvoker().try_invoke(std::forward<Func &&>(func), std::forward<Args>(args)...);
+    }
+
+    // queued_js_executor that gives up after `timeout` with JsResultStatus::TIMEOUT.
+    //
+    // eg:
+    //  auto status = queued_js_executor_for(std::chrono::seconds(5), load_graph_model_from_path, id, "model.json");
+    template<typename Rep, typename Period, typename Func, typename... Args>
+    JsResultStatus queued_js_executor_for(const std::chrono::duration<Rep, Period> &timeout, Func &&func, Args... args) {
+        return QueuedSyncToAsync::getInvoker().invoke_for(timeout, std::forward<Func &&>(func), std::forward<Args>(args)...);
+    }
+
+    template<typename Func, typename... Args>
+    JsResultStatus queued_js_executor_until(std::chrono::steady_clock::time_point deadline, Func &&func, Args... args) {
+        return QueuedSyncToAsync::getInvoker().invoke_until(deadline, std::forward<Func &&>(func), std::forward<Args>(args)...);
+    }
+
+    // queued_js_executor for a Javascript function that returns a value.
+    //
+    // eg:
+    //  auto bytes = queued_js_call<std::int64_t>(get_size, "key");
+    //  JsArena arena;
+    //  auto name = queued_js_call<std::string>(arena, get_name, id);
+    //  if (name) { use(name.value); }
+    template<typename T, typename Func, typename... Args>
+    JsResult<T> queued_js_call(Func &&func, Args... args) {
+        return QueuedSyncToAsync::getInvoker().template call<T>(std::forward<Func &&>(func), std::forward<Args>(args)...);
+    }
+
+    template<typename T, typename Func, typename... Args>
+    JsResult<T> queued_js_call(JsArena &arena, Func &&func, Args... args) {
+        return QueuedSyncToAsync::getInvoker().template call<T>(arena, std::forward<Func &&>(func), std::forward<Args>(args)...);
+    }
+
+    // Non-blocking version of queued_js_executor. Use the handle with wait,
+    // wait_for, wait_any or wait_all to collect the status.
+    //
+    // eg:
+    //  auto load = queued_js_submit(load_graph_model_from_path, "detector", "model.json");
+    //  auto log = queued_js_submit(log_data, "loading detector");
+    //  std::vector<JsCallHandle> handles;
+    //  handles.push_back(std::move(load));
+    //  handles.push_back(std::move(log));
+    //  wait_all(handles);
+    template<typename Func, typename... Args>
+    JsCallHandle queued_js_submit(Func &&func, Args... args) {
+        return QueuedSyncToAsync::getInvoker().template submit(std::forward<Func &&>(func), std::forward<Args>(args)...);
+    }
+
+    inline JsResultStatus wait(JsCallHandle &handle) { return handle.wait(); }
+
+    template<typename Rep, typename Period>
+    bool wait_for(JsCallHandle &handle, const std::chrono::duration<Rep, Period> &timeout) {
+        return handle.wait_for(timeout);
+    }
+
+    // Block until at least one of the handles is ready and return its index.
+    // Handles that were already waited on, or never started, are skipped, so
+    // calling it until it returns handles.size() visits every call once.
+    std::size_t wait_any(std::vector<JsCallHandle> &handles);
+
+    // Block until every handle is ready.
+    void wait_all(std::vector<JsCallHandle> &handles);
+
 }// namespace Utils
 
+template<typename Rep, typename Period>
+bool Utils::JsCallHandle::wait_for(const std::chrono::duration<Rep, Period> &timeout) {
+    return wait_until(std::chrono::steady_clock::now() +
+                      std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+}
+
 template<typename Func, typename... Args>
 Utils::JsResultStatus Utils::QueuedSyncToAsync::invoke(Func &&func, Args... args) {
-    mStatus = JsResultStatus::NOT_STARTED;
-    {
-        // I didn't observe any difference in proxySync and proxyAsync in local testing
-        // but to make sure function started executing and not just enqueued I am going
-        // with proxySync
-        auto executed = mQueue.proxySync(mReturner.native_handle(), [&]() {
-
-            // We will add reference to our resume function which unlocks the thread, and
-            // reference to status variable which can be set appropriately once the function
-            // is executed.
-            func(std::forward<Args>(args)..., &mResume, &mStatus);
-        });
-        if (executed) {
-            // If emscripten failed to execute the function, mStatus will never change
-            // To avoid deadlock lock only if function is executed. Else return NOT_STARTED
-            // Caller should check status and figure out why the call failed.
-            std::unique_lock<std::mutex> lock(mMutex);
-            mCond.wait(lock, [&]() { return funcProducedResult(); });
-        }
+    return submit(std::forward<Func &&>(func), std::forward<Args>(args)...).wait();
+}
+
+template<typename Func, typename... Args>
+Utils::JsResultStatus Utils::QueuedSyncToAsync::invoke_until(std::chrono::steady_clock::time_point deadline, Func &&func, Args... args) {
+    std::uint64_t traceStart = 0;
+    SYNC_TO_ASYNC_TRACE(traceStart = trace::now_ns());
+    std::size_t index;
+    auto acquired = acquireSlot(index, true, deadline);
+    if (acquired != JsResultStatus::OK) {
+        return acquired;
+    }
+    auto handle = start(index, traceStart, deadline, std::forward<Func &&>(func), std::forward<Args>(args)...);
+    if (!handle.wait_until(deadline)) {
+        // Dropping the handle detaches the slot, see detachSlot.
+        return JsResultStatus::TIMEOUT;
+    }
+    return handle.wait();
+}
+
+template<typename Rep, typename Period, typename Func, typename... Args>
+Utils::JsResultStatus Utils::QueuedSyncToAsync::invoke_for(const std::chrono::duration<Rep, Period> &timeout, Func &&func, Args... args) {
+    return invoke_until(std::chrono::steady_clock::now() +
+                                std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout),
+                        std::forward<Func &&>(func), std::forward<Args>(args)...);
+}
+
+template<typename Func, typename... Args>
+Utils::JsCallHandle Utils::QueuedSyncToAsync::submit(Func &&func, Args... args) {
+    std::uint64_t traceStart = 0;
+    SYNC_TO_ASYNC_TRACE(traceStart = trace::now_ns());
+    std::size_t index;
+    auto acquired = acquireSlot(index);
+    if (acquired != JsResultStatus::OK) {
+        return JsCallHandle{acquired};
+    }
+    return start(index, traceStart, std::chrono::steady_clock::time_point::max(),
+                 std::forward<Func &&>(func), std::forward<Args>(args)...);
+}
+
+template<typename Func, typename... Args>
+Utils::JsResultStatus Utils::QueuedSyncToAsync::try_invoke(Func &&func, Args... args) {
+    std::uint64_t traceStart = 0;
+    SYNC_TO_ASYNC_TRACE(traceStart = trace::now_ns());
+    std::size_t index;
+    auto acquired = acquireSlot(index, false);
+    if (acquired != JsResultStatus::OK) {
+        return acquired;
+    }
+    return start(index, traceStart, std::chrono::steady_clock::time_point::max(),
+                 std::forward<Func &&>(func), std::forward<Args>(args)...).wait();
+}
+
+template<typename T, typename Func, typename... Args>
+Utils::JsResult<T> Utils::QueuedSyncToAsync::call(Func &&func, Args... args) {
+    static_assert(!detail::ReturnValue<T>::kPayload, "pass a JsArena to receive bytes or strings");
+    return callInto<T>(nullptr, std::forward<Func &&>(func), std::forward<Args>(args)...);
+}
+
+template<typename T, typename Func, typename... Args>
+Utils::JsResult<T> Utils::QueuedSyncToAsync::call(JsArena &arena, Func &&func, Args... args) {
+    return callInto<T>(&arena, std::forward<Func &&>(func), std::forward<Args>(args)...);
+}
+
+template<typename T, typename Func, typename... Args>
+Utils::JsResult<T> Utils::QueuedSyncToAsync::callInto(JsArena *arena, Func &&func, Args... args) {
+    static_assert(JsCallOf<Func>::kReturnsValue, "the js function does not return a value");
+    std::uint64_t traceStart = 0;
+    SYNC_TO_ASYNC_TRACE(traceStart = trace::now_ns());
+    std::size_t index;
+    auto acquired = acquireSlot(index);
+    if (acquired != JsResultStatus::OK) {
+        JsResult<T> result;
+        result.status = acquired;
+        return result;
+    }
+    if (arena != nullptr) {
+        arena->attach(mSlots[index].ret);
+    }
+    auto handle = start(index, traceStart, std::chrono::steady_clock::time_point::max(),
+                        std::forward<Func &&>(func), std::forward<Args>(args)...);
+    handle.wait();
+    return detail::result_of<T>(handle.returned(), arena);
+}
+
+template<typename Func, typename... Args>
+Utils::JsCallHandle Utils::QueuedSyncToAsync::start(std::size_t index, std::uint64_t traceStart,
+                                                    std::chrono::steady_clock::time_point deadline, Func &&func, Args... args) {
+    auto &slot = mSlots[index];
+    SYNC_TO_ASYNC_TRACE(slot.trace = trace::CallTrace{trace::key_of(func), traceStart, trace::now_ns()});
+    (void) traceStart;
+    // The call and its arguments stay on this stack, proxied with the C API so
+    // that no std::function has to be allocated.
+    struct Start {
+        JsCallOf<Func> call;
+        CompletionSlot *slot;
+    };
+    Start start{JsCallOf<Func>(func, args...), &slot};
+    // Wait until the function started executing and not just got queued.
+    // This also keeps the arguments alive while Javascript reads them.
+    auto started = runOnReturner([](void *arg) {
+        auto *start = static_cast<Start *>(arg);
+        // We will add reference to our slot's resume function which wakes the
+        // waiter, and reference to the slot's return variable which can be set
+        // appropriately once the function is executed.
+        SYNC_TO_ASYNC_TRACE(start->slot->trace.jsStarted = trace::now_ns());
+        start->call(&start->slot->resume, &start->slot->ret);
+    }, &start, deadline);
+    if (started != JsResultStatus::OK) {
+        // If emscripten failed to execute the function, or it timed out in its
+        // lane, the slot will never be resumed. To avoid deadlock mark it
+        // finished right away, with status NOT_STARTED or TIMEOUT.
+        // Caller should check status and figure out why the call failed.
+        abandonSlot(index, started);
     }
-    return static_cast<JsResultStatus>(mStatus);
+    return JsCallHandle{this, index};
 }
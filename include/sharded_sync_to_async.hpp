@@ -0,0 +1,93 @@
+#pragma once
+
+#include "common.hpp"
+#include "proxying_sync_to_async.hpp"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace Utils {
+
+    // How ShardedSyncToAsync picks the shard for a call.
+    enum class ShardPolicy : int {
+        // Shards in turn.
+        ROUND_ROBIN = 0,
+        // The shard with the fewest calls in flight, ties broken in turn.
+        LEAST_OUTSTANDING = 1
+    };
+
+    // Several QueuedSyncToAsync returners, each with its own thread and
+    // Javascript scope, so Javascript work can run on several cores at once.
+    //
+    // State created in Javascript lives on one shard only. Calls that create
+    // state (like importing a library or loading a model) are broadcast to
+    // every shard, after which any shard can serve the calls that use it.
+    //
+    // The first shard is QueuedSyncToAsync::getInvoker(), so a single shard
+    // behaves exactly like queued_js_executor.
+    class ShardedSyncToAsync {
+    public:
+        explicit ShardedSyncToAsync(std::size_t shards, ShardPolicy policy = ShardPolicy::LEAST_OUTSTANDING);
+        ShardedSyncToAsync(const ShardedSyncToAsync &) = delete;
+        ShardedSyncToAsync &operator=(const ShardedSyncToAsync &) = delete;
+
+        std::size_t size() const { return mShards.size(); }
+        ShardPolicy policy() const { return mPolicy; }
+        QueuedSyncToAsync &shard(std::size_t index) { return *mShards[index]; }
+
+        // The shard the next call should go to.
+        QueuedSyncToAsync &pick() { return *mShards[pickIndex()]; }
+        // Index of that shard, for calls that create state on one shard only.
+        std::size_t pickIndex();
+
+        // Run the function on one shard, chosen by the policy.
+        template<typename Func, typename... Args>
+        JsResultStatus invoke(Func &&func, Args... args) {
+            return pick().invoke(std::forward<Func &&>(func), args...);
+        }
+
+        // try_invoke on the shard chosen by the policy, then on the others in
+        // turn. BUSY only if every shard is full.
+        template<typename Func, typename... Args>
+        JsResultStatus try_invoke(Func &&func, Args... args) {
+            auto first = pickIndex();
+            auto status = JsResultStatus::BUSY;
+            for (std::size_t i = 0; i < mShards.size() && status == JsResultStatus::BUSY; ++i) {
+                status = mShards[(first + i) % mShards.size()]->try_invoke(func, args...);
+            }
+            return status;
+        }
+
+        // Run the function on every shard at once and wait for all of them.
+        // Returns OK if it succeeded everywhere, else the first failure.
+        // Pointer arguments only need to stay valid until this returns.
+        template<typename Func, typename... Args>
+        JsResultStatus broadcast(Func &&func, Args... args);
+
+    private:
+        ShardPolicy mPolicy;
+        std::vector<QueuedSyncToAsync *> mShards;
+        std::vector<std::unique_ptr<QueuedSyncToAsync>> mOwned;
+        std::atomic<std::size_t> mNext{0};
+    };
+
+}// namespace Utils
+
+template<typename Func, typename... Args>
+Utils::JsResultStatus Utils::ShardedSyncToAsync::broadcast(Func &&func, Args... args) {
+    std::vector<JsCallHandle> handles;
+    handles.reserve(mShards.size());
+    for (auto *shard : mShards) {
+        handles.push_back(shard->submit(func, args...));
+    }
+    auto status = JsResultStatus::OK;
+    for (auto &handle : handles) {
+        auto shardStatus = handle.wait();
+        if (status == JsResultStatus::OK) {
+            status = shardStatus;
+        }
+    }
+    return status;
+}
@@ -14,14 +14,51 @@
 #include <emscripten/val.h>
 #include <pthread.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <type_traits>
 #include <utility>
+#include <vector>
+#include "bridge_trace.hpp"
 #include "common.hpp"
+#include "completion_wait.hpp"
+#include "js_binding.hpp"
+#include "js_result.hpp"
+
+// Number of persistent SyncToAsync workers used by js_executor. Every worker
+// holds one pthread for the lifetime of the application, so keep this below
+// -sPTHREAD_POOL_SIZE.
+#ifndef SYNC_TO_ASYNC_POOL_SIZE
+#define SYNC_TO_ASYNC_POOL_SIZE 4
+#endif
+
+extern "C" {
+// Defined in js_functions.js: runs func(arg) on this thread's event loop as a
+// MessageChannel task (mode 1) or a microtask (mode 2).
+void sync_to_async_post(void (*func)(void *), void *arg, int mode);
+}
 
 namespace Utils {
 
+    // How a SyncToAsync worker schedules work on its own event loop: the
+    // next call, and the Javascript function it runs.
+    enum class Dispatch : int {
+        // emscripten_async_call, i.e. setTimeout(0). Browsers clamp nested
+        // timeouts to 4ms.
+        TIMEOUT = 0,
+        // A MessageChannel message, which is a task without the clamp.
+        MESSAGE_CHANNEL = 1,
+        // A microtask, which runs before any other task of the event loop.
+        MICROTASK = 2
+    };
+
     enum class ThreadState : std::uint8_t {
         Waiting = 0,
         WorkAvailable,
@@ -44,11 +81,15 @@ namespace Utils {
         // Public API
         //==============================================================================
     public:
-        // Pass around the callback as a pointer to a std::function. Using a pointer
+        // Pass around the callback as a pointer to a Completion. Using a pointer
         // means that it can be sent easily to JS, as a void* parameter to a C API,
         // etc., and also means we do not need to worry about the lifetime of the
-        // std::function in user code.
-        using Callback = std::function<void()> *;
+        // callback in user code.
+        using Callback = Completion *;
+
+        // Work given as a plain function and its context. Unlike a
+        // std::function it is never copied or allocated.
+        using WorkFunc = void (*)(void *context, Callback resume);
 
         //
         // Run some work on thread. This is a synchronous (blocking) call. The
@@ -70,15 +111,32 @@ namespace Utils {
         // threads freely.
         //
         void invoke(std::function<void(Callback)> newWork);
+        // Same without allocating. `context` must stay valid until the work
+        // called its callback, which invoke() waits for.
+        void invoke(WorkFunc work, void *context);
+
+        // Like invoke(), but gives up at `deadline`. Returns false if the work
+        // had not called its callback by then. The worker stays busy until it
+        // does, see idle().
+        bool invokeUntil(std::function<void(Callback)> newWork, std::chrono::steady_clock::time_point deadline);
+
+        // True when the worker has no work assigned, or the last work called
+        // its callback.
+        bool idle();
+
+        Dispatch dispatch() const { return mDispatch; }
+
+        // Run func(arg) on the calling worker's event loop after the current
+        // work returned, with the worker's Dispatch. Only for work functions,
+        // which run on the worker.
+        static void defer(void (*func)(void *), void *arg);
 
         //==============================================================================
         // End Public API
 
     private:
-        // The dedicated worker thread.
-        std::thread mExecutionThread;
-        // Condition variable used for bidirectional communication between the
-        // worker thread and invoking threads.
+        // Condition variable invokers wait on until the worker took the
+        // previous work. Completion is signalled on mWorkCount instead.
         std::condition_variable mSynchronizationCondition;
         std::mutex mMutex;
 
@@ -89,29 +147,59 @@ namespace Utils {
         // Increment the count every time work is finished. This will allow invokers
         // to detect that their particular work has been completed even if some
         // other invoker wins the race and submits new work before the original
-        // invoker can check for completion.
+        // invoker can check for completion. Invokers sleep on it, see
+        // detail::wait_while.
         std::atomic<uint32_t> mWorkCount{0};
+        // Value mWorkCount takes once the last assigned work is finished.
+        uint32_t mAssignedWork = 0;
+        // The worker has nothing scheduled and sits in its event loop, so
+        // the next assignWork or the destructor has to wake it. Guarded by
+        // mMutex.
+        bool mParked = true;
+
+        // Either a WorkFunc with its context, or a std::function owned by the
+        // worker.
+        struct Work {
+            WorkFunc func = nullptr;
+            void *context = nullptr;
+            std::function<void(Callback)> owned;
+        };
 
         // The work that the dedicated worker thread should perform and the callback
         // that needs to be called when the work is finished.
-        std::function<void(Callback)> mWork;
-        std::function<void()> mResumeFunc;
+        Work mWork;
+        Completion mResumeFunc{&SyncToAsync::resume, this};
+        // The work being run. It is kept until the next work is taken, so
+        // that whatever it owns outlives a resume that arrives after the
+        // invoker stopped waiting.
+        Work mCurrentWork;
 
-        static void *threadMain(void *arg) {
-            // Schedule ourselves to start processing incoming work requests.
-            emscripten_async_call(threadIter, arg, 0);
-            return nullptr;
-        }
+#if SYNC_TO_ASYNC_TRACING
+        // When the last piece of work called its resume function.
+        std::atomic<std::uint64_t> mResumedAt{0};
+#endif
+
+        Dispatch mDispatch;
 
-        // The main worker thread routine that waits for work, wakes up when work is
-        // available, executes the work, then schedules itself again.
+        // The dedicated worker thread. Declared last so that it only starts
+        // once the state it reads has been constructed.
+        std::thread mExecutionThread;
+
+        static void *threadMain(void *arg);
+
+        // The main worker thread routine. Runs on the worker's event loop
+        // whenever work was assigned, takes it and executes it.
         static void threadIter(void *arg);
+        // Schedule threadIter on the parked worker. Called with mMutex held.
+        void unpark();
+        // mResumeFunc: the work is finished.
+        static void resume(void *arg);
         // Spawn the worker thread. It starts in the `Waiting` state, so it is ready
         // to accept work requests from invokers even before it starts up.
 
     public:
-        SyncToAsync()
-            : mState{ThreadState::Waiting}, mExecutionThread(threadMain, this) {
+        explicit SyncToAsync(Dispatch dispatch = Dispatch::TIMEOUT)
+            : mState{ThreadState::Waiting}, mDispatch{dispatch}, mExecutionThread(threadMain, this) {
         }
 
         ~SyncToAsync() {
@@ -122,20 +210,105 @@ namespace Utils {
             // therefore not be any work available.
             assert(mState == ThreadState::Waiting);
 
-            // Wake the worker and tell it to quit. Be ready to join it when it
-            // does. There shouldn't be other invokers waiting to send work since we
-            // are destructing the SyncToAsync, so just use `notify_one`.
+            // Tell the worker to quit and wake it if it is parked, else it
+            // sees the state once its current work resumes. Be ready to join it
+            // when it does.
             mState = ThreadState::ShouldExit;
-            mSynchronizationCondition.notify_one();
+            if (mParked) {
+                unpark();
+            }
 
             // Unlock to allow the worker to wake up and exit.
             lock.unlock();
             mExecutionThread.join();
         }
         void waitForWork(std::unique_lock<std::mutex> &lock);
-        uint32_t assignWork(std::function<void(Callback)> newWork);
+        uint32_t assignWork(Work &&newWork);
+        // Releases the lock and waits until work `workID` called its callback.
         void waitForCompletion(std::unique_lock<std::mutex> &lock, uint32_t workID);
-        static std::function<void(Callback)> getAssignedFunc(SyncToAsync *parent);
+        static void takeAssignedWork(SyncToAsync *parent, Work &work);
+#if SYNC_TO_ASYNC_TRACING
+        std::uint64_t lastResumeTime() const { return mResumedAt.load(); }
+#endif
+    };
+
+    // A fixed set of SyncToAsync workers that is created once and reused for
+    // every call. Each invoke() borrows an idle worker for the duration of the
+    // call, so up to size() calls can be in flight at the same time. Further
+    // callers wait until a worker is handed back.
+    //
+    // A worker whose call missed its deadline is retired: a fresh worker takes
+    // its place, and the old one is destroyed once its call finally resumes.
+    class SyncToAsyncPool {
+        Dispatch mDispatch;
+        std::vector<std::unique_ptr<SyncToAsync>> mWorkers;
+        std::vector<SyncToAsync *> mIdle;
+        // Workers that timed out and still wait for Javascript.
+        std::vector<std::unique_ptr<SyncToAsync>> mRetired;
+        std::mutex mMutex;
+        std::condition_variable mWorkerAvailable;
+        // See setMaxWaiting and stats. Guarded by mMutex.
+        std::size_t mMaxWaiting = SIZE_MAX;
+        std::size_t mWaiting = 0;
+        std::size_t mPeakWaiting = 0;
+        std::uint64_t mRejected = 0;
+
+        // Borrow an idle worker. If there is none, wait for one until the
+        // deadline, unless `wait` is false or the waiting limit is reached.
+        // Returns OK, BUSY or TIMEOUT.
+        JsResultStatus acquire(SyncToAsync *&worker, bool wait = true,
+                               std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+        void release(SyncToAsync &worker);
+        // Hand the worker back after a call and complete its trace.
+        void finishInvoke(SyncToAsync &worker, trace::CallTrace *callTrace);
+        // Replace a worker that is stuck in a call.
+        void retire(SyncToAsync &worker);
+        // Destroy retired workers whose call has resumed by now.
+        void sweepRetired();
+
+    public:
+        explicit SyncToAsyncPool(std::size_t size, Dispatch dispatch = Dispatch::TIMEOUT);
+        ~SyncToAsyncPool();
+        SyncToAsyncPool(const SyncToAsyncPool &) = delete;
+        void operator=(const SyncToAsyncPool &) = delete;
+
+        // Same contract as SyncToAsync::invoke, but runs on whichever worker
+        // is free. When tracing is enabled, callTrace is completed and recorded.
+        // Returns BUSY without running the work if the waiting limit is
+        // reached, else OK.
+        JsResultStatus invoke(std::function<void(SyncToAsync::Callback)> newWork, trace::CallTrace *callTrace = nullptr);
+        JsResultStatus invoke(SyncToAsync::WorkFunc work, void *context, trace::CallTrace *callTrace = nullptr);
+        // invoke that returns BUSY right away if no worker is idle.
+        JsResultStatus tryInvoke(SyncToAsync::WorkFunc work, void *context, trace::CallTrace *callTrace = nullptr);
+
+        // Same contract as SyncToAsync::invokeUntil. Waiting for a free worker
+        // counts against the deadline too. Returns OK, TIMEOUT or BUSY.
+        // callTrace is completed but left to the caller to record, since only
+        // the caller knows when Javascript started.
+        JsResultStatus invokeUntil(std::function<void(SyncToAsync::Callback)> newWork,
+                                   std::chrono::steady_clock::time_point deadline,
+                                   trace::CallTrace *callTrace = nullptr);
+
+        // Callers that may wait for an idle worker at once. Calls beyond it
+        // return BUSY instead of blocking. Unlimited by default.
+        void setMaxWaiting(std::size_t count);
+        QueueStats stats();
+
+        std::size_t size() const { return mWorkers.size(); }
+        Dispatch dispatch() const { return mDispatch; }
+
+        // Number of retired workers that are still waiting for Javascript.
+        std::size_t retired();
+
+        // Size used when getPool() creates the shared pool. Only has an effect
+        // if called before the first js_executor call. Returns false if the
+        // pool already exists.
+        static bool setDefaultSize(std::size_t size);
+        // Same for the Dispatch of the shared pool's workers.
+        static bool setDefaultDispatch(Dispatch dispatch);
+
+        // Shared pool used by js_executor. Created on first use.
+        static SyncToAsyncPool &getPool();
     };
 
     // Following are some convenient functions created to call js functions from C++
@@ -167,43 +340,188 @@ namespace Utils {
     //  On the call side
     //  auto status = js_executor(log_data, "Hello World!");
     //  status can be JsResultStatus::OK, ERROR, or NOT_STARTED
+    //
+    //  The call runs on one of the workers of SyncToAsyncPool::getPool(), so no
+    //  thread is created or joined per call.
+    //
+    //  The arguments are converted to the parameter types of the declaration
+    //  at compile time (see js_binding.hpp) and, once the pool is warmed up,
+    //  the call makes no heap allocation.
+    namespace detail {
+        // Runs one call on the pool, with its status and value going to `ret`.
+        // With `wait` false it does not wait for an idle worker, and `ret`
+        // reports BUSY if there was none.
+        template<typename Func, typename... Args>
+        void execute_on_pool(SyncToAsyncPool &pool, bool wait, JsReturn &ret, Func &&func, Args &&...args) {
+            // Everything the call needs lives here, on the caller's stack, and
+            // the worker is handed plain functions, so no allocation is made.
+            struct Pending {
+                JsCallOf<Func> call;
+                JsReturn *ret;
+                SyncToAsync::Callback resume;
+#if SYNC_TO_ASYNC_TRACING
+                trace::CallTrace trace;
+#endif
+            };
+            Pending pending{JsCallOf<Func>(func, std::forward<Args>(args)...), &ret, nullptr};
+#if SYNC_TO_ASYNC_TRACING
+            pending.trace = trace::CallTrace{trace::key_of(func), trace::now_ns()};
+            auto *tracePointer = &pending.trace;
+#else
+            trace::CallTrace *tracePointer = nullptr;
+#endif
+            auto work = [](void *context, SyncToAsync::Callback resumeFunc) {
+                        static_cast<Pending *>(context)->resume = resumeFunc;
+                        // Call Javascript from the worker's event loop, once the
+                        // worker returned from here.
+                        auto emscripten_call_back = [](void *context) {
+                            auto *call = static_cast<Pending *>(context);
+                            SYNC_TO_ASYNC_TRACE(call->trace.jsStarted = trace::now_ns());
+                            call->call(call->resume, call->ret);
+                        };
+                        SyncToAsync::defer(emscripten_call_back, context);
+                    };
+            auto status = wait ? pool.invoke(work, &pending, tracePointer) : pool.tryInvoke(work, &pending, tracePointer);
+            if (status != JsResultStatus::OK) {
+                ret.status = status;
+            }
+        }
+    }// namespace detail
+
     template<typename Func, typename... Args>
     JsResultStatus js_executor(Func &&func, Args... args) {
-        using JsInvoker = Utils::SyncToAsync;
-        std::function<void()> callback;
-        int status = JsResultStatus::NOT_STARTED;
-        JsInvoker invoker;
-        invoker.invoke(
-                [&](JsInvoker ::Callback resumeFunc) {
-                    callback = [&]() { func(std::forward<Args>(args)..., resumeFunc, &status); };
+        JsReturn ret;
+        detail::execute_on_pool(SyncToAsyncPool::getPool(), true, ret, func, args...);
+        return static_cast<JsResultStatus>(ret.status);
+    }
 
-                    auto emscripten_call_back = [](void *callback) {
-                        auto *functionRef = static_cast<JsInvoker ::Callback>(callback);
-                        (*functionRef)();
-                    };
+    // js_executor that returns JsResultStatus::BUSY right away if no worker
+    // of the pool is idle, instead of waiting for one.
+    template<typename Func, typename... Args>
+    JsResultStatus try_js_executor(Func &&func, Args... args) {
+        JsReturn ret;
+        detail::execute_on_pool(SyncToAsyncPool::getPool(), false, ret, func, args...);
+        return static_cast<JsResultStatus>(ret.status);
+    }
 
-                    emscripten_async_call(emscripten_call_back, &callback, 0);
-                });
-        return static_cast<JsResultStatus>(status);
+    // js_executor on a pool of your own, eg. one with a different Dispatch.
+    //
+    //  Utils::SyncToAsyncPool fast(2, Utils::Dispatch::MESSAGE_CHANNEL);
+    //  auto status = js_executor_on(fast, log_data, "Hello World!");
+    template<typename Func, typename... Args>
+    JsResultStatus js_executor_on(SyncToAsyncPool &pool, Func &&func, Args... args) {
+        JsReturn ret;
+        detail::execute_on_pool(pool, true, ret, func, args...);
+        return static_cast<JsResultStatus>(ret.status);
     }
 
-    template<typename Func>
-    JsResultStatus js_executor(Func &&func) {
+    // js_executor for a Javascript function that returns a scalar, declared
+    // with a Utils::JsReturn * as its last parameter (see js_result.hpp).
+    //
+    //  auto size = js_call<std::int64_t>(get_size, "key");
+    //  if (size) { use(size.value); }
+    template<typename T, typename Func, typename... Args>
+    JsResult<T> js_call(Func &&func, Args... args) {
+        static_assert(!detail::ReturnValue<T>::kPayload, "pass a JsArena to receive bytes or strings");
+        static_assert(JsCallOf<Func>::kReturnsValue, "the js function does not return a value");
+        JsReturn ret;
+        detail::execute_on_pool(SyncToAsyncPool::getPool(), true, ret, func, args...);
+        return detail::result_of<T>(ret, nullptr);
+    }
+
+    // js_call for a byte or string payload, which is written to `arena`.
+    template<typename T, typename Func, typename... Args>
+    JsResult<T> js_call(JsArena &arena, Func &&func, Args... args) {
+        static_assert(JsCallOf<Func>::kReturnsValue, "the js function does not return a value");
+        JsReturn ret;
+        arena.attach(ret);
+        detail::execute_on_pool(SyncToAsyncPool::getPool(), true, ret, func, args...);
+        return detail::result_of<T>(ret, &arena);
+    }
+
+    namespace detail {
+        // State of a js_executor_until call. It is owned by the work function,
+        // which the worker keeps until its next call, so a resume that arrives
+        // after the caller timed out still writes into live memory.
+        struct TimedCall {
+            enum Phase : int {
+                PENDING = 0,
+                STARTED,
+                CANCELLED
+            };
+            std::atomic<int> phase{PENDING};
+            JsReturn ret;
+            std::function<void()> call;
+#if SYNC_TO_ASYNC_TRACING
+            std::atomic<std::uint64_t> jsStarted{0};
+#endif
+
+            // Only one of start() and cancel() succeeds.
+            bool start() {
+                int expected = PENDING;
+                return phase.compare_exchange_strong(expected, STARTED);
+            }
+            bool cancel() {
+                int expected = PENDING;
+                return phase.compare_exchange_strong(expected, CANCELLED);
+            }
+        };
+    }// namespace detail
+
+    // js_executor with a deadline. Returns JsResultStatus::TIMEOUT if the
+    // Javascript function did not resume in time, eg. because its promise never
+    // settles. The worker it ran on is then replaced, so the pool keeps its size.
+    //
+    // If the deadline passes before the function was called it is not called
+    // at all. If it was already running, it keeps running and its eventual
+    // resume is discarded. Pointer arguments it writes to asynchronously (like
+    // the output of a prediction) must then stay valid until it settles.
+    template<typename Func, typename... Args>
+    JsResultStatus js_executor_until(std::chrono::steady_clock::time_point deadline, Func &&func, Args... args) {
         using JsInvoker = Utils::SyncToAsync;
-        std::function<void()> callback;
-        int status = JsResultStatus::NOT_STARTED;
-        JsInvoker invoker;
-        invoker.invoke(
-                [&](JsInvoker ::Callback resumeFunc) {
-                    callback = [&]() { func(resumeFunc, std::addressof(status)); };
+        JsCallOf<Func> jsCall(func, args...);
+        auto state = std::make_shared<detail::TimedCall>();
+#if SYNC_TO_ASYNC_TRACING
+        trace::CallTrace callTrace{trace::key_of(func), trace::now_ns()};
+        auto *tracePointer = &callTrace;
+#else
+        trace::CallTrace *tracePointer = nullptr;
+#endif
+        auto completed = SyncToAsyncPool::getPool().invokeUntil(
+                [state, jsCall](JsInvoker ::Callback resumeFunc) {
+                    auto *call = state.get();
+                    call->call = [call, jsCall, resumeFunc]() {
+                        if (!call->start()) {
+                            // The caller is gone and so may be its arguments,
+                            // only hand the worker back.
+                            (*resumeFunc)();
+                            return;
+                        }
+                        SYNC_TO_ASYNC_TRACE(call->jsStarted = trace::now_ns());
+                        jsCall(resumeFunc, std::addressof(call->ret));
+                    };
+
                     auto emscripten_call_back = [](void *callback) {
-                        auto *functionRef = static_cast<JsInvoker ::Callback>(callback);
-                        (*functionRef)();
+                        (*static_cast<std::function<void()> *>(callback))();
                     };
 
-                    emscripten_async_call(emscripten_call_back, std::addressof(callback), 0);
-                });
-        return static_cast<JsResultStatus>(status);
+                    SyncToAsync::defer(emscripten_call_back, std::addressof(call->call));
+                },
+                deadline, tracePointer);
+        if (completed != JsResultStatus::OK) {
+            state->cancel();
+            return completed;
+        }
+        SYNC_TO_ASYNC_TRACE(callTrace.jsStarted = state->jsStarted;
+                            trace::record(callTrace));
+        return static_cast<JsResultStatus>(state->ret.status);
+    }
+
+    template<typename Rep, typename Period, typename Func, typename... Args>
+    JsResultStatus js_executor_for(const std::chrono::duration<Rep, Period> &timeout, Func &&func, Args... args) {
+        return js_executor_until(std::chrono::steady_clock::now() +
+                                         std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout),
+                                 std::forward<Func &&>(func), std::forward<Args>(args)...);
     }
 
 }// namespace Utils
@@ -215,7 +533,7 @@ extern "C" {
 // status_pointer is reference to variable owned by C++ side and status is the status of function
 // status = 0 means OK and status = 1 means error. This is passed appropriately from Js side
 //
-// callback is pointer to an internal function created by SyncToAsync which includes some synchronization primitives
+// callback is a pointer to a Utils::Completion created by the executor, which wakes the waiting caller
 // The js side should call this function at the end of execution as follows
 //
 // Module._resume_execution(callback, status_pointer, <0 or 1>);
@@ -1,22 +1,467 @@
 #pragma once
+#include "sharded_sync_to_async.hpp"
 #include "sync_to_async.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <string>
+#include <vector>
 
 extern "C" {
 extern void import_tfjs(Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
 extern void check_pretfjs(Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
 extern void check_if_on_thread(Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
-extern void load_graph_model_from_path(const char* model_id, const char *path, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
-extern void load_layer_model_from_path(const char* model_id, const char *path, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
-extern void load_graph_model_from_buffer(const char* model_id, const char *topology, const unsigned char *weights_ptr, const int weight_size, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
-extern void load_layer_model_from_buffer(const char* model_id, const char *topology, const unsigned char *weights_ptr, const int weight_size, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
-extern void predict_in_js(const char* model_id, const float * const input_ptr, const int input_size, const int * const input_shape_ptr, float *const output_ptr, const int output_size, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
-extern void dispose_model(const char* model_id, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void load_graph_model_from_path(int model_id, const char *path, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void load_layer_model_from_path(int model_id, const char *path, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void load_graph_model_from_buffers(int model_id, const char *topology, const void *shards_ptr, const int shard_count, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void load_layer_model_from_buffers(int model_id, const char *topology, const void *shards_ptr, const int shard_count, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void predict_in_js(int model_id, const void *input_ptr, int input_dtype, const int input_size, const int *const input_shape_ptr, const int input_rank, void *const output_ptr, int output_dtype, const int output_size, int *written_ptr, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void register_staging_arena(int arena_id, float *base_ptr, int slot_count, int input_floats, int output_floats, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void predict_staged(int model_id, int arena_id, int slot, int input_size, const int *input_shape_ptr, int input_rank, int output_size, int *written_ptr, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void dispose_model(int model_id, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void model_output_shape(int model_id, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, Utils::JsReturn *ret);
+extern void tfjs_memory(Utils::SyncToAsync::Callback fn_to_continue_in_cpp, Utils::JsReturn *ret);
+extern void set_tfjs_backend(const char *backend_name, const char *wasm_path, int simd, int threads, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void tfjs_backend_name(Utils::SyncToAsync::Callback fn_to_continue_in_cpp, Utils::JsReturn *ret);
+extern void upload_tensor(const void *input_ptr, int input_dtype, int input_size, const int *input_shape_ptr, int input_rank, int tensor_id, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void predict_tensor(int model_id, int input_id, int output_id, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void crop_and_resize_tensor(int image_id, const float *boxes_ptr, int box_count, int height, int width, int output_id, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void download_tensor(int tensor_id, void *output_ptr, int output_dtype, int output_size, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void tensor_shape(int tensor_id, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, Utils::JsReturn *ret);
+extern void dispose_tensor(int tensor_id, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, int *status_pointer);
+extern void model_bundle(int model_id, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, Utils::JsReturn *ret);
+extern void warmup_model(int model_id, const int *input_shape_ptr, int input_rank, int runs, Utils::SyncToAsync::Callback fn_to_continue_in_cpp, Utils::JsReturn *ret);
 }
 
+// All tfjs calls run on QueuedSyncToAsync returners. By default there is one,
+// the shared invoker, so tf.js and the loaded models live in a single
+// Javascript scope. See set_shards to spread predictions over more threads.
 namespace tfjs {
+    // Use `count` returner threads for tf.js, each with its own tf.js instance
+    // and a replica of every loaded model, which costs the model's memory once
+    // per shard. Predictions are spread over the shards by `policy`, so CPU
+    // backend inference scales with cores. Must be called before anything
+    // else in tfjs, returns false otherwise.
+    bool set_shards(std::size_t count, Utils::ShardPolicy policy = Utils::ShardPolicy::LEAST_OUTSTANDING);
+    std::size_t shards();
+
+    // Probe for tf.js and import it if needed, on every shard. Always crosses
+    // into Javascript.
     Utils::JsResultStatus import();
-    Utils::JsResultStatus load_file(const std::string& path, const std::string& type);
-    Utils::JsResultStatus load_buffer(const std::string& topology, const std::vector<unsigned char> &weights, const std::string& type);
-    Utils::JsResultStatus predict(const std::vector<float> &input, const std::vector<int> &input_shape, std::vector<float> &output);
-    Utils::JsResultStatus dispose(const std::string &model_name);
+    // Import tf.js once per runtime. Thread safe, and free after the first
+    // success, so the other tfjs functions call it on every use. Call it
+    // explicitly at start up to keep the import out of the first request.
+    Utils::JsResultStatus init();
+    // How many times init() imported tf.js. Stays at 1 once an import succeeded.
+    std::size_t imports();
+
+    // tf.js backends. WEBGL needs a browser with WebGL, it is not available
+    // under Node.
+    enum class Backend : int {
+        CPU = 0,
+        WASM = 1,
+        WEBGL = 2
+    };
+
+    struct BackendOptions {
+        // WASM only. tf.js uses SIMD and multithreaded kernels where the
+        // runtime supports them, these can only switch them off. They have no
+        // effect once the wasm backend was initialised.
+        bool simd = true;
+        bool threads = true;
+        // Directory of tf-backend-wasm.min.js and the tfjs-backend-wasm*.wasm
+        // files. The build puts them next to tf.min.js, so by default they are
+        // loaded from the working directory instead of the network.
+        std::string wasmPath = "./";
+    };
+
+    // Switch tf.js on every shard to `backend`, importing tf.js and the wasm
+    // backend first if needed. Returns ERROR if the backend could not be
+    // initialised on a shard.
+    Utils::JsResultStatus set_backend(Backend backend, const BackendOptions &options = {});
+    // Name of the backend tf.js runs on in the first shard, e.g. "cpu" or "wasm".
+    Utils::JsResult<std::string> backend();
+
+    // Handle to a model loaded into tf.js. The model stays resident until the
+    // handle is destroyed or dispose() is called, so several models can be
+    // loaded side by side. Javascript keeps the models in a table indexed by
+    // id(), which makes the lookup on every predict O(1).
+    class Model {
+        int mId = -1;
+        Utils::JsResultStatus mStatus = Utils::NOT_STARTED;
+
+    public:
+        Model() = default;
+        Model(int id, Utils::JsResultStatus status) : mId{id}, mStatus{status} {}
+        Model(Model &&other) noexcept;
+        Model &operator=(Model &&other) noexcept;
+        Model(const Model &) = delete;
+        Model &operator=(const Model &) = delete;
+        ~Model();
+
+        // Id of the model in the Javascript model table, -1 if nothing is loaded.
+        int id() const { return mId; }
+        // Status of the load that produced this handle.
+        Utils::JsResultStatus status() const { return mStatus; }
+        bool valid() const { return mId >= 0; }
+        explicit operator bool() const { return valid(); }
+
+        // Free the model in tf.js. The handle is empty afterwards.
+        Utils::JsResultStatus dispose();
+    };
+
+    // Element types that can cross into tf.js. Values match tfjs_heap_view in js_functions.js.
+    enum class DType : int {
+        UINT8 = 0,
+        INT32 = 1,
+        FLOAT32 = 2
+    };
+
+    template<typename T>
+    struct dtype_of;
+    template<>
+    struct dtype_of<std::uint8_t> : std::integral_constant<DType, DType::UINT8> {};
+    template<>
+    struct dtype_of<std::int32_t> : std::integral_constant<DType, DType::INT32> {};
+    template<>
+    struct dtype_of<float> : std::integral_constant<DType, DType::FLOAT32> {};
+
+    // Non-owning view of a tensor in C++ memory, of any rank.
+    template<typename T>
+    struct TensorView {
+        T *data;
+        std::size_t size;
+        std::vector<int> shape;
+    };
+
+    // One weight file of a model, owned by the caller. Only has to stay valid
+    // until load_buffer returns.
+    struct WeightShard {
+        const unsigned char *data;
+        std::size_t size;
+    };
+
+    // type is "graph" or "layer". Check valid() or status() on the result.
+    Model load_file(const std::string& path, const std::string& type);
+    // topology is the content of model.json (or model artifacts with weightSpecs).
+    // Exactly the given weight bytes are copied into tf.js, once.
+    Model load_buffer(const std::string& topology, const std::vector<unsigned char> &weights, const std::string& type);
+    // Same as above for sharded models. Shards must be in weightsManifest order.
+    Model load_buffer(const std::string& topology, const std::vector<WeightShard> &shards, const std::string& type);
+
+    // A loaded model can be saved as a single file bundle: the topology with
+    // its weight specs, followed by all the weights in one piece. Loading a
+    // bundle is one file read and one copy into tf.js, with no model.json or
+    // weight shards to fetch. Files are read and written through the
+    // Emscripten filesystem, so mount NODEFS (or use NODERAWFS) under Node, or
+    // IDBFS in a browser and FS.syncfs it, to keep them between runs.
+    //
+    // The bundle holds a hash of its contents and is rejected if it doesn't
+    // match, e.g. when it was cut short by a crash.
+    Utils::JsResultStatus save_bundle(const Model &model, const std::string &file);
+    Model load_bundle(const std::string &file, const std::string &type);
+    // Load from a bundle in cache_dir if there is one for `path`, else load
+    // from `path` and write the bundle for the next start. Bundles are keyed
+    // by the path and, if model.json can be read through the filesystem, the
+    // hash of model.json and of the weight files it lists, so a changed or
+    // retrained model is loaded again. Paths the filesystem can't read, like
+    // URLs, are keyed by the path alone: their bundle is used until it is
+    // deleted, see cached_bundle. cache_dir must exist.
+    Model load_cached(const std::string &path, const std::string &type, const std::string &cache_dir);
+    // Write the bundle load_cached looks for, e.g. for a model that was
+    // loaded from the same files with load_buffer.
+    Utils::JsResultStatus save_cached(const Model &model, const std::string &path, const std::string &cache_dir);
+    // File in cache_dir that load_cached keeps the bundle of `path` in.
+    std::string cached_bundle(const std::string &path, const std::string &cache_dir);
+    // Untyped form of predict, prefer the templates below.
+    Utils::JsResultStatus predict(const Model &model,
+                                  const void *input, DType input_dtype, std::size_t input_size, const std::vector<int> &input_shape,
+                                  void *output, DType output_dtype, std::size_t output_size, std::size_t *written = nullptr);
+
+    // Run the model on input and write the first output to output, which must
+    // hold at least output_size values. tf.js casts integer inputs to float32
+    // and converts the result to Out, so e.g. uint8 camera frames can be passed
+    // without converting them in C++ first. uint8 results are rounded and
+    // clamped to 0..255, not wrapped. If given, `written` receives the number
+    // of values the output has, which may be less than output_size.
+    template<typename In, typename Out>
+    Utils::JsResultStatus predict(const Model &model, const TensorView<In> &input, Out *output, std::size_t output_size,
+                                  std::size_t *written = nullptr) {
+        return predict(model,
+                       input.data, dtype_of<typename std::remove_const<In>::type>::value, input.size, input.shape,
+                       output, dtype_of<Out>::value, output_size, written);
+    }
+
+    Utils::JsResultStatus predict(const Model &model, const std::vector<float> &input, const std::vector<int> &input_shape, std::vector<float> &output);
+    Utils::JsResultStatus dispose(Model &model);
+
+    // Handle to a tensor that stays inside tf.js, so that the stages of a
+    // pipeline can hand their results to each other without copying them out
+    // to C++ and back in:
+    //
+    //  auto frame = tfjs::upload(image);
+    //  auto boxes = tfjs::predict(detector, frame);
+    //  auto crops = tfjs::crop_and_resize(frame, regions, 224, 224);
+    //  tfjs::download(tfjs::predict(classifier, crops), scores.data(), scores.size());
+    //
+    // The tensor is disposed when the handle is destroyed or dispose() is
+    // called. It lives on the tfjs shard it was made on, and the calls that
+    // use it run there.
+    class TensorHandle {
+        int mId = -1;
+        std::size_t mShard = 0;
+        Utils::JsResultStatus mStatus = Utils::NOT_STARTED;
+
+    public:
+        TensorHandle() = default;
+        TensorHandle(int id, std::size_t shard, Utils::JsResultStatus status) : mId{id}, mShard{shard}, mStatus{status} {}
+        TensorHandle(TensorHandle &&other) noexcept;
+        TensorHandle &operator=(TensorHandle &&other) noexcept;
+        TensorHandle(const TensorHandle &) = delete;
+        TensorHandle &operator=(const TensorHandle &) = delete;
+        ~TensorHandle();
+
+        // Id of the tensor in the Javascript tensor table, -1 if there is none.
+        int id() const { return mId; }
+        std::size_t shard() const { return mShard; }
+        // Status of the call that produced this handle.
+        Utils::JsResultStatus status() const { return mStatus; }
+        bool valid() const { return mId >= 0; }
+        explicit operator bool() const { return valid(); }
+
+        // Free the tensor in tf.js. The handle is empty afterwards.
+        Utils::JsResultStatus dispose();
+    };
+
+    // Copy a tensor into tf.js. Integer data is cast to float32, like the input of predict.
+    TensorHandle upload(const void *input, DType input_dtype, std::size_t input_size, const std::vector<int> &input_shape);
+    template<typename In>
+    TensorHandle upload(const TensorView<In> &input) {
+        return upload(input.data, dtype_of<typename std::remove_const<In>::type>::value, input.size, input.shape);
+    }
+
+    // Run the model on a tensor in tf.js and keep its first output there.
+    TensorHandle predict(const Model &model, const TensorHandle &input);
+
+    // tf.image.cropAndResize of a [1, height, width, channels] image: one
+    // height x width crop per box, each box being normalised
+    // {y1, x1, y2, x2} coordinates.
+    TensorHandle crop_and_resize(const TensorHandle &image, const std::vector<std::array<float, 4>> &boxes, int height, int width);
+
+    Utils::JsResult<std::vector<int>> shape(const TensorHandle &tensor);
+
+    // Copy the values of a tensor out of tf.js, converted to output_dtype.
+    // Fails if there are more than output_size.
+    Utils::JsResultStatus download(const TensorHandle &tensor, void *output, DType output_dtype, std::size_t output_size);
+    template<typename Out>
+    Utils::JsResultStatus download(const TensorHandle &tensor, Out *output, std::size_t output_size) {
+        return download(tensor, static_cast<void *>(output), dtype_of<Out>::value, output_size);
+    }
+
+    // Preallocated float32 buffers for predict inputs and outputs, in a ring
+    // of fixed size slots that Javascript keeps views of. A prediction through
+    // a slot copies nothing in C++ and allocates nothing on either side.
+    //
+    //  auto slot = tfjs::staging().borrow();
+    //  std::copy(sample.begin(), sample.end(), slot.input());
+    //  slot.set_shape({1, 4});
+    //  if (tfjs::predict(model, slot, sample.size(), 2) == Utils::OK) { use(slot.output()); }
+    //
+    // Borrowing and returning slots is lock free. borrow() sleeps on a futex
+    // while every slot is in use, and returning a slot wakes one borrower.
+    class StagingArena {
+    public:
+        static constexpr std::size_t kMaxRank = 8;
+
+        struct Options {
+            std::size_t slots = 16;
+            std::size_t inputFloats = 16384;
+            std::size_t outputFloats = 4096;
+        };
+
+        // A borrowed slot. Returned to the arena when destroyed.
+        class Slot {
+        public:
+            Slot() = default;
+            Slot(Slot &&other) noexcept : mArena{other.mArena}, mIndex{other.mIndex} { other.mArena = nullptr; }
+            Slot &operator=(Slot &&other) noexcept;
+            Slot(const Slot &) = delete;
+            Slot &operator=(const Slot &) = delete;
+            ~Slot() { release(); }
+
+            explicit operator bool() const { return mArena != nullptr; }
+            std::size_t index() const { return mIndex; }
+
+            float *input() const;
+            std::size_t input_capacity() const;
+            float *output() const;
+            std::size_t output_capacity() const;
+
+            // Shape of the input, with the batch dimension. At most kMaxRank dimensions.
+            bool set_shape(const int *dims, std::size_t rank);
+            bool set_shape(std::initializer_list<int> shape) { return set_shape(shape.begin(), shape.size()); }
+            bool set_shape(const std::vector<int> &shape) { return set_shape(shape.data(), shape.size()); }
+            const int *shape() const;
+            std::size_t rank() const;
+
+            void release();
+
+        private:
+            friend class StagingArena;
+            Slot(StagingArena *arena, std::size_t index) : mArena{arena}, mIndex{index} {}
+
+            StagingArena *mArena = nullptr;
+            std::size_t mIndex = 0;
+        };
+
+        StagingArena(const StagingArena &) = delete;
+        StagingArena &operator=(const StagingArena &) = delete;
+
+        // Borrow a free slot, waiting for one if all are in use.
+        Slot borrow();
+        // Borrow a free slot if there is one, else return an empty slot.
+        Slot try_borrow();
+
+        std::size_t slots() const { return mOptions.slots; }
+        const Options &options() const { return mOptions; }
+        // Id of the arena on the Javascript side.
+        int id() const { return mId; }
+        // Status of registering the arena with every tfjs shard.
+        Utils::JsResultStatus status() const { return mStatus; }
+
+    private:
+        friend StagingArena &staging();
+        StagingArena(int id, Options options);
+
+        struct SlotShape {
+            std::array<int, kMaxRank> dims;
+            std::size_t rank = 0;
+        };
+
+        int mId;
+        Options mOptions;
+        Utils::JsResultStatus mStatus = Utils::NOT_STARTED;
+        std::unique_ptr<float[]> mMemory;
+        std::unique_ptr<SlotShape[]> mShapes;
+        std::unique_ptr<std::atomic<bool>[]> mBusy;
+        std::atomic<std::size_t> mCursor{0};
+        // Bumped on every return, for borrow() to sleep on, and the number of
+        // borrowers asleep, so returns only wake when somebody waits.
+        std::atomic<std::uint32_t> mReturns{0};
+        std::atomic<std::uint32_t> mSleepers{0};
+    };
+
+    // Size the arena returned by staging(). Must be called before its first
+    // use, returns false otherwise.
+    bool set_staging(StagingArena::Options options);
+    // The staging arena owned by tfjs, created and registered on first use.
+    StagingArena &staging();
+
+    // Run the model on the first input_size values of slot.input(), shaped by
+    // slot.shape(), and write the first output to slot.output(). `written`
+    // as for predict above.
+    Utils::JsResultStatus predict(const Model &model, const StagingArena::Slot &slot, std::size_t input_size, std::size_t output_size,
+                                  std::size_t *written = nullptr);
+
+    // Batching front end for predict. Concurrent single sample predictions on
+    // the same model are gathered for up to `window`, or until `maxBatch` of
+    // them arrived, and run as one batched predict, whose output is scattered
+    // back to the callers. That adds up to `window` of latency to a call, in
+    // exchange for one tensor and one kernel dispatch per batch instead of per
+    // sample under load.
+    //
+    // The first caller of a batch runs it, the others wait for it. The model
+    // must take the batch as its first dimension, and must outlive the predictor.
+    class BatchingPredictor {
+    public:
+        struct Options {
+            std::chrono::microseconds window{2000};
+            std::size_t maxBatch = 32;
+        };
+
+        struct Stats {
+            std::uint64_t requests = 0;
+            std::uint64_t batches = 0;
+            // Batches whose output did not split into output_size values per
+            // request, and that were predicted one request at a time instead.
+            std::uint64_t fallbacks = 0;
+        };
+
+        explicit BatchingPredictor(const Model &model) : BatchingPredictor(model, Options{}) {}
+        BatchingPredictor(const Model &model, Options options) : mModel{model}, mOptions{options} {}
+        BatchingPredictor(const BatchingPredictor &) = delete;
+        BatchingPredictor &operator=(const BatchingPredictor &) = delete;
+
+        // Predict one sample. input_shape includes the batch dimension, which
+        // must be 1, and output_size should be exactly the model's output size
+        // for one sample, so that the batched output can be split. A batch
+        // whose output does not split that way is predicted one sample at a
+        // time, see Stats::fallbacks. A sample whose shape or output size
+        // differs from the batch being gathered runs on its own.
+        Utils::JsResultStatus predict(const float *input, std::size_t input_size, const std::vector<int> &input_shape,
+                                      float *output, std::size_t output_size);
+        Utils::JsResultStatus predict(const std::vector<float> &input, const std::vector<int> &input_shape, std::vector<float> &output);
+
+        Stats stats() const;
+
+    private:
+        struct Request {
+            const float *input;
+            float *output;
+        };
+        struct Batch {
+            std::vector<int> shape;
+            std::size_t inputSize;
+            std::size_t outputSize;
+            std::vector<Request> requests;
+            bool done = false;
+            Utils::JsResultStatus status = Utils::NOT_STARTED;
+            // The leader waits on `full`, the others on `finished`.
+            std::condition_variable full;
+            std::condition_variable finished;
+        };
+
+        // Stack the inputs, predict and scatter the outputs. Called without the lock.
+        Utils::JsResultStatus run(Batch &batch);
+
+        const Model &mModel;
+        Options mOptions;
+        mutable std::mutex mMutex;
+        // Batch that is still taking requests, if any.
+        std::shared_ptr<Batch> mOpen;
+        Stats mStats;
+    };
+
+    // Shape of the first output of the model, -1 for dimensions that are not
+    // fixed, like the batch. One crossing into Javascript.
+    Utils::JsResult<std::vector<int>> output_shape(const Model &model);
+
+    // tf.memory() of the tf.js backend of the first shard.
+    struct MemoryInfo {
+        std::int64_t numTensors = 0;
+        std::int64_t numDataBuffers = 0;
+        std::int64_t numBytes = 0;
+    };
+    Utils::JsResult<MemoryInfo> memory();
+
+    // Latency of the first prediction of a model, which compiles the
+    // backend's kernels and uploads the weights, and of the ones after it.
+    struct WarmupInfo {
+        std::chrono::microseconds firstRun{0};
+        std::chrono::microseconds steadyState{0};
+    };
+
+    // Run 1 + `runs` predictions of zeros on every shard, so that the cold
+    // start is paid here, at load time, and not by the first request. An empty
+    // input_shape takes the model's input shape with 1 for dimensions that are
+    // not fixed. firstRun is the slowest shard's first prediction, steadyState
+    // the mean of the others.
+    Utils::JsResult<WarmupInfo> warmup(const Model &model, const std::vector<int> &input_shape = {}, std::size_t runs = 3);
 }// namespace tfjs
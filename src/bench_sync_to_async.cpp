@@ -0,0 +1,693 @@
+// Microbenchmarks for the sync-to-async bridge.
+//
+// Runs headless under Node from the build directory (tf.min.js is loaded from
+// there, nothing is fetched over the network):
+//
+//  node tfjs_async_to_sync_bench.js --csv bench.csv --json bench.json
+//
+// The host build (see README) runs it as ./tfjs_async_to_sync_bench and skips
+// the tfjs benchmarks.
+//
+// Options:
+//  --csv <file>        write the results as CSV
+//  --json <file>       write the results as JSON
+//  --iterations <n>    calls per latency measurement (default 1000)
+//  --threads <n>       largest number of concurrent callers (default 16)
+//  --shards <n>        largest number of ShardedSyncToAsync shards (default 4)
+//  --tfjs-shards <n>   tfjs::set_shards for the predict benchmarks (default 1).
+//                      Run once per value to compare predict throughput.
+//  --backend <name>    tf.js backend for the predict benchmarks: cpu, wasm or
+//                      webgl (default: whatever tf.js picks).
+#include "js_includes.hpp"
+#include "preprocess.hpp"
+#include "proxying_sync_to_async.hpp"
+#include "sharded_sync_to_async.hpp"
+#include "sync_to_async.hpp"
+#include "tfjs.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        int iterations = 1000;
+        int threads = 16;
+        int shards = 4;
+        int tfjsShards = 1;
+        std::string backend;
+        std::string csvPath;
+        std::string jsonPath;
+    };
+
+    struct Result {
+        std::string benchmark;
+        std::string variant;
+        std::string metric;
+        double value;
+        std::string unit;
+    };
+
+    std::vector<Result> gResults;
+
+    void report(const std::string &benchmark, const std::string &variant, const std::string &metric, double value, const std::string &unit) {
+        gResults.push_back({benchmark, variant, metric, value, unit});
+        std::printf("%-22s %-28s %-14s %14.2f %s\n", benchmark.c_str(), variant.c_str(), metric.c_str(), value, unit.c_str());
+        std::fflush(stdout);
+    }
+
+    double micros(Clock::duration duration) {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    }
+
+    double percentile(std::vector<double> &samples, double q) {
+        if (samples.empty()) {
+            return 0;
+        }
+        std::sort(samples.begin(), samples.end());
+        auto index = static_cast<std::size_t>(q * static_cast<double>(samples.size() - 1));
+        return samples[index];
+    }
+
+    // What js_executor did before SyncToAsyncPool: a fresh SyncToAsync, and
+    // therefore a fresh pthread, for every call.
+    Utils::JsResultStatus one_shot_js_executor() {
+        std::function<void()> callback;
+        int status = Utils::JsResultStatus::NOT_STARTED;
+        Utils::SyncToAsync invoker;
+        invoker.invoke([&](Utils::SyncToAsync::Callback resumeFunc) {
+            callback = [&, resumeFunc]() { noop_func(resumeFunc, &status); };
+            emscripten_async_call([](void *cb) { (*static_cast<std::function<void()> *>(cb))(); }, &callback, 0);
+        });
+        return static_cast<Utils::JsResultStatus>(status);
+    }
+
+    // Round trip latency of single calls, one after the other.
+    template<typename Call>
+    void bench_latency(const std::string &benchmark, const std::string &variant, int iterations, Call &&call) {
+        // Warm up so that lazily created pools and pthreads are not measured.
+        call();
+        std::vector<double> samples;
+        samples.reserve(iterations);
+        auto failures = 0;
+        for (auto i = 0; i < iterations; ++i) {
+            auto t1 = Clock::now();
+            if (call() != Utils::JsResultStatus::OK) {
+                ++failures;
+            }
+            samples.push_back(micros(Clock::now() - t1));
+        }
+        double total = 0;
+        for (auto sample : samples) {
+            total += sample;
+        }
+        report(benchmark, variant, "mean", total / iterations, "us");
+        report(benchmark, variant, "p50", percentile(samples, 0.5), "us");
+        report(benchmark, variant, "p99", percentile(samples, 0.99), "us");
+        report(benchmark, variant, "failures", failures, "calls");
+    }
+
+    // Calls per second with `threads` callers issuing `callsPerThread` calls each.
+    template<typename Call>
+    void bench_throughput(const std::string &benchmark, const std::string &variant, int threads, int callsPerThread, Call &&call) {
+        std::atomic<int> failures{0};
+        std::vector<std::thread> workers;
+        auto t1 = Clock::now();
+        for (auto i = 0; i < threads; ++i) {
+            workers.emplace_back([&] {
+                for (auto j = 0; j < callsPerThread; ++j) {
+                    if (call() != Utils::JsResultStatus::OK) {
+                        failures++;
+                    }
+                }
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        auto seconds = std::chrono::duration<double>(Clock::now() - t1).count();
+        auto name = variant + " x" + std::to_string(threads);
+        report(benchmark, name, "throughput", threads * callsPerThread / seconds, "calls/s");
+        report(benchmark, name, "failures", failures.load(), "calls");
+    }
+
+    // Keeps `count` threads spinning so that the pthread pool has nothing left,
+    // like the 15 thread tests in test_tfjs.cpp.
+    class BusyThreads {
+        std::atomic<bool> mStop{false};
+        std::vector<std::thread> mThreads;
+
+    public:
+        explicit BusyThreads(int count) {
+            for (auto i = 0; i < count; ++i) {
+                mThreads.emplace_back([this] {
+                    while (!mStop.load(std::memory_order_relaxed)) {
+                    }
+                });
+            }
+        }
+        ~BusyThreads() {
+            mStop = true;
+            for (auto &thread : mThreads) {
+                thread.join();
+            }
+        }
+    };
+
+    void bench_executors(const Options &options) {
+        bench_latency("noop_round_trip", "one-shot SyncToAsync", options.iterations / 10, [] { return one_shot_js_executor(); });
+        bench_latency("noop_round_trip", "js_executor", options.iterations, [] { return Utils::js_executor(noop_func); });
+        bench_latency("noop_round_trip", "queued_js_executor", options.iterations, [] { return Utils::queued_js_executor(noop_func); });
+
+        for (auto threads = 1; threads <= options.threads; threads *= 2) {
+            auto callsPerThread = std::max(1, options.iterations / threads);
+            bench_throughput("noop_throughput", "js_executor", threads, callsPerThread, [] { return Utils::js_executor(noop_func); });
+            bench_throughput("noop_throughput", "queued_js_executor", threads, callsPerThread, [] { return Utils::queued_js_executor(noop_func); });
+        }
+
+        // 200us of CPU bound Javascript per call, spread over more and more returners.
+        auto callsPerThread = std::max(1, options.iterations / options.threads);
+        for (auto shards = 1; shards <= options.shards; shards *= 2) {
+            Utils::ShardedSyncToAsync sharded(shards);
+            bench_throughput("sharded_throughput", "busy 200us " + std::to_string(shards) + " shards", options.threads, callsPerThread,
+                             [&] { return sharded.invoke(busy_func, 200); });
+        }
+
+        {
+            BusyThreads busy(15);
+            bench_latency("pool_exhausted", "js_executor", options.iterations / 10, [] { return Utils::js_executor(noop_func); });
+            bench_latency("pool_exhausted", "queued_js_executor", options.iterations / 10, [] { return Utils::queued_js_executor(noop_func); });
+        }
+    }
+
+    // 15 threads that each wait for a call of 50us of Javascript at a time:
+    // latency per call and process CPU time per call, with the callers going
+    // to sleep right away and spinning for 20us first.
+    void bench_wake(const Options &options) {
+        const int waiters = 15;
+        auto callsPerThread = std::max(10, options.iterations / 10);
+        auto run = [&](const std::string &variant, auto &&call) {
+            std::vector<std::vector<double>> perThread(waiters);
+            std::vector<std::thread> workers;
+            auto cpu = std::clock();
+            for (auto t = 0; t < waiters; ++t) {
+                workers.emplace_back([&, t] {
+                    perThread[t].reserve(callsPerThread);
+                    for (auto i = 0; i < callsPerThread; ++i) {
+                        auto t1 = Clock::now();
+                        call();
+                        perThread[t].push_back(micros(Clock::now() - t1));
+                    }
+                });
+            }
+            for (auto &worker : workers) {
+                worker.join();
+            }
+            auto cpuMicros = 1e6 * static_cast<double>(std::clock() - cpu) / CLOCKS_PER_SEC;
+            std::vector<double> samples;
+            for (auto &thread : perThread) {
+                samples.insert(samples.end(), thread.begin(), thread.end());
+            }
+            report("wake_15_waiters", variant, "p50", percentile(samples, 0.5), "us");
+            report("wake_15_waiters", variant, "p99", percentile(samples, 0.99), "us");
+            report("wake_15_waiters", variant, "cpu", cpuMicros / samples.size(), "us/call");
+        };
+        auto spin = Utils::wait_spin();
+        for (auto spinUs : {0, 20}) {
+            Utils::set_wait_spin(std::chrono::microseconds(spinUs));
+            auto suffix = ", spin " + std::to_string(spinUs) + "us";
+            run("queued_js_executor" + suffix, [] { return Utils::queued_js_executor(busy_func, 50); });
+            run("js_executor" + suffix, [] { return Utils::js_executor(busy_func, 50); });
+        }
+        Utils::set_wait_spin(spin);
+    }
+
+    // No-op latency on a returner that 4 threads keep busy with 5ms calls,
+    // standing in for model loads, in the same lane and in the BULK lane.
+    void bench_lanes(const Options &options) {
+        for (auto lane : {Utils::Lane::INTERACTIVE, Utils::Lane::BULK}) {
+            Utils::QueuedSyncToAsync invoker;
+            std::atomic<bool> stop{false};
+            std::vector<std::thread> loaders;
+            for (auto i = 0; i < 4; ++i) {
+                loaders.emplace_back([&] {
+                    Utils::ScopedLane scoped(lane);
+                    while (!stop.load(std::memory_order_relaxed)) {
+                        invoker.invoke(busy_func, 5000);
+                    }
+                });
+            }
+            auto variant = lane == Utils::Lane::BULK ? "loads in bulk lane" : "loads in same lane";
+            bench_latency("busy_returner", variant, std::max(10, options.iterations / 20), [&] { return invoker.invoke(noop_func); });
+            stop = true;
+            for (auto &loader : loaders) {
+                loader.join();
+            }
+            if (lane == Utils::Lane::BULK) {
+                auto bulk = invoker.laneStats(Utils::Lane::BULK);
+                report("busy_returner", variant, "bulk max depth", bulk.maxDepth, "calls");
+                report("busy_returner", variant, "bulk aged", bulk.aged, "calls");
+            }
+        }
+    }
+
+    // 32 threads calling 200us of Javascript as fast as they can, on a
+    // returner that queues without limit and on one that lets at most 4 calls
+    // wait and turns the rest away with BUSY: latency of the calls that ran
+    // and the share that was shed.
+    void bench_overload(const Options &options) {
+        const int callers = 32;
+        auto callsPerThread = std::max(10, options.iterations / 20);
+        for (auto bounded : {false, true}) {
+            Utils::QueuedSyncToAsync invoker;
+            if (bounded) {
+                invoker.setMaxInFlight(4);
+                invoker.setMaxWaiting(4);
+            }
+            std::vector<std::vector<double>> perThread(callers);
+            std::vector<std::thread> workers;
+            for (auto t = 0; t < callers; ++t) {
+                workers.emplace_back([&, t] {
+                    for (auto i = 0; i < callsPerThread; ++i) {
+                        auto t1 = Clock::now();
+                        if (invoker.invoke(busy_func, 200) == Utils::OK) {
+                            perThread[t].push_back(micros(Clock::now() - t1));
+                        } else {
+                            // What a caller would do instead, e.g. answer from a cache.
+                            std::this_thread::sleep_for(std::chrono::microseconds(200));
+                        }
+                    }
+                });
+            }
+            for (auto &worker : workers) {
+                worker.join();
+            }
+            std::vector<double> samples;
+            for (auto &thread : perThread) {
+                samples.insert(samples.end(), thread.begin(), thread.end());
+            }
+            auto variant = bounded ? "4 in flight, 4 waiting" : "unbounded";
+            auto stats = invoker.queueStats();
+            report("overload_32_callers", variant, "p50", percentile(samples, 0.5), "us");
+            report("overload_32_callers", variant, "p99", percentile(samples, 0.99), "us");
+            report("overload_32_callers", variant, "peak waiting", stats.peakWaiting, "calls");
+            report("overload_32_callers", variant, "rejected", 100.0 * stats.rejected / (callers * callsPerThread), "%");
+        }
+    }
+
+    // No-op js_executor latency with each way a worker can schedule the
+    // call. Only differs in browsers, where setTimeout is clamped.
+    void bench_dispatch(const Options &options) {
+        const std::pair<Utils::Dispatch, const char *> modes[] = {
+                {Utils::Dispatch::TIMEOUT, "setTimeout"},
+                {Utils::Dispatch::MESSAGE_CHANNEL, "MessageChannel"},
+                {Utils::Dispatch::MICROTASK, "microtask"}};
+        for (const auto &mode : modes) {
+            Utils::SyncToAsyncPool pool(1, mode.first);
+            bench_latency("dispatch", mode.second, options.iterations / 10, [&] { return Utils::js_executor_on(pool, noop_func); });
+        }
+    }
+
+    // Dense layer with 4 inputs and 2 outputs, loaded from memory.
+    const char *kTinyDenseModel =
+            R"({"modelTopology":{"class_name":"Sequential","config":{"name":"tiny","layers":[)"
+            R"({"class_name":"Dense","config":{"name":"dense","units":2,"activation":"linear","use_bias":false,)"
+            R"("dtype":"float32","batch_input_shape":[null,4]}}]},"keras_version":"tfjs-layers","backend":"tensor_flow.js"},)"
+            R"("weightsManifest":[{"paths":["weights.bin"],"weights":[{"name":"dense/kernel","shape":[4,2],"dtype":"float32"}]}]})";
+
+    // Square dense layer with `units` inputs and outputs and no bias, its
+    // kernel split over weight_paths.
+    std::string dense_model_json(int units, const std::vector<std::string> &weight_paths = {"weights.bin"}) {
+        std::string paths;
+        for (const auto &path : weight_paths) {
+            paths += (paths.empty() ? "\"" : ",\"") + path + "\"";
+        }
+        const auto n = std::to_string(units);
+        return R"({"modelTopology":{"class_name":"Sequential","config":{"name":"bench","layers":[)"
+               R"({"class_name":"Dense","config":{"name":"dense","units":)" + n + R"(,"activation":"linear","use_bias":false,)"
+               R"("dtype":"float32","batch_input_shape":[null,)" + n + R"(]}}]},"keras_version":"tfjs-layers","backend":"tensor_flow.js"},)"
+               R"("weightsManifest":[{"paths":[)" + paths + R"(],"weights":[{"name":"dense/kernel","shape":[)" + n + "," + n +
+               R"(],"dtype":"float32"}]}]})";
+    }
+
+    // All-zero kernel of dense_model_json(units), as one buffer.
+    std::vector<unsigned char> dense_weights(int units) {
+        return std::vector<unsigned char>(sizeof(float) * units * units, 0);
+    }
+
+    // Switch tf.js to --backend before any model is loaded.
+    bool backend_named(const std::string &name, tfjs::Backend &backend) {
+        if (name == "cpu") {
+            backend = tfjs::Backend::CPU;
+        } else if (name == "wasm") {
+            backend = tfjs::Backend::WASM;
+        } else if (name == "webgl") {
+            backend = tfjs::Backend::WEBGL;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    void select_backend(const Options &options) {
+        tfjs::Backend backend;
+        if (!backend_named(options.backend, backend)) {
+            return;
+        }
+        if (tfjs::set_backend(backend) != Utils::OK) {
+            std::printf("could not switch tf.js to %s\n", options.backend.c_str());
+        }
+    }
+
+    // First prediction of a freshly loaded model against the ones after it.
+    void bench_warmup(const std::string &variant, const tfjs::Model &model, const std::vector<int> &shape) {
+        auto info = tfjs::warmup(model, shape, 10);
+        if (!info) {
+            std::printf("warm up of %s failed\n", variant.c_str());
+            return;
+        }
+        report("warmup", variant + ", " + tfjs::backend().value, "first_run", info.value.firstRun.count(), "us");
+        report("warmup", variant + ", " + tfjs::backend().value, "steady_state", info.value.steadyState.count(), "us");
+    }
+
+    void bench_predict(const Options &options) {
+        if (tfjs::init() != Utils::OK) {
+            std::printf("tf.js not available, skipping tfjs benchmarks\n");
+            return;
+        }
+        std::vector<float> kernel = {1, 0, 0, 1, 1, 0, 0, 1};
+        auto model = tfjs::load_buffer(kTinyDenseModel,
+                                       std::vector<unsigned char>(reinterpret_cast<const unsigned char *>(kernel.data()),
+                                                                  reinterpret_cast<const unsigned char *>(kernel.data() + kernel.size())),
+                                       "layer");
+        if (!model) {
+            std::printf("could not load the tiny model, skipping predict benchmarks\n");
+            return;
+        }
+        bench_warmup("tiny dense", model, {1, 4});
+        std::vector<float> input = {1, 2, 3, 4};
+        std::vector<float> output(2);
+        bench_latency("predict", "tiny dense", options.iterations, [&] { return tfjs::predict(model, input, {1, 4}, output); });
+        bench_latency("predict", "tiny dense, staged", options.iterations, [&] {
+            auto slot = tfjs::staging().borrow();
+            std::copy(input.begin(), input.end(), slot.input());
+            slot.set_shape({1, 4});
+            return tfjs::predict(model, slot, input.size(), 2);
+        });
+    }
+
+    // Predictions per second of a 512x512 dense layer, which keeps the CPU
+    // backend busy long enough for the shards to matter.
+    void bench_predict_throughput(const Options &options) {
+        const int units = 512;
+        if (tfjs::init() != Utils::OK) {
+            return;
+        }
+        auto model = tfjs::load_buffer(dense_model_json(units), dense_weights(units), "layer");
+        if (!model) {
+            std::printf("could not load the dense model, skipping predict throughput\n");
+            return;
+        }
+        bench_warmup("dense 512", model, {1, units});
+        auto variant = "dense 512, " + std::to_string(tfjs::shards()) + " shards";
+        tfjs::BatchingPredictor batcher(model, {std::chrono::milliseconds(1), 32});
+        for (auto threads = 1; threads <= options.threads; threads *= 2) {
+            auto callsPerThread = std::max(1, options.iterations / 10 / threads);
+            bench_throughput("predict_throughput", variant, threads, callsPerThread, [&] {
+                std::vector<float> input(units, 1.0f);
+                std::vector<float> output(units);
+                return tfjs::predict(model, input, {1, units}, output);
+            });
+            bench_throughput("predict_throughput", variant + ", batched", threads, callsPerThread, [&] {
+                std::vector<float> input(units, 1.0f);
+                std::vector<float> output(units);
+                return batcher.predict(input, {1, units}, output);
+            });
+        }
+    }
+
+    // Three stages of a 512x512 dense layer, handing the activations on
+    // through C++ vectors or as tensors that stay in tf.js.
+    void bench_pipeline(const Options &options) {
+        const int units = 512;
+        if (tfjs::init() != Utils::OK) {
+            return;
+        }
+        auto model = tfjs::load_buffer(dense_model_json(units), dense_weights(units), "layer");
+        if (!model) {
+            return;
+        }
+        std::vector<float> input(units, 1.0f);
+        std::vector<float> first(units), second(units), output(units);
+        auto iterations = std::max(10, options.iterations / 10);
+        bench_latency("pipeline", "dense 512 x3, vectors", iterations, [&] {
+            tfjs::predict(model, input, {1, units}, first);
+            tfjs::predict(model, first, {1, units}, second);
+            return tfjs::predict(model, second, {1, units}, output);
+        });
+        bench_latency("pipeline", "dense 512 x3, handles", iterations, [&] {
+            auto x = tfjs::upload(tfjs::TensorView<const float>{input.data(), input.size(), {1, units}});
+            auto y = tfjs::predict(model, tfjs::predict(model, tfjs::predict(model, x)));
+            return tfjs::download(y, output.data(), output.size());
+        });
+    }
+
+    // A 640x480 RGB frame resized to 224x224, normalized and reordered to
+    // CHW, with the SIMD kernels and with the scalar ones. Runs on the host too.
+    void bench_preprocess(const Options &options) {
+        const int height = 480, width = 640, size = 224, channels = 3;
+        const float mean[3] = {123.7f, 116.3f, 103.5f};
+        const float stddev[3] = {58.4f, 57.1f, 57.4f};
+        std::vector<std::uint8_t> frame(height * width * channels);
+        for (std::size_t i = 0; i < frame.size(); ++i) {
+            frame[i] = static_cast<std::uint8_t>(i * 31);
+        }
+        std::vector<float> resized(size * size * channels), planar(resized.size());
+        auto iterations = std::max(10, options.iterations / 10);
+        bench_latency("preprocess", tfjs::preprocess::simd() ? "640x480 to 224x224, simd" : "640x480 to 224x224, simd (not built)", iterations, [&] {
+            tfjs::preprocess::resize_bilinear(frame.data(), height, width, channels, resized.data(), size, size);
+            tfjs::preprocess::normalize(resized.data(), size * size, channels, mean, stddev, resized.data());
+            tfjs::preprocess::hwc_to_chw(resized.data(), size, size, channels, planar.data());
+            return Utils::JsResultStatus::OK;
+        });
+        bench_latency("preprocess", "640x480 to 224x224, scalar", iterations, [&] {
+            tfjs::preprocess::scalar::resize_bilinear(frame.data(), height, width, channels, resized.data(), size, size);
+            tfjs::preprocess::scalar::normalize(resized.data(), size * size, channels, mean, stddev, resized.data());
+            tfjs::preprocess::scalar::hwc_to_chw(resized.data(), size, size, channels, planar.data());
+            return Utils::JsResultStatus::OK;
+        });
+    }
+
+    struct MemoryUsage {
+        double rss;
+        double arrayBuffers;
+        double heap;
+    };
+
+    MemoryUsage sample_memory() {
+        double sample[3] = {0, 0, 0};
+        Utils::queued_js_executor(sample_memory_usage, sample);
+        return {sample[0], sample[1], sample[2]};
+    }
+
+    // Loads a single dense layer with a 5000x5000 float32 kernel (100 MB of
+    // weights) from a C++ buffer and reports how memory grows.
+    //
+    // Before exact-slice ingestion tf.js was handed the whole wasm heap
+    // (reported as "heap"), which is at least the size of the weights plus
+    // everything else the program allocated.
+    void bench_load_buffer_memory() {
+        const int units = 5000;
+        if (tfjs::init() != Utils::OK) {
+            return;
+        }
+        const auto topology = dense_model_json(units);
+        auto weights = dense_weights(units);
+        auto before = sample_memory();
+        auto t1 = Clock::now();
+        auto model = tfjs::load_buffer(topology, weights, "layer");
+        auto t2 = Clock::now();
+        auto after = sample_memory();
+        auto mb = [](double bytes) { return bytes / (1024.0 * 1024.0); };
+        report("load_buffer", "100MB dense", "time", micros(t2 - t1) / 1000.0, "ms");
+        report("load_buffer", "100MB dense", "status", model.status(), "");
+        report("load_buffer", "100MB dense", "weights", mb(weights.size()), "MB");
+        report("load_buffer", "100MB dense", "rss_growth", mb(after.rss - before.rss), "MB");
+        report("load_buffer", "100MB dense", "arraybuffer_growth", mb(after.arrayBuffers - before.arrayBuffers), "MB");
+        report("load_buffer", "100MB dense", "heap", mb(after.heap), "MB");
+    }
+
+    std::vector<unsigned char> read_file(const std::string &path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::vector<unsigned char>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    }
+
+    // Start up cost of a 2048x2048 dense layer (16 MB in 4 weight files) from
+    // the converter's files against a single file bundle. The files are read
+    // through the filesystem (NODERAWFS) and handed to load_buffer, which is
+    // the cheapest cold path available offline. load_cached from a path is
+    // reported too where tf.js can load the path itself.
+    void bench_model_cache() {
+        const int units = 2048;
+        const int shardCount = 4;
+        if (tfjs::init() != Utils::OK) {
+            return;
+        }
+        std::vector<std::string> paths;
+        for (auto i = 1; i <= shardCount; ++i) {
+            paths.push_back("bench_cache_shard" + std::to_string(i) + ".bin");
+        }
+        const auto topology = dense_model_json(units, paths);
+        {
+            std::ofstream("bench_cache_model.json") << topology;
+            auto weights = dense_weights(units);
+            const auto shardSize = weights.size() / shardCount;
+            for (auto i = 0; i < shardCount; ++i) {
+                std::ofstream(paths[i], std::ios::binary)
+                        .write(reinterpret_cast<const char *>(weights.data() + i * shardSize), static_cast<std::streamsize>(shardSize));
+            }
+        }
+
+        auto t1 = Clock::now();
+        auto json = read_file("bench_cache_model.json");
+        std::vector<std::vector<unsigned char>> files;
+        std::vector<tfjs::WeightShard> shards;
+        for (const auto &path : paths) {
+            files.push_back(read_file(path));
+            shards.push_back({files.back().data(), files.back().size()});
+        }
+        auto fromFiles = tfjs::load_buffer(std::string(json.begin(), json.end()), shards, "layer");
+        auto t2 = Clock::now();
+        report("model_cache", "dense 2048, files", "load", micros(t2 - t1) / 1000.0, "ms");
+
+        auto t3 = Clock::now();
+        auto saved = tfjs::save_bundle(fromFiles, "bench_cache.tfjsbundle");
+        auto t4 = Clock::now();
+        report("model_cache", "dense 2048, bundle", "save", micros(t4 - t3) / 1000.0, "ms");
+        if (saved == Utils::OK) {
+            auto t5 = Clock::now();
+            auto fromBundle = tfjs::load_bundle("bench_cache.tfjsbundle", "layer");
+            auto t6 = Clock::now();
+            report("model_cache", "dense 2048, bundle", "load", micros(t6 - t5) / 1000.0, "ms");
+            report("model_cache", "dense 2048, bundle", "status", fromBundle.status(), "");
+        }
+
+        auto t7 = Clock::now();
+        auto cold = tfjs::load_cached("bench_cache_model.json", "layer", ".");
+        auto t8 = Clock::now();
+        if (cold) {
+            auto cached = tfjs::load_cached("bench_cache_model.json", "layer", ".");
+            auto t9 = Clock::now();
+            report("model_cache", "dense 2048, load_cached", "cold", micros(t8 - t7) / 1000.0, "ms");
+            report("model_cache", "dense 2048, load_cached", "cached", micros(t9 - t8) / 1000.0, "ms");
+        } else {
+            std::printf("tf.js can't load bench_cache_model.json from a path here, skipping load_cached\n");
+        }
+
+        std::remove("bench_cache_model.json");
+        std::remove("bench_cache.tfjsbundle");
+        std::remove(tfjs::cached_bundle("bench_cache_model.json", ".").c_str());
+        for (const auto &path : paths) {
+            std::remove(path.c_str());
+        }
+    }
+
+    std::string escapeJson(const std::string &text) {
+        std::string escaped;
+        for (auto c : text) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    void write_csv(const std::string &path) {
+        std::ofstream out(path);
+        out << "benchmark,variant,metric,value,unit\n";
+        for (const auto &result : gResults) {
+            out << result.benchmark << "," << result.variant << "," << result.metric << "," << result.value << "," << result.unit << "\n";
+        }
+    }
+
+    void write_json(const std::string &path) {
+        std::ofstream out(path);
+        out << "[\n";
+        for (std::size_t i = 0; i < gResults.size(); ++i) {
+            const auto &result = gResults[i];
+            out << "  {\"benchmark\": \"" << escapeJson(result.benchmark)
+                << "\", \"variant\": \"" << escapeJson(result.variant)
+                << "\", \"metric\": \"" << escapeJson(result.metric)
+                << "\", \"value\": " << result.value
+                << ", \"unit\": \"" << escapeJson(result.unit) << "\"}"
+                << (i + 1 < gResults.size() ? ",\n" : "\n");
+        }
+        out << "]\n";
+    }
+
+    Options parse(int argc, char **argv) {
+        Options options;
+        for (auto i = 1; i + 1 < argc; i += 2) {
+            if (std::strcmp(argv[i], "--csv") == 0) {
+                options.csvPath = argv[i + 1];
+            } else if (std::strcmp(argv[i], "--json") == 0) {
+                options.jsonPath = argv[i + 1];
+            } else if (std::strcmp(argv[i], "--iterations") == 0) {
+                options.iterations = std::max(10, std::atoi(argv[i + 1]));
+            } else if (std::strcmp(argv[i], "--threads") == 0) {
+                options.threads = std::max(1, std::atoi(argv[i + 1]));
+            } else if (std::strcmp(argv[i], "--shards") == 0) {
+                options.shards = std::max(1, std::atoi(argv[i + 1]));
+            } else if (std::strcmp(argv[i], "--tfjs-shards") == 0) {
+                options.tfjsShards = std::max(1, std::atoi(argv[i + 1]));
+            } else if (std::strcmp(argv[i], "--backend") == 0) {
+                options.backend = argv[i + 1];
+                tfjs::Backend backend;
+                if (!backend_named(options.backend, backend)) {
+                    // Otherwise the predict rows would silently measure whatever tf.js picked.
+                    std::fprintf(stderr, "unknown --backend %s, expected cpu, wasm or webgl\n", argv[i + 1]);
+                    std::exit(1);
+                }
+            }
+        }
+        return options;
+    }
+}// namespace
+
+int main(int argc, char **argv) {
+    auto options = parse(argc, argv);
+    tfjs::set_shards(options.tfjsShards);
+    bench_executors(options);
+    bench_lanes(options);
+    bench_wake(options);
+    bench_dispatch(options);
+    bench_overload(options);
+    bench_preprocess(options);
+    select_backend(options);
+    bench_predict(options);
+    bench_predict_throughput(options);
+    bench_pipeline(options);
+    bench_load_buffer_memory();
+    bench_model_cache();
+    if (!options.csvPath.empty()) {
+        write_csv(options.csvPath);
+    }
+    if (!options.jsonPath.empty()) {
+        write_json(options.jsonPath);
+    }
+    return 0;
+}
@@ -0,0 +1,210 @@
+#include "bridge_trace.hpp"
+
+#include <iomanip>
+#include <ostream>
+
+namespace {
+    using Utils::trace::LatencyHistogram;
+    using Utils::trace::PHASE_COUNT;
+
+#if SYNC_TO_ASYNC_TRACING
+    // Distinct Javascript functions that can be traced. Calls to functions
+    // beyond this are not recorded.
+    constexpr std::size_t kMaxFunctions = 64;
+
+    struct FunctionEntry {
+        std::atomic<const void *> key{nullptr};
+        std::atomic<const char *> name{nullptr};
+        std::array<LatencyHistogram, PHASE_COUNT> phases;
+    };
+
+    std::array<FunctionEntry, kMaxFunctions> gFunctions;
+
+    // Open addressing over a fixed table. Entries are claimed with a CAS and
+    // never released, so lookups need no lock.
+    FunctionEntry *entryFor(const void *key) {
+        auto start = (reinterpret_cast<std::uintptr_t>(key) >> 3) % kMaxFunctions;
+        for (std::size_t probe = 0; probe < kMaxFunctions; ++probe) {
+            auto &entry = gFunctions[(start + probe) % kMaxFunctions];
+            auto current = entry.key.load(std::memory_order_acquire);
+            if (current == key) {
+                return &entry;
+            }
+            if (current == nullptr) {
+                const void *expected = nullptr;
+                if (entry.key.compare_exchange_strong(expected, key, std::memory_order_acq_rel) ||
+                    expected == key) {
+                    return &entry;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    void addPhase(FunctionEntry &entry, Utils::trace::Phase phase, std::uint64_t from, std::uint64_t to) {
+        if (from != 0 && to >= from) {
+            entry.phases[phase].add(to - from);
+        }
+    }
+#endif
+}// namespace
+
+const char *Utils::trace::phase_name(Phase phase) {
+    switch (phase) {
+        case QUEUE_WAIT:
+            return "queue_wait";
+        case DISPATCH:
+            return "dispatch";
+        case JS:
+            return "js";
+        case WAKE:
+            return "wake";
+        case TOTAL:
+            return "total";
+        default:
+            return "unknown";
+    }
+}
+
+std::size_t Utils::trace::LatencyHistogram::bucketFor(std::uint64_t ns) {
+    if (ns < 4) {
+        return static_cast<std::size_t>(ns);
+    }
+    std::size_t exponent = 63;
+    while (!(ns >> exponent)) {
+        --exponent;
+    }
+    auto sub = static_cast<std::size_t>((ns >> (exponent - 2)) & 3);
+    auto bucket = 4 * (exponent - 1) + sub;
+    return bucket < kBucketCount ? bucket : kBucketCount - 1;
+}
+
+std::uint64_t Utils::trace::LatencyHistogram::bucketUpperBound(std::size_t bucket) {
+    if (bucket < 4) {
+        return bucket;
+    }
+    auto exponent = bucket / 4 + 1;
+    auto sub = bucket % 4;
+    return ((5 + sub) << (exponent - 2)) - 1;
+}
+
+void Utils::trace::LatencyHistogram::add(std::uint64_t ns) {
+    mBuckets[bucketFor(ns)].fetch_add(1, std::memory_order_relaxed);
+    mCount.fetch_add(1, std::memory_order_relaxed);
+    auto currentMax = mMax.load(std::memory_order_relaxed);
+    while (ns > currentMax && !mMax.compare_exchange_weak(currentMax, ns, std::memory_order_relaxed)) {
+    }
+}
+
+void Utils::trace::LatencyHistogram::reset() {
+    for (auto &bucket : mBuckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    mCount.store(0, std::memory_order_relaxed);
+    mMax.store(0, std::memory_order_relaxed);
+}
+
+std::uint64_t Utils::trace::LatencyHistogram::quantile(double q) const {
+    // Sum the buckets instead of trusting mCount, which may be ahead of them
+    // while other threads are adding.
+    std::uint64_t total = 0;
+    for (auto &bucket : mBuckets) {
+        total += bucket.load(std::memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    auto rank = static_cast<std::uint64_t>(q * static_cast<double>(total - 1)) + 1;
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < kBucketCount; ++i) {
+        seen += mBuckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            auto bound = bucketUpperBound(i);
+            auto currentMax = max();
+            return bound < currentMax ? bound : currentMax;
+        }
+    }
+    return max();
+}
+
+void Utils::trace::record(const CallTrace &call) {
+#if SYNC_TO_ASYNC_TRACING
+    auto *entry = entryFor(call.key);
+    if (!entry) {
+        return;
+    }
+    addPhase(*entry, QUEUE_WAIT, call.start, call.acquired);
+    addPhase(*entry, DISPATCH, call.acquired, call.jsStarted);
+    addPhase(*entry, JS, call.jsStarted, call.resumed);
+    addPhase(*entry, WAKE, call.resumed, call.woken);
+    addPhase(*entry, TOTAL, call.start, call.woken);
+#else
+    (void) call;
+#endif
+}
+
+void Utils::trace::set_name(const void *key, const char *name) {
+#if SYNC_TO_ASYNC_TRACING
+    if (auto *entry = entryFor(key)) {
+        entry->name.store(name, std::memory_order_release);
+    }
+#else
+    (void) key;
+    (void) name;
+#endif
+}
+
+std::vector<Utils::trace::FunctionStats> Utils::trace::snapshot() {
+    std::vector<FunctionStats> stats;
+#if SYNC_TO_ASYNC_TRACING
+    for (auto &entry : gFunctions) {
+        auto key = entry.key.load(std::memory_order_acquire);
+        if (key == nullptr) {
+            continue;
+        }
+        FunctionStats function{key, entry.name.load(std::memory_order_acquire), {}};
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+            auto &histogram = entry.phases[phase];
+            function.phases[phase] = {histogram.count(), histogram.quantile(0.5), histogram.quantile(0.99), histogram.max()};
+        }
+        stats.push_back(function);
+    }
+#endif
+    return stats;
+}
+
+void Utils::trace::dump(std::ostream &out) {
+    auto stats = snapshot();
+    if (stats.empty()) {
+        out << "sync-to-async trace: no calls recorded"
+            << (SYNC_TO_ASYNC_TRACING ? "" : " (built without SYNC_TO_ASYNC_TRACING)") << "\n";
+        return;
+    }
+    auto us = [](std::uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+    out << std::fixed << std::setprecision(1);
+    for (const auto &function : stats) {
+        if (function.name) {
+            out << function.name << "\n";
+        } else {
+            out << function.key << "\n";
+        }
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+            const auto &s = function.phases[phase];
+            out << "  " << std::setw(10) << phase_name(static_cast<Phase>(phase))
+                << "  count " << std::setw(8) << s.count
+                << "  p50 " << std::setw(10) << us(s.p50_ns) << " us"
+                << "  p99 " << std::setw(10) << us(s.p99_ns) << " us"
+                << "  max " << std::setw(10) << us(s.max_ns) << " us\n";
+        }
+    }
+}
+
+void Utils::trace::reset() {
+#if SYNC_TO_ASYNC_TRACING
+    for (auto &entry : gFunctions) {
+        for (auto &histogram : entry.phases) {
+            histogram.reset();
+        }
+    }
+#endif
+}
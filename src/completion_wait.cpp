@@ -0,0 +1,78 @@
+#include "completion_wait.hpp"
+
+#include <emscripten/threading.h>
+
+#include <climits>
+#include <cmath>
+
+static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t), "futexes need a plain 32 bit word");
+
+namespace {
+    std::atomic<std::int64_t> gSpinNs{std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                              std::chrono::microseconds(SYNC_TO_ASYNC_WAIT_SPIN_US))
+                                              .count()};
+
+    volatile void *address(const std::atomic<std::uint32_t> &word) {
+        return const_cast<std::atomic<std::uint32_t> *>(&word);
+    }
+
+    // True if word changed within the spin budget.
+    bool spin_while(const std::atomic<std::uint32_t> &word, std::uint32_t value) {
+        auto spin = gSpinNs.load(std::memory_order_relaxed);
+        if (spin <= 0) {
+            return false;
+        }
+        auto end = std::chrono::steady_clock::now() + std::chrono::nanoseconds(spin);
+        do {
+            // Reading the clock costs more than a load, so check a few times per read.
+            for (auto i = 0; i < 64; ++i) {
+                if (word.load(std::memory_order_acquire) != value) {
+                    return true;
+                }
+            }
+        } while (std::chrono::steady_clock::now() < end);
+        return false;
+    }
+}// namespace
+
+void Utils::set_wait_spin(std::chrono::microseconds spin) {
+    gSpinNs = std::chrono::duration_cast<std::chrono::nanoseconds>(spin).count();
+}
+
+std::chrono::microseconds Utils::wait_spin() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::nanoseconds(gSpinNs.load()));
+}
+
+void Utils::detail::wait_while(const std::atomic<std::uint32_t> &word, std::uint32_t value) {
+    if (spin_while(word, value)) {
+        return;
+    }
+    // The futex only sleeps if the word still holds `value`, so a wake
+    // between the load and the wait is not lost.
+    while (word.load(std::memory_order_acquire) == value) {
+        emscripten_futex_wait(address(word), value, INFINITY);
+    }
+}
+
+bool Utils::detail::wait_while_until(const std::atomic<std::uint32_t> &word, std::uint32_t value,
+                                     std::chrono::steady_clock::time_point deadline) {
+    if (spin_while(word, value)) {
+        return true;
+    }
+    while (word.load(std::memory_order_acquire) == value) {
+        auto left = std::chrono::duration<double, std::milli>(deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0) {
+            return false;
+        }
+        emscripten_futex_wait(address(word), value, left);
+    }
+    return true;
+}
+
+void Utils::detail::wake_one(std::atomic<std::uint32_t> &word) {
+    emscripten_futex_wake(address(word), 1);
+}
+
+void Utils::detail::wake_all(std::atomic<std::uint32_t> &word) {
+    emscripten_futex_wake(address(word), INT_MAX);
+}
@@ -0,0 +1,247 @@
+#include "host/event_loop.hpp"
+
+#include <emscripten.h>
+#include <emscripten/proxying.h>
+#include <emscripten/threading.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <memory>
+#include <unordered_map>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    struct PthreadHash {
+        std::size_t operator()(pthread_t thread) const { return std::hash<unsigned long>()(static_cast<unsigned long>(thread)); }
+    };
+    struct PthreadEqual {
+        bool operator()(pthread_t a, pthread_t b) const { return pthread_equal(a, b) != 0; }
+    };
+
+    std::mutex gLoopsMutex;
+    std::unordered_map<pthread_t, std::unique_ptr<host::EventLoop>, PthreadHash, PthreadEqual> gLoops;
+
+    // Forgets the loop of a thread when it exits, so a later thread that gets
+    // the same pthread_t starts with an empty loop.
+    struct LoopOwner {
+        ~LoopOwner() {
+            std::lock_guard<std::mutex> lock(gLoopsMutex);
+            gLoops.erase(pthread_self());
+        }
+    };
+
+    // Lives on the stack of the thread waiting in emscripten_proxy_sync.
+    struct SyncTask {
+        void (*func)(void *) = nullptr;
+        void *arg = nullptr;
+        std::mutex mutex;
+        std::condition_variable done;
+        bool finished = false;
+
+        static void run(void *task) {
+            auto *self = static_cast<SyncTask *>(task);
+            self->func(self->arg);
+            std::lock_guard<std::mutex> lock(self->mutex);
+            self->finished = true;
+            self->done.notify_one();
+        }
+    };
+}// namespace
+
+void host::EventLoop::post(TaskFunc func, void *arg, Clock::duration delay) {
+    // Notify while holding the lock: the task may make the thread exit, which
+    // destroys this loop as soon as the thread can see the task.
+    std::lock_guard<std::mutex> lock(mMutex);
+    mTasks.push_back(Entry{Clock::now() + delay, mSequence++, func, arg});
+    std::push_heap(mTasks.begin(), mTasks.end(), Later());
+    mWakeup.notify_one();
+}
+
+void host::EventLoop::post(Task task, Clock::duration delay) {
+    post(
+            [](void *arg) {
+                std::unique_ptr<Task> owned(static_cast<Task *>(arg));
+                (*owned)();
+            },
+            new Task(std::move(task)), delay);
+}
+
+bool host::EventLoop::next(Entry &task, bool block) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        if (!mTasks.empty()) {
+            auto due = mTasks.front().due;
+            if (due <= Clock::now()) {
+                std::pop_heap(mTasks.begin(), mTasks.end(), Later());
+                task = mTasks.back();
+                mTasks.pop_back();
+                return true;
+            }
+            if (!block) {
+                return false;
+            }
+            mWakeup.wait_until(lock, due);
+        } else {
+            if (!block) {
+                return false;
+            }
+            mWakeup.wait(lock);
+        }
+    }
+}
+
+void host::EventLoop::run() {
+    Entry task;
+    while (true) {
+        next(task, true);
+        task.func(task.arg);
+    }
+}
+
+void host::EventLoop::runPending() {
+    Entry task;
+    while (next(task, false)) {
+        task.func(task.arg);
+    }
+}
+
+host::EventLoop &host::EventLoop::current() {
+    thread_local LoopOwner owner;
+    return of(pthread_self());
+}
+
+host::EventLoop &host::EventLoop::of(pthread_t thread) {
+    std::lock_guard<std::mutex> lock(gLoopsMutex);
+    auto &loop = gLoops[thread];
+    if (!loop) {
+        loop.reset(new EventLoop());
+    }
+    return *loop;
+}
+
+extern "C" {
+
+void emscripten_async_call(em_arg_callback_func func, void *arg, int millis) {
+    host::EventLoop::current().post(func, arg, std::chrono::milliseconds(millis));
+}
+
+void emscripten_exit_with_live_runtime(void) {
+    host::EventLoop::current().run();
+}
+
+#if defined(__linux__)
+
+int emscripten_futex_wait(volatile void *addr, uint32_t val, double maxWaitMilliseconds) {
+    timespec timeout{};
+    timespec *limit = nullptr;
+    if (!std::isinf(maxWaitMilliseconds)) {
+        auto nanos = static_cast<long long>(maxWaitMilliseconds * 1e6);
+        timeout.tv_sec = static_cast<time_t>(nanos / 1000000000);
+        timeout.tv_nsec = static_cast<long>(nanos % 1000000000);
+        limit = &timeout;
+    }
+    if (syscall(SYS_futex, const_cast<void *>(addr), FUTEX_WAIT_PRIVATE, val, limit, nullptr, 0) == 0) {
+        return 0;
+    }
+    return errno == ETIMEDOUT ? -ETIMEDOUT : errno == EAGAIN ? -EWOULDBLOCK : 0;
+}
+
+int emscripten_futex_wake(volatile void *addr, int count) {
+    return static_cast<int>(syscall(SYS_futex, const_cast<void *>(addr), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0));
+}
+
+#else
+
+// Without futexes every waiter sleeps on one condition. Correct, but wakes
+// all of them.
+namespace {
+    std::mutex gFutexMutex;
+    std::condition_variable gFutexWake;
+}// namespace
+
+int emscripten_futex_wait(volatile void *addr, uint32_t val, double maxWaitMilliseconds) {
+    std::unique_lock<std::mutex> lock(gFutexMutex);
+    if (*static_cast<volatile uint32_t *>(addr) != val) {
+        return -EWOULDBLOCK;
+    }
+    if (std::isinf(maxWaitMilliseconds)) {
+        gFutexWake.wait(lock);
+        return 0;
+    }
+    auto limit = std::chrono::duration<double, std::milli>(maxWaitMilliseconds);
+    return gFutexWake.wait_for(lock, limit) == std::cv_status::timeout ? -ETIMEDOUT : 0;
+}
+
+int emscripten_futex_wake(volatile void *, int count) {
+    { std::lock_guard<std::mutex> lock(gFutexMutex); }
+    gFutexWake.notify_all();
+    return count;
+}
+
+#endif
+
+double emscripten_get_now(void) {
+    return std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+// The host queue has no state of its own, work goes straight to the loop of
+// the target thread.
+struct em_proxying_queue {};
+
+em_proxying_queue *em_proxying_queue_create(void) {
+    return new em_proxying_queue();
+}
+
+void em_proxying_queue_destroy(em_proxying_queue *q) {
+    delete q;
+}
+
+em_proxying_queue *emscripten_proxy_get_system_queue(void) {
+    static em_proxying_queue systemQueue;
+    return &systemQueue;
+}
+
+void emscripten_proxy_execute_queue(em_proxying_queue *) {
+    host::EventLoop::current().runPending();
+}
+
+int emscripten_proxy_async(em_proxying_queue *, pthread_t target_thread, void (*func)(void *), void *arg) {
+    host::EventLoop::of(target_thread).post(func, arg);
+    return 1;
+}
+
+int emscripten_proxy_sync(em_proxying_queue *, pthread_t target_thread, void (*func)(void *), void *arg) {
+    if (pthread_equal(target_thread, pthread_self())) {
+        func(arg);
+        return 1;
+    }
+    SyncTask task;
+    task.func = func;
+    task.arg = arg;
+    host::EventLoop::of(target_thread).post(&SyncTask::run, &task);
+    std::unique_lock<std::mutex> lock(task.mutex);
+    task.done.wait(lock, [&]() { return task.finished; });
+    return 1;
+}
+
+}// extern "C"
+
+bool emscripten::ProxyingQueue::proxyAsync(const pthread_t target, std::function<void()> &&func) {
+    host::EventLoop::of(target).post(std::move(func));
+    return true;
+}
+
+bool emscripten::ProxyingQueue::proxySync(const pthread_t target, const std::function<void()> &func) {
+    return emscripten_proxy_sync(
+                   queue, target, [](void *arg) { (*static_cast<const std::function<void()> *>(arg))(); },
+                   const_cast<std::function<void()> *>(&func)) == 1;
+}
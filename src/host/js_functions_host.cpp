@@ -0,0 +1,219 @@
+// Native stand-ins for the Javascript functions in src/js_functions.js, used by
+// the host backend. They follow the same protocol: run on the thread the
+// executor dispatched them to, and finish by calling resume_execution, either
+// right away or later from that thread's event loop like a settled promise.
+//
+// tf.js does not exist on the host, so the tfjs functions report an error.
+#include "../js_includes.hpp"
+#include "tfjs.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+namespace {
+    struct PendingResume {
+        Utils::SyncToAsync::Callback callback;
+        int *statusPointer;
+        int status;
+    };
+
+    // Like resolving a promise after `delayMs`: resume from the event loop of
+    // the current thread.
+    void resume_later(Utils::SyncToAsync::Callback callback, int *statusPointer, int status, int delayMs) {
+        emscripten_async_call(
+                [](void *arg) {
+                    auto *pending = static_cast<PendingResume *>(arg);
+                    resume_execution(pending->callback, pending->statusPointer, pending->status);
+                    delete pending;
+                },
+                new PendingResume{callback, statusPointer, status},
+                delayMs);
+    }
+
+    void no_tfjs(const char *function, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+        std::cout << function << ": tf.js is not available on the host backend" << std::endl;
+        resume_execution(callback, statusPointer, Utils::ERROR);
+    }
+
+    // js_resume_bytes of js_functions.js.
+    void resume_bytes(Utils::Completion *callback, Utils::JsReturn *ret, int status, const void *data, std::size_t size) {
+        if (size <= ret->capacity) {
+            std::memcpy(ret->arena, data, size);
+        }
+        resume_execution_bytes(callback, ret, status, static_cast<std::uint32_t>(size));
+    }
+}// namespace
+
+extern "C" {
+
+void log_data(const char *data, Utils::Completion *callback, int *statusPointer) {
+    std::cout << "I am in log data" << std::endl;
+    std::cout << data << std::endl;
+    resume_execution(callback, statusPointer, Utils::OK);
+}
+
+void log_multiple(const char *data1, const char *data2, Utils::Completion *callback, int *statusPointer) {
+    std::cout << data1 << std::endl;
+    std::cout << data2 << std::endl;
+    resume_execution(callback, statusPointer, Utils::OK);
+}
+
+void error_func(Utils::Completion *callback, int *statusPointer) {
+    resume_execution(callback, statusPointer, Utils::ERROR);
+}
+
+void noop_func(Utils::Completion *callback, int *statusPointer) {
+    resume_execution(callback, statusPointer, Utils::OK);
+}
+
+void echo_status(int status, Utils::Completion *callback, int *statusPointer) {
+    resume_execution(callback, statusPointer, status);
+}
+
+void scale_i64(int value, int shift, Utils::Completion *callback, Utils::JsReturn *ret) {
+    auto scaled = static_cast<std::uint64_t>(static_cast<std::int64_t>(value)) << shift;
+    resume_execution_i64(callback, ret, Utils::OK,
+                         static_cast<std::uint32_t>(scaled), static_cast<std::uint32_t>(scaled >> 32));
+}
+
+void half_f64(int value, Utils::Completion *callback, Utils::JsReturn *ret) {
+    resume_execution_f64(callback, ret, Utils::OK, value / 2.0);
+}
+
+void repeat_text(const char *text, int times, Utils::Completion *callback, Utils::JsReturn *ret) {
+    if (times < 0) {
+        resume_bytes(callback, ret, Utils::ERROR, "", 0);
+        return;
+    }
+    std::string repeated;
+    for (int i = 0; i < times; ++i) {
+        repeated += text;
+    }
+    resume_bytes(callback, ret, Utils::OK, repeated.data(), repeated.size());
+}
+
+void sample_memory_usage(double *out, Utils::Completion *callback, int *statusPointer) {
+    long pages = 0;
+    long residentPages = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> pages >> residentPages;
+    out[0] = static_cast<double>(residentPages) * static_cast<double>(sysconf(_SC_PAGESIZE));
+    out[1] = 0;
+    out[2] = 0;
+    resume_execution(callback, statusPointer, Utils::OK);
+}
+
+// The host event loop has no timer clamp, so every Dispatch is a plain post.
+void sync_to_async_post(void (*func)(void *), void *arg, int) {
+    emscripten_async_call(func, arg, 0);
+}
+
+void busy_func(int busy_us, Utils::Completion *callback, int *statusPointer) {
+    auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(busy_us);
+    while (std::chrono::steady_clock::now() < end) {
+    }
+    resume_execution(callback, statusPointer, Utils::OK);
+}
+
+void long_running_func(int delay_in_ms, Utils::Completion *callback, int *statusPointer) {
+    resume_later(callback, statusPointer, Utils::OK, delay_in_ms);
+}
+
+void import_tfjs(Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("import_tfjs", callback, statusPointer);
+}
+
+void check_pretfjs(Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    resume_execution(callback, statusPointer, Utils::ERROR);
+}
+
+void check_if_on_thread(Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    resume_execution(callback, statusPointer, Utils::OK);
+}
+
+void load_graph_model_from_path(int, const char *, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("load_graph_model_from_path", callback, statusPointer);
+}
+
+void load_layer_model_from_path(int, const char *, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("load_layer_model_from_path", callback, statusPointer);
+}
+
+void load_graph_model_from_buffers(int, const char *, const void *, const int, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("load_graph_model_from_buffers", callback, statusPointer);
+}
+
+void load_layer_model_from_buffers(int, const char *, const void *, const int, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("load_layer_model_from_buffers", callback, statusPointer);
+}
+
+void predict_in_js(int, const void *, int, const int, const int *const, const int, void *const, int, const int, int *, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("predict_in_js", callback, statusPointer);
+}
+
+void register_staging_arena(int, float *, int, int, int, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    resume_execution(callback, statusPointer, Utils::OK);
+}
+
+void predict_staged(int, int, int, int, const int *, int, int, int *, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("predict_staged", callback, statusPointer);
+}
+
+void dispose_model(int, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("dispose_model", callback, statusPointer);
+}
+
+void model_output_shape(int, Utils::SyncToAsync::Callback callback, Utils::JsReturn *ret) {
+    no_tfjs("model_output_shape", callback, &ret->status);
+}
+
+void tfjs_memory(Utils::SyncToAsync::Callback callback, Utils::JsReturn *ret) {
+    no_tfjs("tfjs_memory", callback, &ret->status);
+}
+
+void set_tfjs_backend(const char *, const char *, int, int, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("set_tfjs_backend", callback, statusPointer);
+}
+
+void tfjs_backend_name(Utils::SyncToAsync::Callback callback, Utils::JsReturn *ret) {
+    no_tfjs("tfjs_backend_name", callback, &ret->status);
+}
+
+void upload_tensor(const void *, int, int, const int *, int, int, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("upload_tensor", callback, statusPointer);
+}
+
+void predict_tensor(int, int, int, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("predict_tensor", callback, statusPointer);
+}
+
+void crop_and_resize_tensor(int, const float *, int, int, int, int, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("crop_and_resize_tensor", callback, statusPointer);
+}
+
+void download_tensor(int, void *, int, int, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("download_tensor", callback, statusPointer);
+}
+
+void tensor_shape(int, Utils::SyncToAsync::Callback callback, Utils::JsReturn *ret) {
+    no_tfjs("tensor_shape", callback, &ret->status);
+}
+
+void dispose_tensor(int, Utils::SyncToAsync::Callback callback, int *statusPointer) {
+    no_tfjs("dispose_tensor", callback, statusPointer);
+}
+
+void model_bundle(int, Utils::SyncToAsync::Callback callback, Utils::JsReturn *ret) {
+    no_tfjs("model_bundle", callback, &ret->status);
+}
+
+void warmup_model(int, const int *, int, int, Utils::SyncToAsync::Callback callback, Utils::JsReturn *ret) {
+    no_tfjs("warmup_model", callback, &ret->status);
+}
+
+}// extern "C"
@@ -0,0 +1,34 @@
+#include "js_coroutine.hpp"
+
+Utils::coro::JsScheduler::JsScheduler() : mThread{threadMain, this} {}
+
+Utils::coro::JsScheduler::~JsScheduler() {
+    // Leave the event loop from the inside, like the QueuedSyncToAsync returner.
+    mQueue.proxyAsync(mThread.native_handle(), [] { pthread_exit(nullptr); });
+    mThread.join();
+}
+
+Utils::coro::detail::Detached Utils::coro::JsScheduler::drive(Task<void> task, JsScheduler *scheduler) {
+    co_await task;
+    scheduler->mActive--;
+}
+
+void Utils::coro::JsScheduler::start(void *handle) {
+    std::coroutine_handle<>::from_address(handle).resume();
+}
+
+void Utils::coro::JsScheduler::spawn(Task<void> task) {
+    mActive++;
+    // The driver is created suspended here and first resumed on the scheduler
+    // thread. Proxied through the C API, so only its frame is allocated.
+    auto driver = drive(std::move(task), this);
+    auto queued = emscripten_proxy_async(mQueue.queue, mThread.native_handle(), &JsScheduler::start,
+                                         driver.handle.address());
+    assert(queued == 1);
+    (void) queued;
+}
+
+Utils::coro::JsScheduler &Utils::coro::JsScheduler::getScheduler() {
+    static JsScheduler instance;
+    return instance;
+}
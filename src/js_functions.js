@@ -35,12 +35,83 @@ function check_if_on_thread(fn_to_continue_in_cpp, status_pointer) {
     }
 }
 
+// One MessageChannel per thread. Every message runs the oldest posted callback.
+function sync_to_async_channel() {
+    if (!sync_to_async_channel.port) {
+        const channel = new MessageChannel();
+        const pending = [];
+        channel.port1.onmessage = () => pending.shift()();
+        // Under Node an open port would keep the thread alive on its own.
+        if (channel.port1.unref) {
+            channel.port1.unref();
+        }
+        sync_to_async_channel.port = channel.port2;
+        sync_to_async_channel.pending = pending;
+    }
+    return sync_to_async_channel;
+}
+
+// Runs the C function pointer func(arg) on this thread's event loop, for
+// Utils::Dispatch. emscripten_async_call goes through setTimeout, which
+// browsers clamp to 4ms once timeouts nest. Mode 1 posts a MessageChannel
+// message, a task without the clamp. Mode 2 queues a microtask, which runs as
+// soon as the current task returns to the event loop.
+function sync_to_async_post(func, arg, mode) {
+    const run = () => callUserCallback(() => getWasmTableEntry(func)(arg));
+    if (mode === 2) {
+        queueMicrotask(run);
+        return;
+    }
+    const channel = sync_to_async_channel();
+    channel.pending.push(run);
+    channel.port.postMessage(0);
+}
+
+// Resuming with a value, for functions declared with a Utils::JsReturn * in
+// place of the status pointer (see include/js_result.hpp). The value is passed
+// back in the same call that resumes C++.
+
+// value can be a Number or a BigInt. It is passed as two 32 bit halves, which
+// works with and without WASM_BIGINT.
+function js_resume_i64(callback, return_ptr, status, value) {
+    const bits = BigInt.asUintN(64, BigInt(value));
+    const low = Number(bits & BigInt(0xffffffff));
+    const high = Number(bits >> BigInt(32));
+    Module._resume_execution_i64(callback, return_ptr, status, low, high);
+}
+
+function js_resume_f64(callback, return_ptr, status, value) {
+    Module._resume_execution_f64(callback, return_ptr, status, value);
+}
+
+// Copies bytes (any typed array or ArrayBuffer) into the caller's arena. If it
+// does not fit nothing is copied, and C++ learns the size it needs.
+function js_resume_bytes(callback, return_ptr, status, bytes) {
+    const view = ArrayBuffer.isView(bytes)
+        ? new Uint8Array(bytes.buffer, bytes.byteOffset, bytes.byteLength)
+        : new Uint8Array(bytes);
+    // Layout of Utils::JsReturn: status, kind, arena, capacity
+    const arena = Module.HEAPU32[(return_ptr >> 2) + 2];
+    const capacity = Module.HEAPU32[(return_ptr >> 2) + 3];
+    if (view.length <= capacity) {
+        Module.HEAPU8.set(view, arena);
+    }
+    Module._resume_execution_bytes(callback, return_ptr, status, view.length);
+}
+
+// Strings are returned as UTF-8, without a terminating null.
+function js_resume_string(callback, return_ptr, status, text) {
+    js_resume_bytes(callback, return_ptr, status, new TextEncoder().encode(text));
+}
+
+// Loaded models are kept in Module.tfjsModels, indexed by the integer id
+// that tfjs::Model allocated on the C++ side.
 function load_graph_model_from_path(model_id, path, fn_to_continue_in_cpp, status_pointer) {
     console.log('Loading Graph model from path');
     let model_path = UTF8ToString(path);
-    let name = UTF8ToString(model_id);
+    const models = Module.tfjsModels || (Module.tfjsModels = []);
     tf.loadGraphModel(model_path).then((model) => {
-        Module[name] = model;
+        models[model_id] = model;
         Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 0);
     }).catch(err => {
         console.log(err);
@@ -51,10 +122,10 @@ function load_graph_model_from_path(model_id, path, fn_to_continue_in_cpp, statu
 function load_layer_model_from_path(model_id, path, fn_to_continue_in_cpp, status_pointer) {
     console.log('Loading layers model from path');
     let model_path = UTF8ToString(path);
-    let name = UTF8ToString(model_id);
+    const models = Module.tfjsModels || (Module.tfjsModels = []);
 
     tf.loadLayersModel(model_path).then((model) => {
-        Module[name] = model;
+        models[model_id] = model;
         Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 0);
     }).catch(err => {
         console.log(err);
@@ -62,33 +133,61 @@ function load_layer_model_from_path(model_id, path, fn_to_continue_in_cpp, statu
     });
 }
 
-function load_graph_model_from_buffer(model_id, topology, weights_ptr, weight_size, fn_to_continue_in_cpp, status_pointer) {
+// Build tf.js model artifacts from a topology string and a list of weight
+// shards living in the wasm heap. shards_ptr points to shard_count
+// { const unsigned char *data; int size; } records, in weightsManifest order.
+//
+// Only the weight bytes are copied, once, straight into a buffer tf.js can own.
+// The heap views are created and consumed synchronously, before anything is
+// awaited, so a heap growth during the load can't detach them.
+function tfjs_model_artifacts(topology, shards_ptr, shard_count) {
+    const json = JSON.parse(UTF8ToString(topology));
+    let total = 0;
+    for (let i = 0; i < shard_count; i++) {
+        total += Module.HEAP32[(shards_ptr >> 2) + 2 * i + 1];
+    }
+    const weightData = new Uint8Array(total);
+    let offset = 0;
+    for (let i = 0; i < shard_count; i++) {
+        const ptr = Module.HEAPU32[(shards_ptr >> 2) + 2 * i];
+        const size = Module.HEAP32[(shards_ptr >> 2) + 2 * i + 1];
+        weightData.set(Module.HEAPU8.subarray(ptr, ptr + size), offset);
+        offset += size;
+    }
+    // Accept both the model.json layout (weightsManifest) and plain artifacts (weightSpecs)
+    let weightSpecs = json.weightSpecs;
+    if (!weightSpecs && json.weightsManifest) {
+        weightSpecs = [];
+        for (const group of json.weightsManifest) {
+            weightSpecs.push(...group.weights);
+        }
+    }
+    return {
+        modelTopology: json.modelTopology,
+        format: json.format,
+        generatedBy: json.generatedBy,
+        convertedBy: json.convertedBy,
+        signature: json.signature,
+        userDefinedMetadata: json.userDefinedMetadata,
+        modelInitializer: json.modelInitializer,
+        weightSpecs: weightSpecs,
+        weightData: weightData.buffer
+    };
+}
+
+function load_graph_model_from_buffers(model_id, topology, shards_ptr, shard_count, fn_to_continue_in_cpp, status_pointer) {
     console.log('Loading Graph model from buffer');
-    let name = UTF8ToString(model_id);
-    class ModelHandler
-    {
-        constructor(topology, weights_ptr, weight_size) {
-            const array = new Uint8Array(Module.HEAPU8.buffer, weights_ptr, weight_size);
-            this.model = JSON.parse(topology);
-            this.model.weightData = array.buffer;
-        }
-        async load()
-        {
-            return new Promise((resolve, reject) => {
-                try {
-                    resolve(this.model);
-                }
-                catch (err)
-                {
-                    console.log(err);
-                    throw err;
-                }
-            })
-        }
-    }
-    const model = new ModelHandler(topology, weights_ptr, weight_size);
-    tf.loadGraphModel(model).then((modelGraph) => {
-        Module[name] = modelGraph;
+    const models = Module.tfjsModels || (Module.tfjsModels = []);
+    let artifacts;
+    try {
+        artifacts = tfjs_model_artifacts(topology, shards_ptr, shard_count);
+    } catch (err) {
+        console.log(err);
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 1);
+        return;
+    }
+    tf.loadGraphModel(tf.io.fromMemory(artifacts)).then((modelGraph) => {
+        models[model_id] = modelGraph;
         Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 0);
     }).catch(err => {
         console.log(err);
@@ -96,33 +195,19 @@ function load_graph_model_from_buffer(model_id, topology, weights_ptr, weight_si
     });
 }
 
-function load_layer_model_from_buffer(model_id, topology, weights_ptr, weight_size, fn_to_continue_in_cpp, status_pointer) {
+function load_layer_model_from_buffers(model_id, topology, shards_ptr, shard_count, fn_to_continue_in_cpp, status_pointer) {
     console.log('Loading Layers model from buffer');
-    let name = UTF8ToString(model_id);
-    class ModelHandler
-    {
-        constructor(topology, weights_ptr, weight_size) {
-            this.array = new Uint8Array(Module.HEAPU8.buffer, weights_ptr, weight_size);
-            this.model = JSON.parse(topology);
-            this.model.weightData = this.array.buffer;
-        }
-        async load()
-        {
-            return new Promise((resolve, reject) => {
-                try {
-                    resolve(this.model);
-                }
-                catch (err)
-                {
-                    console.log(err);
-                    throw err;
-                }
-            })
-        }
-    }
-    const model = new ModelHandler(topology, weights_ptr, weight_size);
-    tf.loadLayersModel(model).then((modelGraph) => {
-        Module[name] = modelGraph;
+    const models = Module.tfjsModels || (Module.tfjsModels = []);
+    let artifacts;
+    try {
+        artifacts = tfjs_model_artifacts(topology, shards_ptr, shard_count);
+    } catch (err) {
+        console.log(err);
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 1);
+        return;
+    }
+    tf.loadLayersModel(tf.io.fromMemory(artifacts)).then((modelGraph) => {
+        models[model_id] = modelGraph;
         Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 0);
     }).catch(err => {
         console.log(err);
@@ -130,23 +215,222 @@ function load_layer_model_from_buffer(model_id, topology, weights_ptr, weight_si
     });
 }
 
-function predict_in_js(model_id, input_ptr, input_size, input_shape_ptr, output_ptr, output_size, fn_to_continue_in_cpp, status_pointer) {
-    let name = UTF8ToString(model_id);
+// Typed array over the wasm heap for a tfjs::DType. Always built from the
+// current heap buffer, so call it again after anything asynchronous in case
+// the heap grew in the meantime.
+function tfjs_heap_view(dtype, ptr, size) {
+    switch (dtype) {
+        case 0:
+            return new Uint8Array(Module.HEAPU8.buffer, ptr, size);
+        case 1:
+            return new Int32Array(Module.HEAP32.buffer, ptr, size);
+        case 2:
+            return new Float32Array(Module.HEAPF32.buffer, ptr, size);
+    }
+    throw new Error('Unsupported dtype ' + dtype);
+}
+
+// tfjs_heap_view for writing results. uint8 values are rounded and clamped to
+// 0..255, like tf.browser.toPixels, rather than wrapped modulo 256.
+function tfjs_output_view(dtype, ptr, size) {
+    if (dtype === 0) {
+        return new Uint8ClampedArray(Module.HEAPU8.buffer, ptr, size);
+    }
+    return tfjs_heap_view(dtype, ptr, size);
+}
+
+// float32 tensor of the C++ data at input_ptr. Integer data is cast inside
+// tf.js, so callers can pass uint8 data as is. Call it inside tf.tidy.
+// tf.js keeps a Float32Array as it is, so float32 tensors share the C++
+// buffer unless copy is set; set it for tensors that outlive the call.
+function tfjs_heap_tensor(input_ptr, input_dtype, input_size, input_shape_ptr, input_rank, copy) {
+    const inputShape = Array.from(new Int32Array(Module.HEAP32.buffer, input_shape_ptr, input_rank));
+    const view = tfjs_heap_view(input_dtype, input_ptr, input_size);
+    const inputBuffer = copy ? view.slice() : view;
+    const input = tf.tensor(inputBuffer, inputShape, input_dtype === 2 ? 'float32' : 'int32');
+    return input_dtype === 2 ? input : tf.cast(input, 'float32');
+}
+
+// Runs model_id on the tensor made by make_input and passes the values of its
+// first output to write_output. make_input is called synchronously, so it can
+// hand out views of the heap; write_output runs after the outputs were
+// downloaded, so it has to build its views from the current heap buffer. The
+// number of values written is stored at written_ptr, an int.
+function tfjs_predict(model_id, make_input, output_size, write_output, written_ptr, fn_to_continue_in_cpp, status_pointer) {
+    const model = Module.tfjsModels && Module.tfjsModels[model_id];
+    let result;
     try {
-        if (!Module[name]) {
-            console.log("Inference failed");
+        if (!model) {
+            console.log("Inference failed: no model " + model_id);
+            Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 1);
             return;
         }
-        tf.tidy(() => {
-            let inputBuffer = new Float32Array(Module.HEAPF32.buffer, input_ptr, input_size);
-            let inputShape = new Int32Array(Module.HEAP32.buffer, input_shape_ptr, 4);
-            let image_tensor = tf.tensor(inputBuffer, inputShape);
-            let y = Module[name].predict(image_tensor).dataSync();
-            let outputBuffer = new Float32Array(Module.HEAPF32.buffer, output_ptr, output_size);
-            for (let i = 0; i < y.length; i++) {
-                outputBuffer[i] = y[i];
-            }
-        })
+        result = tf.tidy(() => {
+            const y = model.predict(make_input());
+            return Array.isArray(y) ? y[0] : y;
+        });
+    } catch (err) {
+        console.log(err);
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 1);
+        return;
+    }
+    result.data().then((values) => {
+        result.dispose();
+        if (values.length > output_size) {
+            throw new Error('Output has ' + values.length + ' values but the buffer holds ' + output_size);
+        }
+        write_output(values);
+        Module.HEAP32[written_ptr >> 2] = values.length;
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 0);
+    }).catch(err => {
+        console.log(err);
+        result.dispose();
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 1);
+    });
+}
+
+// Runs model_id on an input of any rank and dtype (see tfjs::DType). The output is written to output_ptr with a single typed array set, converted
+// to output_dtype.
+function predict_in_js(model_id, input_ptr, input_dtype, input_size, input_shape_ptr, input_rank, output_ptr, output_dtype, output_size, written_ptr, fn_to_continue_in_cpp, status_pointer) {
+    tfjs_predict(model_id, () => {
+        return tfjs_heap_tensor(input_ptr, input_dtype, input_size, input_shape_ptr, input_rank);
+    }, output_size, (values) => {
+        tfjs_output_view(output_dtype, output_ptr, values.length).set(values);
+    }, written_ptr, fn_to_continue_in_cpp, status_pointer);
+}
+
+// Staging arenas of tfjs::StagingArena, with a float32 view per slot input and
+// output. The views are only rebuilt when the heap grew, instead of on every call.
+function register_staging_arena(arena_id, base_ptr, slot_count, input_floats, output_floats, fn_to_continue_in_cpp, status_pointer) {
+    const arenas = Module.tfjsArenas || (Module.tfjsArenas = []);
+    arenas[arena_id] = {
+        base: base_ptr,
+        slots: slot_count,
+        inputFloats: input_floats,
+        outputFloats: output_floats,
+        buffer: null,
+        inputs: [],
+        outputs: []
+    };
+    Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 0);
+}
+
+function tfjs_arena_views(arena) {
+    if (arena.buffer !== Module.HEAPF32.buffer) {
+        arena.buffer = Module.HEAPF32.buffer;
+        const stride = (arena.inputFloats + arena.outputFloats) * 4;
+        for (let i = 0; i < arena.slots; i++) {
+            const slot = arena.base + i * stride;
+            arena.inputs[i] = new Float32Array(arena.buffer, slot, arena.inputFloats);
+            arena.outputs[i] = new Float32Array(arena.buffer, slot + arena.inputFloats * 4, arena.outputFloats);
+        }
+    }
+    return arena;
+}
+
+// predict_in_js for float32 data that is already in slot `slot` of a staging arena.
+function predict_staged(model_id, arena_id, slot, input_size, input_shape_ptr, input_rank, output_size, written_ptr, fn_to_continue_in_cpp, status_pointer) {
+    const arena = Module.tfjsArenas && Module.tfjsArenas[arena_id];
+    if (!arena) {
+        console.log("Inference failed: no staging arena " + arena_id);
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 1);
+        return;
+    }
+    tfjs_predict(model_id, () => {
+        const inputShape = Array.from(new Int32Array(Module.HEAP32.buffer, input_shape_ptr, input_rank));
+        const input = tfjs_arena_views(arena).inputs[slot];
+        return tf.tensor(input_size === input.length ? input : input.subarray(0, input_size), inputShape, 'float32');
+    }, output_size, (values) => {
+        tfjs_arena_views(arena).outputs[slot].set(values);
+    }, written_ptr, fn_to_continue_in_cpp, status_pointer);
+}
+
+// Tensors of tfjs::TensorHandle, kept in Module.tfjsTensors by the id that
+// C++ allocated. Every function that makes one stores it under output_id, and
+// runs its intermediate tensors in tf.tidy, so the table holds the only
+// tensors that outlive a call.
+function tfjs_store_tensor(output_id, make_tensor, fn_to_continue_in_cpp, status_pointer) {
+    const tensors = Module.tfjsTensors || (Module.tfjsTensors = []);
+    try {
+        tensors[output_id] = tf.tidy(make_tensor);
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 0);
+    } catch (err) {
+        console.log(err);
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 1);
+    }
+}
+
+function tfjs_tensor(tensor_id) {
+    const tensor = Module.tfjsTensors && Module.tfjsTensors[tensor_id];
+    if (!tensor) {
+        throw new Error('No tensor ' + tensor_id);
+    }
+    return tensor;
+}
+
+function upload_tensor(input_ptr, input_dtype, input_size, input_shape_ptr, input_rank, output_id, fn_to_continue_in_cpp, status_pointer) {
+    tfjs_store_tensor(output_id, () => {
+        return tfjs_heap_tensor(input_ptr, input_dtype, input_size, input_shape_ptr, input_rank, true);
+    }, fn_to_continue_in_cpp, status_pointer);
+}
+
+// Runs model_id on tensor input_id and keeps its first output as output_id.
+function predict_tensor(model_id, input_id, output_id, fn_to_continue_in_cpp, status_pointer) {
+    tfjs_store_tensor(output_id, () => {
+        const model = Module.tfjsModels && Module.tfjsModels[model_id];
+        if (!model) {
+            throw new Error('No model ' + model_id);
+        }
+        const y = model.predict(tfjs_tensor(input_id));
+        return Array.isArray(y) ? y[0] : y;
+    }, fn_to_continue_in_cpp, status_pointer);
+}
+
+// boxes_ptr points to box_count normalised [y1, x1, y2, x2] boxes, all on
+// the first image of the batch.
+function crop_and_resize_tensor(image_id, boxes_ptr, box_count, height, width, output_id, fn_to_continue_in_cpp, status_pointer) {
+    tfjs_store_tensor(output_id, () => {
+        const boxes = tf.tensor2d(new Float32Array(Module.HEAPF32.buffer, boxes_ptr, box_count * 4), [box_count, 4]);
+        const boxIndices = tf.zeros([box_count], 'int32');
+        return tf.image.cropAndResize(tfjs_tensor(image_id), boxes, boxIndices, [height, width]);
+    }, fn_to_continue_in_cpp, status_pointer);
+}
+
+// Writes the values of tensor_id to output_ptr, converted to output_dtype.
+function download_tensor(tensor_id, output_ptr, output_dtype, output_size, fn_to_continue_in_cpp, status_pointer) {
+    let tensor;
+    try {
+        tensor = tfjs_tensor(tensor_id);
+    } catch (err) {
+        console.log(err);
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 1);
+        return;
+    }
+    tensor.data().then((values) => {
+        if (values.length > output_size) {
+            throw new Error('Tensor has ' + values.length + ' values but the buffer holds ' + output_size);
+        }
+        tfjs_output_view(output_dtype, output_ptr, values.length).set(values);
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 0);
+    }).catch(err => {
+        console.log(err);
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 1);
+    });
+}
+
+function tensor_shape(tensor_id, callback, return_ptr) {
+    try {
+        js_resume_bytes(callback, return_ptr, 0, Int32Array.from(tfjs_tensor(tensor_id).shape));
+    } catch (err) {
+        console.log(err);
+        js_resume_bytes(callback, return_ptr, 1, new Int32Array(0));
+    }
+}
+
+function dispose_tensor(tensor_id, fn_to_continue_in_cpp, status_pointer) {
+    try {
+        tfjs_tensor(tensor_id).dispose();
+        Module.tfjsTensors[tensor_id] = undefined;
         Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 0);
     } catch (err) {
         console.log(err);
@@ -155,14 +439,15 @@ function predict_in_js(model_id, input_ptr, input_size, input_shape_ptr, output_
 }
 
 function dispose_model(model_id, fn_to_continue_in_cpp, status_pointer) {
-    let name = UTF8ToString(model_id);
+    const models = Module.tfjsModels || [];
 
     try {
-        if (!Module[name]) {
+        if (!models[model_id]) {
+            Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 1);
             return;
         }
-        Module[name].dispose();
-        Module[name] = undefined;
+        models[model_id].dispose();
+        models[model_id] = undefined;
         Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 0);
     } catch (err) {
         console.log(err);
@@ -170,6 +455,185 @@ function dispose_model(model_id, fn_to_continue_in_cpp, status_pointer) {
     }
 }
 
+// Shape of the first output of model_id as int32 values, -1 for dimensions
+// that are not fixed, like the batch.
+function model_output_shape(model_id, callback, return_ptr) {
+    const model = Module.tfjsModels && Module.tfjsModels[model_id];
+    try {
+        const outputs = model ? model.outputs : undefined;
+        if (!outputs || !outputs.length || !outputs[0].shape) {
+            console.log("No output shape for model " + model_id);
+            js_resume_bytes(callback, return_ptr, 1, new Int32Array(0));
+            return;
+        }
+        const shape = outputs[0].shape.map((dim) => (dim === null || dim === undefined) ? -1 : dim);
+        js_resume_bytes(callback, return_ptr, 0, Int32Array.from(shape));
+    } catch (err) {
+        console.log(err);
+        js_resume_bytes(callback, return_ptr, 1, new Int32Array(0));
+    }
+}
+
+// tf.memory() as [numTensors, numDataBuffers, numBytes] doubles.
+function tfjs_memory(callback, return_ptr) {
+    try {
+        const memory = tf.memory();
+        js_resume_bytes(callback, return_ptr, 0, new Float64Array([memory.numTensors, memory.numDataBuffers, memory.numBytes]));
+    } catch (err) {
+        console.log(err);
+        js_resume_bytes(callback, return_ptr, 1, new Float64Array(0));
+    }
+}
+
+// Payload of a tfjs::save_bundle file for model_id: the length of the
+// topology JSON as a uint32, the topology with its weight specs, and then all
+// the weights in one piece, as tf.js saves them.
+function model_bundle(model_id, callback, return_ptr) {
+    const model = Module.tfjsModels && Module.tfjsModels[model_id];
+    if (!model) {
+        console.log("No model " + model_id + " to bundle");
+        js_resume_bytes(callback, return_ptr, 1, new Uint8Array(0));
+        return;
+    }
+    let resumed = false;
+    model.save(tf.io.withSaveHandler((artifacts) => {
+        const topology = new TextEncoder().encode(JSON.stringify({
+            modelTopology: artifacts.modelTopology,
+            format: artifacts.format,
+            generatedBy: artifacts.generatedBy,
+            convertedBy: artifacts.convertedBy,
+            signature: artifacts.signature,
+            userDefinedMetadata: artifacts.userDefinedMetadata,
+            modelInitializer: artifacts.modelInitializer,
+            weightSpecs: artifacts.weightSpecs
+        }));
+        // Newer tf.js versions may hand the weights over in several buffers
+        const parts = Array.isArray(artifacts.weightData) ? artifacts.weightData : [artifacts.weightData || new ArrayBuffer(0)];
+        let weightsSize = 0;
+        for (const part of parts) {
+            weightsSize += part.byteLength;
+        }
+        const bundle = new Uint8Array(4 + topology.length + weightsSize);
+        new DataView(bundle.buffer).setUint32(0, topology.length, true);
+        bundle.set(topology, 4);
+        let offset = 4 + topology.length;
+        for (const part of parts) {
+            bundle.set(new Uint8Array(part), offset);
+            offset += part.byteLength;
+        }
+        resumed = true;
+        js_resume_bytes(callback, return_ptr, 0, bundle);
+        return {modelArtifactsInfo: {dateSaved: new Date(), modelTopologyType: 'JSON'}};
+    })).catch(err => {
+        console.log(err);
+        if (!resumed) {
+            js_resume_bytes(callback, return_ptr, 1, new Uint8Array(0));
+        }
+    });
+}
+
+// Switches tf.js to backend_name ('cpu', 'wasm' or 'webgl'). The wasm backend
+// is imported from wasm_path on first use, and its .wasm files are loaded from
+// there too instead of the CDN. tf.js detects SIMD and thread support itself,
+// simd and threads can only switch them off before the backend initialises.
+function set_tfjs_backend(backend_name, wasm_path, simd, threads, fn_to_continue_in_cpp, status_pointer) {
+    const name = UTF8ToString(backend_name);
+    try {
+        if (name === 'wasm') {
+            if (!tf.wasm) {
+                const path = UTF8ToString(wasm_path);
+                importScripts(path + 'tf-backend-wasm.min.js');
+                tf.wasm.setWasmPaths(path);
+            }
+            if (!simd) {
+                tf.env().set('WASM_HAS_SIMD_SUPPORT', false);
+            }
+            if (!threads) {
+                tf.env().set('WASM_HAS_MULTITHREAD_SUPPORT', false);
+            }
+        }
+    } catch (err) {
+        console.log(err);
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 1);
+        return;
+    }
+    tf.setBackend(name).then((ok) => {
+        if (!ok) {
+            throw new Error('Backend ' + name + ' is not available');
+        }
+        return tf.ready();
+    }).then(() => {
+        console.log('tf.js runs on ' + tf.getBackend());
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 0);
+    }).catch(err => {
+        console.log(err);
+        Module._resume_execution(fn_to_continue_in_cpp, status_pointer, 1);
+    });
+}
+
+function tfjs_backend_name(callback, return_ptr) {
+    try {
+        js_resume_string(callback, return_ptr, 0, tf.getBackend() || '');
+    } catch (err) {
+        console.log(err);
+        js_resume_string(callback, return_ptr, 1, '');
+    }
+}
+
+// Runs 1 + runs predictions of model_id on zeros and returns [first, steady]
+// in milliseconds as doubles, steady being the mean of all but the first. A
+// rank of 0 takes the shape of the model's first input, with 1 for dimensions
+// that are not fixed.
+function warmup_model(model_id, input_shape_ptr, input_rank, runs, callback, return_ptr) {
+    const model = Module.tfjsModels && Module.tfjsModels[model_id];
+    let input;
+    try {
+        if (!model) {
+            throw new Error('Warm up failed: no model ' + model_id);
+        }
+        const shape = input_rank > 0
+            ? Array.from(new Int32Array(Module.HEAP32.buffer, input_shape_ptr, input_rank))
+            : model.inputs[0].shape.map((dim) => (dim === null || dim === undefined || dim < 0) ? 1 : dim);
+        input = tf.zeros(shape, 'float32');
+    } catch (err) {
+        console.log(err);
+        js_resume_bytes(callback, return_ptr, 1, new Float64Array(0));
+        return;
+    }
+    const once = () => {
+        const start = performance.now();
+        const result = tf.tidy(() => {
+            const y = model.predict(input);
+            return Array.isArray(y) ? y[0] : y;
+        });
+        return result.data().then(() => {
+            result.dispose();
+            return performance.now() - start;
+        }, (err) => {
+            result.dispose();
+            throw err;
+        });
+    };
+    let first = 0;
+    let total = 0;
+    let done = once().then((ms) => {
+        first = ms;
+    });
+    for (let i = 0; i < runs; i++) {
+        done = done.then(once).then((ms) => {
+            total += ms;
+        });
+    }
+    done.then(() => {
+        input.dispose();
+        js_resume_bytes(callback, return_ptr, 0, new Float64Array([first, runs > 0 ? total / runs : 0]));
+    }).catch(err => {
+        console.log(err);
+        input.dispose();
+        js_resume_bytes(callback, return_ptr, 1, new Float64Array(0));
+    });
+}
+
 function log_data(data, callback, status_pointer) {
     console.log('I am in log data');
     try {
@@ -195,6 +659,56 @@ function error_func(callback, status_pointer) {
     Module._resume_execution(callback, status_pointer, 1);
 }
 
+function noop_func(callback, status_pointer) {
+    Module._resume_execution(callback, status_pointer, 0);
+}
+
+// Resumes with the status it was given.
+function echo_status(status, callback, status_pointer) {
+    Module._resume_execution(callback, status_pointer, status);
+}
+
+// Returns value * 2^shift as a 64 bit integer.
+function scale_i64(value, shift, callback, return_ptr) {
+    js_resume_i64(callback, return_ptr, 0, BigInt(value) << BigInt(shift));
+}
+
+function half_f64(value, callback, return_ptr) {
+    js_resume_f64(callback, return_ptr, 0, value / 2);
+}
+
+// Returns text repeated times times, fails for a negative count.
+function repeat_text(text, times, callback, return_ptr) {
+    if (times < 0) {
+        js_resume_string(callback, return_ptr, 1, '');
+        return;
+    }
+    js_resume_string(callback, return_ptr, 0, UTF8ToString(text).repeat(times));
+}
+
+// Writes [rss, arrayBuffers, wasm heap size] in bytes as doubles to out_ptr.
+// rss and arrayBuffers are only available under Node and are 0 elsewhere.
+function sample_memory_usage(out_ptr, callback, status_pointer) {
+    try {
+        const usage = (typeof process !== 'undefined' && process.memoryUsage) ? process.memoryUsage() : {};
+        Module.HEAPF64[(out_ptr >> 3)] = usage.rss || 0;
+        Module.HEAPF64[(out_ptr >> 3) + 1] = usage.arrayBuffers || 0;
+        Module.HEAPF64[(out_ptr >> 3) + 2] = Module.HEAPU8.length;
+        Module._resume_execution(callback, status_pointer, 0);
+    } catch (e) {
+        console.log(e);
+        Module._resume_execution(callback, status_pointer, 1);
+    }
+}
+
+// Keeps the thread busy for busy_us microseconds, like a CPU bound inference.
+function busy_func(busy_us, callback, status_pointer) {
+    const end = performance.now() + busy_us / 1000;
+    while (performance.now() < end) {
+    }
+    Module._resume_execution(callback, status_pointer, 0);
+}
+
 function long_running_func(delay_in_ms, callback, status_pointer) {
     const delay = ms => new Promise(res => setTimeout(res, ms));
     delay(delay_in_ms).then(() => {
@@ -212,12 +726,69 @@ mergeInto(LibraryManager.library, {
     check_if_on_thread: check_if_on_thread,
     load_graph_model_from_path: load_graph_model_from_path,
     load_layer_model_from_path: load_layer_model_from_path,
-    load_graph_model_from_buffer: load_graph_model_from_buffer,
-    load_layer_model_from_buffer: load_layer_model_from_buffer,
+    $tfjs_model_artifacts: tfjs_model_artifacts,
+    load_graph_model_from_buffers: load_graph_model_from_buffers,
+    load_graph_model_from_buffers__deps: ['$tfjs_model_artifacts'],
+    load_layer_model_from_buffers: load_layer_model_from_buffers,
+    load_layer_model_from_buffers__deps: ['$tfjs_model_artifacts'],
+    $tfjs_heap_view: tfjs_heap_view,
+    $tfjs_output_view: tfjs_output_view,
+    $tfjs_output_view__deps: ['$tfjs_heap_view'],
+    $tfjs_predict: tfjs_predict,
+    $tfjs_heap_tensor: tfjs_heap_tensor,
+    $tfjs_heap_tensor__deps: ['$tfjs_heap_view'],
     predict_in_js: predict_in_js,
+    predict_in_js__deps: ['$tfjs_heap_tensor', '$tfjs_output_view', '$tfjs_predict'],
+    register_staging_arena: register_staging_arena,
+    $tfjs_arena_views: tfjs_arena_views,
+    predict_staged: predict_staged,
+    predict_staged__deps: ['$tfjs_arena_views', '$tfjs_predict'],
     dispose_model: dispose_model,
+    $tfjs_store_tensor: tfjs_store_tensor,
+    $tfjs_tensor: tfjs_tensor,
+    upload_tensor: upload_tensor,
+    upload_tensor__deps: ['$tfjs_store_tensor', '$tfjs_heap_tensor'],
+    predict_tensor: predict_tensor,
+    predict_tensor__deps: ['$tfjs_store_tensor', '$tfjs_tensor'],
+    crop_and_resize_tensor: crop_and_resize_tensor,
+    crop_and_resize_tensor__deps: ['$tfjs_store_tensor', '$tfjs_tensor'],
+    download_tensor: download_tensor,
+    download_tensor__deps: ['$tfjs_tensor', '$tfjs_output_view'],
+    tensor_shape: tensor_shape,
+    tensor_shape__deps: ['$tfjs_tensor', '$js_resume_bytes'],
+    dispose_tensor: dispose_tensor,
+    dispose_tensor__deps: ['$tfjs_tensor'],
+    $sync_to_async_channel: sync_to_async_channel,
+    sync_to_async_post: sync_to_async_post,
+    sync_to_async_post__deps: ['$sync_to_async_channel', '$callUserCallback', '$getWasmTableEntry'],
+    $js_resume_i64: js_resume_i64,
+    $js_resume_f64: js_resume_f64,
+    $js_resume_bytes: js_resume_bytes,
+    $js_resume_string: js_resume_string,
+    $js_resume_string__deps: ['$js_resume_bytes'],
+    model_output_shape: model_output_shape,
+    model_output_shape__deps: ['$js_resume_bytes'],
+    tfjs_memory: tfjs_memory,
+    tfjs_memory__deps: ['$js_resume_bytes'],
+    model_bundle: model_bundle,
+    model_bundle__deps: ['$js_resume_bytes'],
+    set_tfjs_backend: set_tfjs_backend,
+    tfjs_backend_name: tfjs_backend_name,
+    tfjs_backend_name__deps: ['$js_resume_string'],
+    warmup_model: warmup_model,
+    warmup_model__deps: ['$js_resume_bytes'],
     log_data: log_data,
     log_multiple: log_multiple,
     error_func: error_func,
+    noop_func: noop_func,
+    echo_status: echo_status,
+    scale_i64: scale_i64,
+    scale_i64__deps: ['$js_resume_i64'],
+    half_f64: half_f64,
+    half_f64__deps: ['$js_resume_f64'],
+    repeat_text: repeat_text,
+    repeat_text__deps: ['$js_resume_string'],
+    sample_memory_usage: sample_memory_usage,
+    busy_func: busy_func,
     long_running_func: long_running_func
 })
@@ -1,14 +1,32 @@
+#pragma once
+#include "common.hpp"
+#include "js_result.hpp"
+
 extern "C" {
 extern void log_data(
-        const char *data, std::function<void()> *callback, int *statusPointer);
+        const char *data, Utils::Completion *callback, int *statusPointer);
 
 extern void log_multiple(const char *data1,
                          const char *data2,
-                         std::function<void()> *callback,
+                         Utils::Completion *callback,
                          int *statusPointer);
 
-extern void error_func(std::function<void()> *callback, int *statusPointer);
+extern void error_func(Utils::Completion *callback, int *statusPointer);
+
+extern void noop_func(Utils::Completion *callback, int *statusPointer);
+
+extern void echo_status(int status, Utils::Completion *callback, int *statusPointer);
+
+extern void scale_i64(int value, int shift, Utils::Completion *callback, Utils::JsReturn *ret);
+
+extern void half_f64(int value, Utils::Completion *callback, Utils::JsReturn *ret);
+
+extern void repeat_text(const char *text, int times, Utils::Completion *callback, Utils::JsReturn *ret);
+
+extern void sample_memory_usage(double *out, Utils::Completion *callback, int *statusPointer);
+
+extern void busy_func(int busy_us, Utils::Completion *callback, int *statusPointer);
 
 extern void long_running_func(
-        int delay_in_ms, std::function<void()> *callback, int *statusPointer);
+        int delay_in_ms, Utils::Completion *callback, int *statusPointer);
 }
@@ -0,0 +1,316 @@
+#include "preprocess.hpp"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if !defined(TFJS_PREPROCESS_NO_SIMD) && defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define TFJS_PREPROCESS_SIMD 1
+#elif !defined(TFJS_PREPROCESS_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define TFJS_PREPROCESS_SIMD 1
+#endif
+
+namespace {
+
+    // Source and weight of one output column of a bilinear resize.
+    struct Tap {
+        int x0;
+        int x1;
+        float fx;
+    };
+
+    // Sample position of output index i, like tf.image.resizeBilinear
+    // without alignCorners and halfPixelCenters.
+    void sample(int i, float scale, int size, int &i0, int &i1, float &f) {
+        auto position = static_cast<float>(i) * scale;
+        i0 = std::min(static_cast<int>(position), size - 1);
+        i1 = std::min(i0 + 1, size - 1);
+        f = position - static_cast<float>(i0);
+    }
+
+#ifdef TFJS_PREPROCESS_SIMD
+    // The few operations the kernels need, on four floats.
+#ifdef __wasm_simd128__
+    using Vec = v128_t;
+
+    inline Vec load(const float *p) { return wasm_v128_load(p); }
+    inline Vec load(const std::uint8_t *p) {
+        auto bytes = wasm_v128_load32_zero(p);
+        return wasm_f32x4_convert_u32x4(wasm_u32x4_extend_low_u16x8(wasm_u16x8_extend_low_u8x16(bytes)));
+    }
+    inline void store(float *p, Vec v) { wasm_v128_store(p, v); }
+    inline Vec splat(float x) { return wasm_f32x4_splat(x); }
+    inline Vec add(Vec a, Vec b) { return wasm_f32x4_add(a, b); }
+    inline Vec sub(Vec a, Vec b) { return wasm_f32x4_sub(a, b); }
+    inline Vec mul(Vec a, Vec b) { return wasm_f32x4_mul(a, b); }
+
+    // Four RGB pixels in a, b, c into one vector per channel.
+    inline void deinterleave3(Vec a, Vec b, Vec c, Vec &r, Vec &g, Vec &bl) {
+        r = wasm_i32x4_shuffle(wasm_i32x4_shuffle(a, b, 0, 3, 6, 7), c, 0, 1, 2, 5);
+        g = wasm_i32x4_shuffle(wasm_i32x4_shuffle(a, b, 1, 4, 7, 0), c, 0, 1, 2, 6);
+        bl = wasm_i32x4_shuffle(wasm_i32x4_shuffle(a, b, 2, 5, 0, 0), c, 0, 1, 4, 7);
+    }
+
+    inline void transpose4(Vec &a, Vec &b, Vec &c, Vec &d) {
+        auto t0 = wasm_i32x4_shuffle(a, b, 0, 4, 1, 5);
+        auto t1 = wasm_i32x4_shuffle(c, d, 0, 4, 1, 5);
+        auto t2 = wasm_i32x4_shuffle(a, b, 2, 6, 3, 7);
+        auto t3 = wasm_i32x4_shuffle(c, d, 2, 6, 3, 7);
+        a = wasm_i32x4_shuffle(t0, t1, 0, 1, 4, 5);
+        b = wasm_i32x4_shuffle(t0, t1, 2, 3, 6, 7);
+        c = wasm_i32x4_shuffle(t2, t3, 0, 1, 4, 5);
+        d = wasm_i32x4_shuffle(t2, t3, 2, 3, 6, 7);
+    }
+#else
+    using Vec = __m128;
+
+    inline Vec load(const float *p) { return _mm_loadu_ps(p); }
+    inline Vec load(const std::uint8_t *p) {
+        int word;
+        std::memcpy(&word, p, sizeof(word));
+        auto zero = _mm_setzero_si128();
+        auto bytes = _mm_unpacklo_epi8(_mm_cvtsi32_si128(word), zero);
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(bytes, zero));
+    }
+    inline void store(float *p, Vec v) { _mm_storeu_ps(p, v); }
+    inline Vec splat(float x) { return _mm_set1_ps(x); }
+    inline Vec add(Vec a, Vec b) { return _mm_add_ps(a, b); }
+    inline Vec sub(Vec a, Vec b) { return _mm_sub_ps(a, b); }
+    inline Vec mul(Vec a, Vec b) { return _mm_mul_ps(a, b); }
+
+    inline void deinterleave3(Vec a, Vec b, Vec c, Vec &r, Vec &g, Vec &bl) {
+        r = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+        g = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)),
+                           _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+        bl = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), c, _MM_SHUFFLE(3, 0, 2, 0));
+    }
+
+    inline void transpose4(Vec &a, Vec &b, Vec &c, Vec &d) {
+        _MM_TRANSPOSE4_PS(a, b, c, d);
+    }
+#endif
+
+    // dst = src * scale + bias, where scale and bias repeat every `period`
+    // values. With period = 4 * channels the per channel values line up with
+    // the vectors, since lcm(channels, 4) divides it.
+    template<typename In>
+    void scale_bias(const In *src, std::size_t count, const float *scale, const float *bias, int period, float *dst) {
+        Vec scales[4];
+        Vec biases[4];
+        const auto vectors = period / 4;
+        for (auto k = 0; k < vectors; ++k) {
+            scales[k] = load(scale + 4 * k);
+            biases[k] = load(bias + 4 * k);
+        }
+        std::size_t i = 0;
+        for (; i + period <= count; i += period) {
+            for (auto k = 0; k < vectors; ++k) {
+                store(dst + i + 4 * k, add(mul(load(src + i + 4 * k), scales[k]), biases[k]));
+            }
+        }
+        for (; i < count; ++i) {
+            dst[i] = static_cast<float>(src[i]) * scale[i % period] + bias[i % period];
+        }
+    }
+
+    template<typename In>
+    void normalize_simd(const In *src, std::size_t pixels, int channels, const float *mean, const float *stddev, float *dst) {
+        float scale[16];
+        float bias[16];
+        const auto period = 4 * channels;
+        for (auto i = 0; i < period; ++i) {
+            scale[i] = 1.0f / stddev[i % channels];
+            bias[i] = -mean[i % channels] / stddev[i % channels];
+        }
+        scale_bias(src, pixels * channels, scale, bias, period, dst);
+    }
+
+    // row = top + (bottom - top) * weight, for the vertical pass of the resize.
+    void blend_rows(const std::uint8_t *top, const std::uint8_t *bottom, std::size_t count, float weight, float *row) {
+        auto w = splat(weight);
+        std::size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            auto t = load(top + i);
+            store(row + i, add(t, mul(sub(load(bottom + i), t), w)));
+        }
+        for (; i < count; ++i) {
+            auto t = static_cast<float>(top[i]);
+            row[i] = t + (static_cast<float>(bottom[i]) - t) * weight;
+        }
+    }
+#endif
+
+}// namespace
+
+bool tfjs::preprocess::simd() {
+#ifdef TFJS_PREPROCESS_SIMD
+    return true;
+#else
+    return false;
+#endif
+}
+
+void tfjs::preprocess::scalar::convert(const std::uint8_t *src, std::size_t count, float *dst, float scale, float offset) {
+    for (std::size_t i = 0; i < count; ++i) {
+        dst[i] = static_cast<float>(src[i]) * scale + offset;
+    }
+}
+
+void tfjs::preprocess::scalar::normalize(const float *src, std::size_t pixels, int channels, const float *mean, const float *stddev, float *dst) {
+    for (std::size_t p = 0; p < pixels; ++p) {
+        for (auto c = 0; c < channels; ++c) {
+            auto i = p * channels + c;
+            dst[i] = (src[i] - mean[c]) / stddev[c];
+        }
+    }
+}
+
+void tfjs::preprocess::scalar::normalize(const std::uint8_t *src, std::size_t pixels, int channels, const float *mean, const float *stddev, float *dst) {
+    for (std::size_t p = 0; p < pixels; ++p) {
+        for (auto c = 0; c < channels; ++c) {
+            auto i = p * channels + c;
+            dst[i] = (static_cast<float>(src[i]) - mean[c]) / stddev[c];
+        }
+    }
+}
+
+void tfjs::preprocess::scalar::resize_bilinear(const std::uint8_t *src, int srcHeight, int srcWidth, int channels,
+                                               float *dst, int dstHeight, int dstWidth) {
+    const auto scaleY = static_cast<float>(srcHeight) / static_cast<float>(dstHeight);
+    const auto scaleX = static_cast<float>(srcWidth) / static_cast<float>(dstWidth);
+    for (auto y = 0; y < dstHeight; ++y) {
+        int y0, y1;
+        float fy;
+        sample(y, scaleY, srcHeight, y0, y1, fy);
+        for (auto x = 0; x < dstWidth; ++x) {
+            int x0, x1;
+            float fx;
+            sample(x, scaleX, srcWidth, x0, x1, fx);
+            for (auto c = 0; c < channels; ++c) {
+                auto at = [&](int row, int column) {
+                    return static_cast<float>(src[(static_cast<std::size_t>(row) * srcWidth + column) * channels + c]);
+                };
+                auto top = at(y0, x0) + (at(y0, x1) - at(y0, x0)) * fx;
+                auto bottom = at(y1, x0) + (at(y1, x1) - at(y1, x0)) * fx;
+                dst[(static_cast<std::size_t>(y) * dstWidth + x) * channels + c] = top + (bottom - top) * fy;
+            }
+        }
+    }
+}
+
+void tfjs::preprocess::scalar::hwc_to_chw(const float *src, int height, int width, int channels, float *dst) {
+    const auto plane = static_cast<std::size_t>(height) * width;
+    for (std::size_t p = 0; p < plane; ++p) {
+        for (auto c = 0; c < channels; ++c) {
+            dst[c * plane + p] = src[p * channels + c];
+        }
+    }
+}
+
+#ifdef TFJS_PREPROCESS_SIMD
+void tfjs::preprocess::convert(const std::uint8_t *src, std::size_t count, float *dst, float scale, float offset) {
+    const float scales[4] = {scale, scale, scale, scale};
+    const float offsets[4] = {offset, offset, offset, offset};
+    scale_bias(src, count, scales, offsets, 4, dst);
+}
+
+void tfjs::preprocess::normalize(const float *src, std::size_t pixels, int channels, const float *mean, const float *stddev, float *dst) {
+    if (channels < 1 || channels > 4) {
+        scalar::normalize(src, pixels, channels, mean, stddev, dst);
+        return;
+    }
+    normalize_simd(src, pixels, channels, mean, stddev, dst);
+}
+
+void tfjs::preprocess::normalize(const std::uint8_t *src, std::size_t pixels, int channels, const float *mean, const float *stddev, float *dst) {
+    if (channels < 1 || channels > 4) {
+        scalar::normalize(src, pixels, channels, mean, stddev, dst);
+        return;
+    }
+    normalize_simd(src, pixels, channels, mean, stddev, dst);
+}
+
+void tfjs::preprocess::resize_bilinear(const std::uint8_t *src, int srcHeight, int srcWidth, int channels,
+                                       float *dst, int dstHeight, int dstWidth) {
+    // Vertical pass first, over whole source rows with SIMD, then the
+    // horizontal pass picks the output columns out of the blended row.
+    thread_local std::vector<float> row;
+    thread_local std::vector<Tap> taps;
+    const auto rowSize = static_cast<std::size_t>(srcWidth) * channels;
+    row.resize(rowSize);
+    taps.resize(dstWidth);
+    const auto scaleY = static_cast<float>(srcHeight) / static_cast<float>(dstHeight);
+    const auto scaleX = static_cast<float>(srcWidth) / static_cast<float>(dstWidth);
+    for (auto x = 0; x < dstWidth; ++x) {
+        sample(x, scaleX, srcWidth, taps[x].x0, taps[x].x1, taps[x].fx);
+        taps[x].x0 *= channels;
+        taps[x].x1 *= channels;
+    }
+    for (auto y = 0; y < dstHeight; ++y) {
+        int y0, y1;
+        float fy;
+        sample(y, scaleY, srcHeight, y0, y1, fy);
+        blend_rows(src + y0 * rowSize, src + y1 * rowSize, rowSize, fy, row.data());
+        auto *out = dst + static_cast<std::size_t>(y) * dstWidth * channels;
+        for (const auto &tap : taps) {
+            for (auto c = 0; c < channels; ++c) {
+                auto left = row[tap.x0 + c];
+                *out++ = left + (row[tap.x1 + c] - left) * tap.fx;
+            }
+        }
+    }
+}
+
+void tfjs::preprocess::hwc_to_chw(const float *src, int height, int width, int channels, float *dst) {
+    const auto plane = static_cast<std::size_t>(height) * width;
+    std::size_t p = 0;
+    if (channels == 3) {
+        for (; p + 4 <= plane; p += 4) {
+            Vec r, g, b;
+            deinterleave3(load(src + 3 * p), load(src + 3 * p + 4), load(src + 3 * p + 8), r, g, b);
+            store(dst + p, r);
+            store(dst + plane + p, g);
+            store(dst + 2 * plane + p, b);
+        }
+    } else if (channels == 4) {
+        for (; p + 4 <= plane; p += 4) {
+            auto a = load(src + 4 * p);
+            auto b = load(src + 4 * p + 4);
+            auto c = load(src + 4 * p + 8);
+            auto d = load(src + 4 * p + 12);
+            transpose4(a, b, c, d);
+            store(dst + p, a);
+            store(dst + plane + p, b);
+            store(dst + 2 * plane + p, c);
+            store(dst + 3 * plane + p, d);
+        }
+    }
+    for (; p < plane; ++p) {
+        for (auto c = 0; c < channels; ++c) {
+            dst[c * plane + p] = src[p * channels + c];
+        }
+    }
+}
+#else
+void tfjs::preprocess::convert(const std::uint8_t *src, std::size_t count, float *dst, float scale, float offset) {
+    scalar::convert(src, count, dst, scale, offset);
+}
+
+void tfjs::preprocess::normalize(const float *src, std::size_t pixels, int channels, const float *mean, const float *stddev, float *dst) {
+    scalar::normalize(src, pixels, channels, mean, stddev, dst);
+}
+
+void tfjs::preprocess::normalize(const std::uint8_t *src, std::size_t pixels, int channels, const float *mean, const float *stddev, float *dst) {
+    scalar::normalize(src, pixels, channels, mean, stddev, dst);
+}
+
+void tfjs::preprocess::resize_bilinear(const std::uint8_t *src, int srcHeight, int srcWidth, int channels,
+                                       float *dst, int dstHeight, int dstWidth) {
+    scalar::resize_bilinear(src, srcHeight, srcWidth, channels, dst, dstHeight, dstWidth);
+}
+
+void tfjs::preprocess::hwc_to_chw(const float *src, int height, int width, int channels, float *dst) {
+    scalar::hwc_to_chw(src, height, width, channels, dst);
+}
+#endif
@@ -1,17 +1,369 @@
 #include "proxying_sync_to_async.hpp"
 
-Utils::QueuedSyncToAsync::QueuedSyncToAsync() : mReturner{mReturnerMain, this},
-                                                mResume{[&] {
-                                                    mCond.notify_one();
-                                                }},
-                                                mStatus{JsResultStatus::NOT_STARTED} {}
+#include <algorithm>
+
+namespace {
+    // Shared by every QueuedSyncToAsync so that wait_any works on handles from
+    // different invokers. Completions only take the lock when someone waits.
+    std::mutex gAnyMutex;
+    std::condition_variable gAnyCompletion;
+    std::uint64_t gAnyGeneration = 0;
+    std::atomic<int> gAnyWaiters{0};
+
+    void notifyAnyWaiters() {
+        if (gAnyWaiters.load() == 0) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(gAnyMutex);
+            ++gAnyGeneration;
+        }
+        gAnyCompletion.notify_all();
+    }
+
+    thread_local Utils::Lane gLane = Utils::Lane::INTERACTIVE;
+}// namespace
+
+Utils::ScopedLane::ScopedLane(Lane lane) : mPrevious{gLane} {
+    gLane = lane;
+}
+
+Utils::ScopedLane::~ScopedLane() {
+    gLane = mPrevious;
+}
+
+Utils::Lane Utils::current_lane() {
+    return gLane;
+}
+
+Utils::QueuedSyncToAsync::QueuedSyncToAsync() : mReturner{mReturnerMain, this} {
+    mFreeSlots.reserve(mSlots.size());
+    for (std::size_t i = 0; i < mSlots.size(); ++i) {
+        mSlots[i].resume = Completion{&QueuedSyncToAsync::resumeSlot, &mSlots[i]};
+        mSlots[i].owner = this;
+        mSlots[i].index = i;
+        mFreeSlots.push_back(mSlots.size() - 1 - i);
+    }
+}
 
 Utils::QueuedSyncToAsync::~QueuedSyncToAsync() {
-    pthread_cancel(mReturner.native_handle());
+    // Let the returner leave its event loop from the inside rather than
+    // cancelling it, which is not safe while it waits in C++ code.
+    mQueue.proxyAsync(mReturner.native_handle(), [] { pthread_exit(nullptr); });
     mReturner.join();
 }
 
+Utils::JsResultStatus Utils::QueuedSyncToAsync::runOnReturner(void (*run)(void *), void *arg,
+                                                              std::chrono::steady_clock::time_point deadline) {
+    if (pthread_equal(pthread_self(), mReturner.native_handle())) {
+        // The drain runs on this thread, so nothing would ever start us.
+        run(arg);
+        return JsResultStatus::OK;
+    }
+    PendingStart pending{run, arg, gLane, std::chrono::steady_clock::now(), deadline};
+    std::unique_lock<std::mutex> lock(mLaneMutex);
+    auto &lane = mLanes[static_cast<std::size_t>(pending.lane)];
+    if (lane.tail != nullptr) {
+        lane.tail->next = &pending;
+    } else {
+        lane.head = &pending;
+    }
+    lane.tail = &pending;
+    lane.stats.depth++;
+    lane.stats.maxDepth = std::max(lane.stats.maxDepth, lane.stats.depth);
+    if (!mDraining) {
+        mDraining = true;
+        postDrain(lock);
+    }
+    lock.unlock();
+    detail::wait_while(pending.phase, WAITING);
+    switch (pending.phase.load(std::memory_order_relaxed)) {
+        case STARTED:
+            return JsResultStatus::OK;
+        case EXPIRED:
+            return JsResultStatus::TIMEOUT;
+        default:
+            return JsResultStatus::NOT_STARTED;
+    }
+}
+
+void Utils::QueuedSyncToAsync::postDrain(std::unique_lock<std::mutex> &lock) {
+    lock.unlock();
+    auto queued = emscripten_proxy_async(mQueue.queue, mReturner.native_handle(), &QueuedSyncToAsync::drainLanes, this) == 1;
+    lock.lock();
+    if (!queued) {
+        // Nobody is going to start the waiting calls.
+        mDraining = false;
+        while (auto *failed = popPending()) {
+            failed->phase.store(FAILED, std::memory_order_release);
+            detail::wake_one(failed->phase);
+        }
+    }
+}
+
+Utils::QueuedSyncToAsync::PendingStart *Utils::QueuedSyncToAsync::popPending() {
+    auto &interactive = mLanes[static_cast<std::size_t>(Lane::INTERACTIVE)];
+    auto &bulk = mLanes[static_cast<std::size_t>(Lane::BULK)];
+    auto now = std::chrono::steady_clock::now();
+    auto *lane = &interactive;
+    if (bulk.head != nullptr && (interactive.head == nullptr || now - bulk.head->queued >= mBulkAging)) {
+        lane = &bulk;
+        if (interactive.head != nullptr) {
+            bulk.stats.aged++;
+        }
+    }
+    auto *pending = lane->head;
+    if (pending == nullptr) {
+        return nullptr;
+    }
+    lane->head = pending->next;
+    if (lane->head == nullptr) {
+        lane->tail = nullptr;
+    }
+    lane->stats.depth--;
+    lane->stats.maxWait = std::max(lane->stats.maxWait, std::chrono::duration_cast<std::chrono::microseconds>(now - pending->queued));
+    return pending;
+}
+
+void Utils::QueuedSyncToAsync::drainLanes(void *me) {
+    auto *self = static_cast<QueuedSyncToAsync *>(me);
+    std::unique_lock<std::mutex> lock(self->mLaneMutex);
+    // Calls that arrive while one runs are picked up by this loop, in lane order.
+    for (auto started = 0; started < QUEUED_SYNC_TO_ASYNC_DRAIN_BATCH;) {
+        auto *pending = self->popPending();
+        if (pending == nullptr) {
+            self->mDraining = false;
+            return;
+        }
+        auto &stats = self->mLanes[static_cast<std::size_t>(pending->lane)].stats;
+        // The caller may return as soon as it sees the store. Waking an address
+        // nobody waits on any more is harmless.
+        if (std::chrono::steady_clock::now() >= pending->deadline) {
+            stats.expired++;
+            pending->phase.store(EXPIRED, std::memory_order_release);
+            detail::wake_one(pending->phase);
+            continue;
+        }
+        stats.started++;
+        started++;
+        lock.unlock();
+        pending->run(pending->arg);
+        pending->phase.store(STARTED, std::memory_order_release);
+        detail::wake_one(pending->phase);
+        lock.lock();
+    }
+    // Give the rest of the returner's event loop a turn and continue in a new task.
+    self->postDrain(lock);
+}
+
+void Utils::QueuedSyncToAsync::setBulkAging(std::chrono::steady_clock::duration aging) {
+    std::lock_guard<std::mutex> lock(mLaneMutex);
+    mBulkAging = aging;
+}
+
+Utils::LaneStats Utils::QueuedSyncToAsync::laneStats(Lane lane) {
+    std::lock_guard<std::mutex> lock(mLaneMutex);
+    return mLanes[static_cast<std::size_t>(lane)].stats;
+}
+
+bool Utils::QueuedSyncToAsync::slotAvailable() const {
+    return !mFreeSlots.empty() && mOutstanding.load(std::memory_order_relaxed) < mMaxInFlight;
+}
+
+Utils::JsResultStatus Utils::QueuedSyncToAsync::acquireSlot(std::size_t &index, bool wait, std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (!slotAvailable()) {
+        if (!wait || mWaiting >= mMaxWaiting) {
+            mRejected++;
+            return JsResultStatus::BUSY;
+        }
+        mWaiting++;
+        mPeakWaiting = std::max(mPeakWaiting, mWaiting);
+        auto available = true;
+        if (deadline == std::chrono::steady_clock::time_point::max()) {
+            mSlotFreed.wait(lock, [&]() { return slotAvailable(); });
+        } else {
+            available = mSlotFreed.wait_until(lock, deadline, [&]() { return slotAvailable(); });
+        }
+        mWaiting--;
+        if (!available) {
+            return JsResultStatus::TIMEOUT;
+        }
+    }
+    index = mFreeSlots.back();
+    mFreeSlots.pop_back();
+    mOutstanding++;
+    mSlots[index].ret = JsReturn{};
+    mSlots[index].state.store(PENDING, std::memory_order_relaxed);
+    return JsResultStatus::OK;
+}
+
+void Utils::QueuedSyncToAsync::setMaxInFlight(std::size_t count) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mMaxInFlight = std::clamp<std::size_t>(count, 1, mSlots.size());
+    }
+    mSlotFreed.notify_all();
+}
+
+void Utils::QueuedSyncToAsync::setMaxWaiting(std::size_t count) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mMaxWaiting = count;
+}
+
+Utils::QueueStats Utils::QueuedSyncToAsync::queueStats() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    QueueStats stats;
+    stats.inFlight = mOutstanding.load(std::memory_order_relaxed);
+    stats.waiting = mWaiting;
+    stats.peakWaiting = mPeakWaiting;
+    stats.rejected = mRejected;
+    return stats;
+}
+
+void Utils::QueuedSyncToAsync::releaseSlot(std::size_t index) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFreeSlots.push_back(index);
+        mOutstanding--;
+    }
+    mSlotFreed.notify_one();
+}
+
+void Utils::QueuedSyncToAsync::completeSlot(std::size_t index) {
+    auto &slot = mSlots[index];
+    SYNC_TO_ASYNC_TRACE(slot.trace.resumed = trace::now_ns());
+    if (slot.state.exchange(DONE, std::memory_order_acq_rel) == DETACHED) {
+        // Nobody is going to collect the result.
+        releaseSlot(index);
+    } else {
+        detail::wake_one(slot.state);
+    }
+    notifyAnyWaiters();
+}
+
+void Utils::QueuedSyncToAsync::resumeSlot(void *slot) {
+    auto *completed = static_cast<CompletionSlot *>(slot);
+    completed->owner->completeSlot(completed->index);
+}
+
+void Utils::QueuedSyncToAsync::abandonSlot(std::size_t index, JsResultStatus status) {
+    mSlots[index].ret.status = status;
+    mSlots[index].state.store(DONE, std::memory_order_release);
+}
+
+bool Utils::QueuedSyncToAsync::slotDone(std::size_t index) {
+    return mSlots[index].state.load(std::memory_order_acquire) == DONE;
+}
+
+void Utils::QueuedSyncToAsync::waitForSlot(std::size_t index) {
+    detail::wait_while(mSlots[index].state, PENDING);
+}
+
+bool Utils::QueuedSyncToAsync::waitForSlotUntil(std::size_t index, std::chrono::steady_clock::time_point deadline) {
+    return detail::wait_while_until(mSlots[index].state, PENDING, deadline);
+}
+
+void Utils::QueuedSyncToAsync::detachSlot(std::size_t index) {
+    std::uint32_t expected = PENDING;
+    if (!mSlots[index].state.compare_exchange_strong(expected, DETACHED, std::memory_order_acq_rel)) {
+        // Already done, so resume won't release it.
+        releaseSlot(index);
+    }
+}
+
 Utils::QueuedSyncToAsync &Utils::QueuedSyncToAsync::getInvoker() {
     static QueuedSyncToAsync instance;
     return instance;
 }
+
+Utils::JsCallHandle::JsCallHandle(JsCallHandle &&other) noexcept
+    : mInvoker{other.mInvoker}, mSlot{other.mSlot}, mReturn{other.mReturn} {
+    other.mInvoker = nullptr;
+}
+
+Utils::JsCallHandle &Utils::JsCallHandle::operator=(JsCallHandle &&other) noexcept {
+    if (this != &other) {
+        if (mInvoker) {
+            mInvoker->detachSlot(mSlot);
+        }
+        mInvoker = other.mInvoker;
+        mSlot = other.mSlot;
+        mReturn = other.mReturn;
+        other.mInvoker = nullptr;
+    }
+    return *this;
+}
+
+Utils::JsCallHandle::~JsCallHandle() {
+    if (mInvoker) {
+        mInvoker->detachSlot(mSlot);
+    }
+}
+
+void Utils::JsCallHandle::collect() {
+    SYNC_TO_ASYNC_TRACE(auto &callTrace = mInvoker->mSlots[mSlot].trace;
+                        callTrace.woken = trace::now_ns();
+                        trace::record(callTrace));
+    mReturn = mInvoker->mSlots[mSlot].ret;
+    mInvoker->releaseSlot(mSlot);
+    mInvoker = nullptr;
+}
+
+bool Utils::JsCallHandle::ready() const {
+    return mInvoker == nullptr || mInvoker->slotDone(mSlot);
+}
+
+Utils::JsResultStatus Utils::JsCallHandle::wait() {
+    if (mInvoker) {
+        mInvoker->waitForSlot(mSlot);
+        collect();
+    }
+    return static_cast<JsResultStatus>(mReturn.status);
+}
+
+bool Utils::JsCallHandle::wait_until(std::chrono::steady_clock::time_point deadline) {
+    if (mInvoker) {
+        if (!mInvoker->waitForSlotUntil(mSlot, deadline)) {
+            return false;
+        }
+        collect();
+    }
+    return true;
+}
+
+std::size_t Utils::wait_any(std::vector<JsCallHandle> &handles) {
+    auto pending = [](const JsCallHandle &handle) { return handle.mInvoker != nullptr; };
+    if (std::none_of(handles.begin(), handles.end(), pending)) {
+        return handles.size();
+    }
+    gAnyWaiters++;
+    std::size_t found = handles.size();
+    while (found == handles.size()) {
+        std::uint64_t seen;
+        {
+            std::lock_guard<std::mutex> lock(gAnyMutex);
+            seen = gAnyGeneration;
+        }
+        for (std::size_t i = 0; i < handles.size(); ++i) {
+            if (pending(handles[i]) && handles[i].ready()) {
+                found = i;
+                break;
+            }
+        }
+        if (found == handles.size()) {
+            // A completion after our scan bumps the generation, so it can't be missed.
+            std::unique_lock<std::mutex> lock(gAnyMutex);
+            gAnyCompletion.wait(lock, [&]() { return gAnyGeneration != seen; });
+        }
+    }
+    gAnyWaiters--;
+    handles[found].wait();
+    return found;
+}
+
+void Utils::wait_all(std::vector<JsCallHandle> &handles) {
+    for (auto &handle : handles) {
+        handle.wait();
+    }
+}
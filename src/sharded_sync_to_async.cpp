@@ -0,0 +1,32 @@
+#include "sharded_sync_to_async.hpp"
+
+Utils::ShardedSyncToAsync::ShardedSyncToAsync(std::size_t shards, ShardPolicy policy) : mPolicy{policy} {
+    if (shards == 0) {
+        shards = 1;
+    }
+    mShards.reserve(shards);
+    mShards.push_back(&QueuedSyncToAsync::getInvoker());
+    for (std::size_t i = 1; i < shards; ++i) {
+        mOwned.push_back(std::make_unique<QueuedSyncToAsync>());
+        mShards.push_back(mOwned.back().get());
+    }
+}
+
+std::size_t Utils::ShardedSyncToAsync::pickIndex() {
+    auto start = mNext.fetch_add(1, std::memory_order_relaxed);
+    if (mPolicy == ShardPolicy::ROUND_ROBIN || mShards.size() == 1) {
+        return start % mShards.size();
+    }
+    // Start the scan at a rotating shard, so idle shards share the load.
+    auto best = start % mShards.size();
+    auto bestOutstanding = mShards[best]->outstanding();
+    for (std::size_t i = 1; i < mShards.size() && bestOutstanding > 0; ++i) {
+        auto candidate = (start + i) % mShards.size();
+        auto outstanding = mShards[candidate]->outstanding();
+        if (outstanding < bestOutstanding) {
+            best = candidate;
+            bestOutstanding = outstanding;
+        }
+    }
+    return best;
+}
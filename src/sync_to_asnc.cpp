@@ -1,40 +1,109 @@
 #include "sync_to_async.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <new>
 #include <utility>
 
+namespace {
+    // Dispatch of the SyncToAsync worker running on this thread.
+    thread_local Utils::Dispatch gDispatch = Utils::Dispatch::TIMEOUT;
+
+    void post(Utils::Dispatch dispatch, void (*func)(void *), void *arg) {
+        if (dispatch == Utils::Dispatch::TIMEOUT) {
+            emscripten_async_call(func, arg, 0);
+        } else {
+            sync_to_async_post(func, arg, static_cast<int>(dispatch));
+        }
+    }
+}// namespace
+
+void *Utils::SyncToAsync::threadMain(void *arg) {
+    gDispatch = static_cast<SyncToAsync *>(arg)->mDispatch;
+    // Start parked: the first assignWork schedules threadIter. Keep the
+    // runtime alive so that the thread survives pending JS promises between
+    // calls. It exits through pthread_exit once the destructor sets
+    // `ShouldExit`.
+    emscripten_exit_with_live_runtime();
+}
+
+void Utils::SyncToAsync::defer(void (*func)(void *), void *arg) {
+    post(gDispatch, func, arg);
+}
+
 void Utils::SyncToAsync::invoke(
         std::function<void(Callback)> newWork) {
+    Work work;
+    work.owned = std::move(newWork);
     // The worker might not be waiting for work if some other invoker has
     // already sent work. Wait for the worker to be done with that work and
     // ready for new work.
     std::unique_lock<std::mutex> lock(mMutex);
     waitForWork(lock);
     // Now the worker is definitely waiting for our work. Send it over.
-    auto workID = assignWork(std::move(newWork));
+    auto workID = assignWork(std::move(work));
+    waitForCompletion(lock, workID);
+}
+
+void Utils::SyncToAsync::invoke(WorkFunc func, void *context) {
+    Work work;
+    work.func = func;
+    work.context = context;
+    std::unique_lock<std::mutex> lock(mMutex);
+    waitForWork(lock);
+    auto workID = assignWork(std::move(work));
     waitForCompletion(lock, workID);
 }
 
+bool Utils::SyncToAsync::invokeUntil(std::function<void(Callback)> newWork,
+                                      std::chrono::steady_clock::time_point deadline) {
+    Work work;
+    work.owned = std::move(newWork);
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (!mSynchronizationCondition.wait_until(lock, deadline, [&]() { return mState == ThreadState::Waiting; })) {
+        return false;
+    }
+    auto workID = assignWork(std::move(work));
+    lock.unlock();
+    return detail::wait_while_until(mWorkCount, workID, deadline);
+}
+
+bool Utils::SyncToAsync::idle() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mState == ThreadState::Waiting && mWorkCount == mAssignedWork;
+}
+
 void Utils::SyncToAsync::waitForCompletion(std::unique_lock<std::mutex> &lock, uint32_t workID) {
-    // Wake the worker and wait for it to finish the work. There might be other
-    // invokers waiting to send work as well, so `notify_all` to ensure the
-    // worker wakes up. Wait for `workCount` to increase rather than for the
-    // state to return to `Waiting` to make sure we wake up even if some other
-    // invoker wins the race and submits more work before we acquire the lock.
-    mSynchronizationCondition.notify_all();
-    mSynchronizationCondition.wait(
-            lock, [&]() { return mWorkCount != workID; });
+    // Wait for the worker to finish the work, assignWork woke it. Wait for
+    // `workCount` to increase rather than for the state to return to
+    // `Waiting` to make sure we wake up even if some other invoker wins the
+    // race and submits more work before we look.
+    //
+    // The wait is on the counter itself rather than on the condition, so the
+    // resume wakes the invokers waiting for completion and nobody else.
+    lock.unlock();
+    detail::wait_while(mWorkCount, workID);
 }
 
-uint32_t Utils::SyncToAsync::assignWork(std::function<void(Callback)> newWork) {
+uint32_t Utils::SyncToAsync::assignWork(Work &&newWork) {
     assert(mState == ThreadState::Waiting);
     uint32_t workID = mWorkCount;
+    mAssignedWork = workID + 1;
     mWork = std::move(newWork);
     mState = ThreadState::WorkAvailable;
+    if (mParked) {
+        unpark();
+    }
     return workID;
 }
 
+void Utils::SyncToAsync::unpark() {
+    mParked = false;
+    // The system queue runs from the worker's event loop, like the promises
+    // of the work it runs, so a parked worker takes no CPU.
+    emscripten_proxy_async(emscripten_proxy_get_system_queue(), mExecutionThread.native_handle(), threadIter, this);
+}
+
 void Utils::SyncToAsync::waitForWork(std::unique_lock<std::mutex> &lock) {
     mSynchronizationCondition.wait(
             lock, [&]() { return mState == ThreadState::Waiting; });
@@ -42,63 +111,278 @@ void Utils::SyncToAsync::waitForWork(std::unique_lock<std::mutex> &lock) {
 
 void Utils::SyncToAsync::threadIter(void *arg) {
     auto *parent = static_cast<SyncToAsync *>(arg);
-    std::function<void(Callback)> currentWork = getAssignedFunc(parent);
-
-    // Allocate a resume function that will wake the invoker and schedule us to
-    // wait for more work.
-    std::function<void()> synchronizerFunc = [parent, arg]() {
-        // We are called, so the work was finished. Notify the invoker so it
-        // will wake up and continue once we resume waiting. There might be
-        // other invokers waiting to give us work, so `notify_all` to make sure
-        // our invoker wakes up. Don't worry about overflow because it's a
-        // reasonable assumption that no invoker will continue losing wake up
-        // races for a full cycle.
-        parent->mWorkCount++;
-        parent->mSynchronizationCondition.notify_all();
-
-        // Look for more work. Doing this asynchronously ensures that we
-        // continue after the current call stack unwinds (avoiding constantly
-        // adding to the stack, and also running any remaining code the caller
-        // had, like destructors). TODO: add an option to do a synchronous call
-        // here in some cases, which would avoid the time delay caused by a
-        // browser setTimeout.
-
-        // TODO: The following line loses handle of current thread for long running js functions
-        //        emscripten_async_call(threadIter, arg, /* timeout */ 0);
-    };
-    parent->mResumeFunc = synchronizerFunc;
+    // Replacing the previous work is safe, it has called its resume function.
+    takeAssignedWork(parent, parent->mCurrentWork);
 
     // Run the work function the user gave us. Give it a pointer to the resume
     // function, which it will be responsible for calling when it's done.
-    currentWork(&parent->mResumeFunc);
+    auto &work = parent->mCurrentWork;
+    if (work.func) {
+        work.func(work.context, &parent->mResumeFunc);
+    } else {
+        work.owned(&parent->mResumeFunc);
+    }
+}
+
+void Utils::SyncToAsync::resume(void *arg) {
+    auto *parent = static_cast<SyncToAsync *>(arg);
+    // We are called, so the work was finished. Wake the invoker waiting on
+    // the counter. Don't worry about overflow because it's a reasonable
+    // assumption that no invoker will continue losing wake up races for a
+    // full cycle.
+    SYNC_TO_ASYNC_TRACE(parent->mResumedAt = Utils::trace::now_ns());
+    parent->mWorkCount++;
+    detail::wake_all(parent->mWorkCount);
+
+    // If more work was assigned meanwhile, or the destructor asks us to
+    // exit, take it on a later task. Doing this asynchronously ensures that
+    // we continue after the current call stack unwinds (avoiding constantly
+    // adding to the stack, and also running any remaining code the caller
+    // had, like destructors). Dispatch::MESSAGE_CHANNEL and MICROTASK avoid
+    // the time delay caused by a browser setTimeout.
+    //
+    // Otherwise park: the worker goes back to its event loop rather than
+    // blocking it while it waits, so promises and timers of Javascript on
+    // this thread keep running between calls. assignWork schedules us again.
+    std::lock_guard<std::mutex> lock(parent->mMutex);
+    if (parent->mState == ThreadState::Waiting) {
+        parent->mParked = true;
+        return;
+    }
+    post(parent->mDispatch, threadIter, arg);
+}
+
+void Utils::SyncToAsync::takeAssignedWork(Utils::SyncToAsync *parent, Work &work) {
+    // threadIter is only scheduled once there is something to do, so this
+    // never waits.
+    std::unique_lock<std::mutex> lock(parent->mMutex);
+    if (parent->mState == ThreadState::ShouldExit) {
+        pthread_exit(nullptr);
+    }
+
+    assert(parent->mState == ThreadState::WorkAvailable);
+    // Moving rather than copying keeps this free of allocations.
+    work = std::move(parent->mWork);
+
+    // Now that we have the work, it is ok for new invokers to queue up more
+    // work for us to do, so go back to `Waiting` and let them know.
+    parent->mState = ThreadState::Waiting;
+    lock.unlock();
+    parent->mSynchronizationCondition.notify_all();
+}
+
+Utils::SyncToAsyncPool::SyncToAsyncPool(std::size_t size, Dispatch dispatch) : mDispatch{dispatch} {
+    assert(size > 0);
+    mWorkers.reserve(size);
+    mIdle.reserve(size);
+    for (std::size_t i = 0; i < size; ++i) {
+        mWorkers.emplace_back(new SyncToAsync(dispatch));
+        mIdle.push_back(mWorkers.back().get());
+    }
+}
+
+Utils::SyncToAsyncPool::~SyncToAsyncPool() {
+    // A retired worker still waiting for Javascript can't be joined. Leave
+    // it to the end of the process.
+    for (auto &worker : mRetired) {
+        if (!worker->idle()) {
+            worker.release();
+        }
+    }
+}
+
+Utils::JsResultStatus Utils::SyncToAsyncPool::invoke(std::function<void(SyncToAsync::Callback)> newWork, trace::CallTrace *callTrace) {
+    SyncToAsync *worker;
+    auto acquired = acquire(worker);
+    if (acquired != JsResultStatus::OK) {
+        return acquired;
+    }
+    SYNC_TO_ASYNC_TRACE(if (callTrace) { callTrace->acquired = trace::now_ns(); });
+    worker->invoke(std::move(newWork));
+    finishInvoke(*worker, callTrace);
+    return JsResultStatus::OK;
+}
+
+Utils::JsResultStatus Utils::SyncToAsyncPool::invoke(SyncToAsync::WorkFunc work, void *context, trace::CallTrace *callTrace) {
+    SyncToAsync *worker;
+    auto acquired = acquire(worker);
+    if (acquired != JsResultStatus::OK) {
+        return acquired;
+    }
+    SYNC_TO_ASYNC_TRACE(if (callTrace) { callTrace->acquired = trace::now_ns(); });
+    worker->invoke(work, context);
+    finishInvoke(*worker, callTrace);
+    return JsResultStatus::OK;
 }
 
-std::function<void(Utils::SyncToAsync::Callback)> Utils::SyncToAsync::getAssignedFunc(Utils::SyncToAsync *parent) {
-    std::function<void(Callback)> currentWork;
+Utils::JsResultStatus Utils::SyncToAsyncPool::tryInvoke(SyncToAsync::WorkFunc work, void *context, trace::CallTrace *callTrace) {
+    SyncToAsync *worker;
+    auto acquired = acquire(worker, false);
+    if (acquired != JsResultStatus::OK) {
+        return acquired;
+    }
+    SYNC_TO_ASYNC_TRACE(if (callTrace) { callTrace->acquired = trace::now_ns(); });
+    worker->invoke(work, context);
+    finishInvoke(*worker, callTrace);
+    return JsResultStatus::OK;
+}
+
+void Utils::SyncToAsyncPool::finishInvoke(SyncToAsync &worker, trace::CallTrace *callTrace) {
+    SYNC_TO_ASYNC_TRACE(if (callTrace) {
+        callTrace->resumed = worker.lastResumeTime();
+        callTrace->woken = trace::now_ns();
+    });
+    release(worker);
+    SYNC_TO_ASYNC_TRACE(if (callTrace) { trace::record(*callTrace); });
+    (void) callTrace;
+}
+
+Utils::JsResultStatus Utils::SyncToAsyncPool::invokeUntil(std::function<void(SyncToAsync::Callback)> newWork,
+                                                          std::chrono::steady_clock::time_point deadline,
+                                                          trace::CallTrace *callTrace) {
+    SyncToAsync *worker;
+    auto acquired = acquire(worker, true, deadline);
+    if (acquired != JsResultStatus::OK) {
+        return acquired;
+    }
+    SYNC_TO_ASYNC_TRACE(if (callTrace) { callTrace->acquired = trace::now_ns(); });
+    if (!worker->invokeUntil(std::move(newWork), deadline)) {
+        retire(*worker);
+        return JsResultStatus::TIMEOUT;
+    }
+    SYNC_TO_ASYNC_TRACE(if (callTrace) {
+        callTrace->resumed = worker->lastResumeTime();
+        callTrace->woken = trace::now_ns();
+    });
+    release(*worker);
+    (void) callTrace;
+    return JsResultStatus::OK;
+}
+
+Utils::JsResultStatus Utils::SyncToAsyncPool::acquire(SyncToAsync *&worker, bool wait, std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mIdle.empty()) {
+        if (!wait || mWaiting >= mMaxWaiting) {
+            mRejected++;
+            return JsResultStatus::BUSY;
+        }
+        mWaiting++;
+        mPeakWaiting = std::max(mPeakWaiting, mWaiting);
+        auto available = true;
+        if (deadline == std::chrono::steady_clock::time_point::max()) {
+            mWorkerAvailable.wait(lock, [&]() { return !mIdle.empty(); });
+        } else {
+            available = mWorkerAvailable.wait_until(lock, deadline, [&]() { return !mIdle.empty(); });
+        }
+        mWaiting--;
+        if (!available) {
+            return JsResultStatus::TIMEOUT;
+        }
+    }
+    worker = mIdle.back();
+    mIdle.pop_back();
+    return JsResultStatus::OK;
+}
+
+void Utils::SyncToAsyncPool::setMaxWaiting(std::size_t count) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mMaxWaiting = count;
+}
+
+Utils::QueueStats Utils::SyncToAsyncPool::stats() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    QueueStats stats;
+    stats.inFlight = mWorkers.size() - mIdle.size();
+    stats.waiting = mWaiting;
+    stats.peakWaiting = mPeakWaiting;
+    stats.rejected = mRejected;
+    return stats;
+}
+
+void Utils::SyncToAsyncPool::release(SyncToAsync &worker) {
+    bool hasRetired;
     {
-        // Wait until we get something to do.
-        std::unique_lock<std::mutex> lock(parent->mMutex);
-        parent->mSynchronizationCondition.wait(lock,
-                                               [&]() {
-                                                   return parent->mState == ThreadState::WorkAvailable ||
-                                                          parent->mState == ThreadState::ShouldExit;
-                                               });
-
-        if (parent->mState == ThreadState::ShouldExit) {
-            pthread_exit(nullptr);
+        std::lock_guard<std::mutex> lock(mMutex);
+        mIdle.push_back(&worker);
+        hasRetired = !mRetired.empty();
+    }
+    mWorkerAvailable.notify_one();
+    if (hasRetired) {
+        sweepRetired();
+    }
+}
+
+void Utils::SyncToAsyncPool::retire(SyncToAsync &worker) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (auto &current : mWorkers) {
+            if (current.get() == &worker) {
+                mRetired.push_back(std::move(current));
+                current.reset(new SyncToAsync(mDispatch));
+                mIdle.push_back(current.get());
+                break;
+            }
+        }
+    }
+    mWorkerAvailable.notify_one();
+    sweepRetired();
+}
+
+void Utils::SyncToAsyncPool::sweepRetired() {
+    std::vector<std::unique_ptr<SyncToAsync>> finished;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (auto it = mRetired.begin(); it != mRetired.end();) {
+            if ((*it)->idle()) {
+                finished.push_back(std::move(*it));
+                it = mRetired.erase(it);
+            } else {
+                ++it;
+            }
         }
+    }
+    // `finished` joins the worker threads here, outside the lock.
+}
+
+std::size_t Utils::SyncToAsyncPool::retired() {
+    sweepRetired();
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mRetired.size();
+}
 
-        assert(parent->mState == ThreadState::WorkAvailable);
-        currentWork = parent->mWork;
+namespace {
+    std::mutex gPoolMutex;
+    std::size_t gPoolSize = SYNC_TO_ASYNC_POOL_SIZE;
+    Utils::Dispatch gPoolDispatch = Utils::Dispatch::TIMEOUT;
+    bool gPoolCreated = false;
+}// namespace
 
-        // Now that we have a local copy of the work, it is ok for new invokers
-        // to queue up more work for us to do, so go back to `Waiting` and
-        // release the lock.
-        parent->mState = ThreadState::Waiting;
+bool Utils::SyncToAsyncPool::setDefaultSize(std::size_t size) {
+    std::lock_guard<std::mutex> lock(gPoolMutex);
+    if (gPoolCreated || size == 0) {
+        return false;
     }
-    return currentWork;
+    gPoolSize = size;
+    return true;
 }
 
+bool Utils::SyncToAsyncPool::setDefaultDispatch(Dispatch dispatch) {
+    std::lock_guard<std::mutex> lock(gPoolMutex);
+    if (gPoolCreated) {
+        return false;
+    }
+    gPoolDispatch = dispatch;
+    return true;
+}
+
+Utils::SyncToAsyncPool &Utils::SyncToAsyncPool::getPool() {
+    static SyncToAsyncPool instance = []() {
+        std::lock_guard<std::mutex> lock(gPoolMutex);
+        gPoolCreated = true;
+        return SyncToAsyncPool(gPoolSize, gPoolDispatch);
+    }();
+    return instance;
+}
 
 void EMSCRIPTEN_KEEPALIVE resume_execution(
         const Utils::SyncToAsync::Callback callback,
@@ -107,3 +391,37 @@ void EMSCRIPTEN_KEEPALIVE resume_execution(
     *statusPointer = status;
     (*callback)();
 }
+
+void EMSCRIPTEN_KEEPALIVE resume_execution_i64(
+        Utils::Completion *const callback,
+        Utils::JsReturn *const ret,
+        int status,
+        std::uint32_t low,
+        std::uint32_t high) {
+    ret->kind = Utils::I64;
+    ret->i64 = static_cast<std::int64_t>((static_cast<std::uint64_t>(high) << 32) | low);
+    ret->status = status;
+    (*callback)();
+}
+
+void EMSCRIPTEN_KEEPALIVE resume_execution_f64(
+        Utils::Completion *const callback,
+        Utils::JsReturn *const ret,
+        int status,
+        double value) {
+    ret->kind = Utils::F64;
+    ret->f64 = value;
+    ret->status = status;
+    (*callback)();
+}
+
+void EMSCRIPTEN_KEEPALIVE resume_execution_bytes(
+        Utils::Completion *const callback,
+        Utils::JsReturn *const ret,
+        int status,
+        std::uint32_t size) {
+    ret->kind = Utils::BYTES;
+    ret->size = size;
+    ret->status = status;
+    (*callback)();
+}
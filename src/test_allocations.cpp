@@ -0,0 +1,82 @@
+// Replaces the global allocation functions for the whole test binary and
+// counts the allocations made while a test asks for it, to check that calls
+// through the executors are free of heap allocations once warmed up.
+#include "doctest/doctest.h"
+#include "js_includes.hpp"
+#include "proxying_sync_to_async.hpp"
+#include "sync_to_async.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+    std::atomic<bool> gCounting{false};
+    std::atomic<std::size_t> gAllocations{0};
+    // Keeps the compiler from eliding the allocation in the sanity check.
+    int *volatile gSink = nullptr;
+
+    void *countedAllocation(std::size_t size) {
+        if (gCounting.load(std::memory_order_relaxed)) {
+            gAllocations.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (auto *pointer = std::malloc(size ? size : 1)) {
+            return pointer;
+        }
+        throw std::bad_alloc();
+    }
+
+    // Allocations made by any thread while running `call` `times` times,
+    // after a few warm up calls that may create pools and grow queues.
+    template<typename Call>
+    std::size_t allocationsDuring(int times, Call &&call) {
+        for (auto i = 0; i < 10; ++i) {
+            call();
+        }
+        gAllocations = 0;
+        gCounting = true;
+        for (auto i = 0; i < times; ++i) {
+            call();
+        }
+        gCounting = false;
+        return gAllocations.load();
+    }
+}// namespace
+
+void *operator new(std::size_t size) { return countedAllocation(size); }
+void *operator new[](std::size_t size) { return countedAllocation(size); }
+void operator delete(void *pointer) noexcept { std::free(pointer); }
+void operator delete[](void *pointer) noexcept { std::free(pointer); }
+void operator delete(void *pointer, std::size_t) noexcept { std::free(pointer); }
+void operator delete[](void *pointer, std::size_t) noexcept { std::free(pointer); }
+
+TEST_CASE("Steady state calls do not allocate")
+{
+    SUBCASE("The counter sees allocations")
+    {
+        REQUIRE(allocationsDuring(1, [] {
+                    gSink = new int[4];
+                    delete[] gSink;
+                }) > 0);
+    }
+    SUBCASE("queued_js_executor")
+    {
+        auto failures = 0;
+        REQUIRE(allocationsDuring(1000, [&] { failures += Utils::queued_js_executor(noop_func) != Utils::OK; }) == 0);
+        REQUIRE(allocationsDuring(1000, [&] { failures += Utils::queued_js_executor(echo_status, 1) != Utils::ERROR; }) == 0);
+        REQUIRE(failures == 0);
+    }
+    SUBCASE("js_executor")
+    {
+        auto failures = 0;
+        REQUIRE(allocationsDuring(1000, [&] { failures += Utils::js_executor(noop_func) != Utils::OK; }) == 0);
+        REQUIRE(allocationsDuring(1000, [&] { failures += Utils::js_executor(echo_status, 1) != Utils::ERROR; }) == 0);
+        REQUIRE(failures == 0);
+    }
+    SUBCASE("Calls that return a value")
+    {
+        std::int64_t sum = 0;
+        REQUIRE(allocationsDuring(1000, [&] { sum += Utils::queued_js_call<std::int64_t>(scale_i64, 1, 1).value; }) == 0);
+        REQUIRE(allocationsDuring(1000, [&] { sum += Utils::js_call<std::int64_t>(scale_i64, 1, 1).value; }) == 0);
+        REQUIRE(sum == 2 * 2 * 1010);
+    }
+}
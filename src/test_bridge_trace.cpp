@@ -0,0 +1,69 @@
+#include "doctest/doctest.h"
+#include "bridge_trace.hpp"
+#include "js_includes.hpp"
+#include "proxying_sync_to_async.hpp"
+#include "sync_to_async.hpp"
+#include <sstream>
+
+TEST_CASE("Latency histogram")
+{
+    SUBCASE("Buckets cover their values")
+    {
+        for (std::uint64_t ns : {0ull, 1ull, 3ull, 4ull, 7ull, 8ull, 1000ull, 123456789ull})
+        {
+            auto bucket = Utils::trace::LatencyHistogram::bucketFor(ns);
+            REQUIRE(ns <= Utils::trace::LatencyHistogram::bucketUpperBound(bucket));
+            if (bucket > 0)
+            {
+                REQUIRE(ns > Utils::trace::LatencyHistogram::bucketUpperBound(bucket - 1));
+            }
+        }
+    }
+    SUBCASE("Quantiles are within a bucket of the data")
+    {
+        Utils::trace::LatencyHistogram histogram;
+        for (std::uint64_t i = 1; i <= 1000; ++i)
+        {
+            histogram.add(i * 1000);
+        }
+        REQUIRE(histogram.count() == 1000);
+        REQUIRE(histogram.max() == 1000000);
+        REQUIRE(histogram.quantile(0.5) >= 500000);
+        REQUIRE(histogram.quantile(0.5) <= 500000 * 5 / 4);
+        REQUIRE(histogram.quantile(0.99) >= 990000);
+        REQUIRE(histogram.quantile(0.99) <= 1000000);
+        histogram.reset();
+        REQUIRE(histogram.count() == 0);
+        REQUIRE(histogram.quantile(0.5) == 0);
+    }
+}
+
+#if SYNC_TO_ASYNC_TRACING
+TEST_CASE("Tracing js calls")
+{
+    Utils::trace::reset();
+    Utils::trace::set_name(noop_func, "noop_func");
+    for (auto i = 0; i < 10; ++i)
+    {
+        REQUIRE(Utils::queued_js_executor(noop_func) == 0);
+        REQUIRE(Utils::js_executor(noop_func) == 0);
+    }
+    auto stats = Utils::trace::snapshot();
+    auto found = false;
+    for (const auto& function : stats)
+    {
+        if (function.key == Utils::trace::key_of(noop_func))
+        {
+            found = true;
+            REQUIRE(std::string(function.name) == "noop_func");
+            REQUIRE(function.phases[Utils::trace::TOTAL].count == 20);
+            REQUIRE(function.phases[Utils::trace::JS].count == 20);
+            REQUIRE(function.phases[Utils::trace::TOTAL].max_ns >= function.phases[Utils::trace::JS].max_ns);
+        }
+    }
+    REQUIRE(found);
+    std::stringstream out;
+    Utils::trace::dump(out);
+    REQUIRE(out.str().find("noop_func") != std::string::npos);
+}
+#endif
@@ -0,0 +1,89 @@
+#include "doctest/doctest.h"
+#include "js_coroutine.hpp"
+#include "js_includes.hpp"
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+namespace {
+    using Utils::coro::JsScheduler;
+    using Utils::coro::Task;
+    using Utils::coro::js_call;
+
+    Task<Utils::JsResultStatus> callOnce(bool fail) {
+        if (fail) {
+            co_return co_await js_call(error_func);
+        }
+        co_return co_await js_call(log_data, std::string("Hello from a coroutine"));
+    }
+
+    // noop_func resumes before it returns, which must not nest the resumes.
+    Task<int> callManyTimes(int times) {
+        auto succeeded = 0;
+        for (auto i = 0; i < times; ++i) {
+            succeeded += co_await js_call(noop_func) == Utils::OK;
+        }
+        co_return succeeded;
+    }
+
+    Task<std::int64_t> scaled(int value) {
+        auto result = co_await js_call<std::int64_t>(scale_i64, value, 40);
+        co_return result ? result.value : -1;
+    }
+
+    Task<std::string> typedResults() {
+        Utils::JsArena arena(64);
+        auto big = co_await scaled(3);
+        auto half = co_await js_call<double>(half_f64, 5);
+        auto text = co_await js_call<std::string>(arena, repeat_text, "ab", 2);
+        co_return std::to_string(big == (std::int64_t{3} << 40)) + std::to_string(half.value) + text.value;
+    }
+
+    Task<void> sleepAndCount(int delayMs, std::atomic<int> &done, std::atomic<int> &offThread) {
+        offThread += !JsScheduler::getScheduler().onSchedulerThread();
+        auto status = co_await js_call(long_running_func, delayMs);
+        offThread += !JsScheduler::getScheduler().onSchedulerThread();
+        done += status == Utils::OK;
+    }
+}// namespace
+
+TEST_CASE("Awaiting js calls from coroutines")
+{
+    auto &scheduler = JsScheduler::getScheduler();
+
+    SUBCASE("The status comes back")
+    {
+        REQUIRE(scheduler.run(callOnce(false)) == Utils::OK);
+        REQUIRE(scheduler.run(callOnce(true)) == Utils::ERROR);
+    }
+    SUBCASE("Calls that resume right away")
+    {
+        REQUIRE(scheduler.run(callManyTimes(10000)) == 10000);
+    }
+    SUBCASE("Values and nested tasks")
+    {
+        REQUIRE(scheduler.run(typedResults()) == "1" + std::to_string(2.5) + "abab");
+    }
+    SUBCASE("One thread drives many outstanding calls")
+    {
+        const auto tasks = 200;
+        const auto delay = std::chrono::milliseconds(200);
+        std::atomic<int> done{0};
+        std::atomic<int> offThread{0};
+        auto t1 = std::chrono::steady_clock::now();
+        for (auto i = 0; i < tasks; ++i)
+        {
+            scheduler.spawn(sleepAndCount(static_cast<int>(delay.count()), done, offThread));
+        }
+        while (scheduler.active() > 0 && std::chrono::steady_clock::now() - t1 < delay * tasks)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        auto elapsed = std::chrono::steady_clock::now() - t1;
+        REQUIRE(done == tasks);
+        REQUIRE(offThread == 0);
+        // Sequentially this would take tasks * delay
+        REQUIRE(elapsed < delay * 10);
+    }
+}
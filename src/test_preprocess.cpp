@@ -0,0 +1,111 @@
+#include "doctest/doctest.h"
+#include "preprocess.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace {
+    namespace preprocess = tfjs::preprocess;
+
+    // Pseudo random pixels, the same on every run.
+    std::vector<std::uint8_t> pixels(std::size_t count) {
+        std::mt19937 random(42);
+        std::vector<std::uint8_t> values(count);
+        for (auto &value : values) {
+            value = static_cast<std::uint8_t>(random() & 0xff);
+        }
+        return values;
+    }
+
+    bool close(const std::vector<float> &a, const std::vector<float> &b, float tolerance = 1e-4f) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (std::size_t i = 0; i < a.size(); ++i) {
+            if (std::abs(a[i] - b[i]) > tolerance * std::max(1.0f, std::abs(b[i]))) {
+                return false;
+            }
+        }
+        return true;
+    }
+}// namespace
+
+// The sizes are odd on purpose, so the SIMD kernels also run their tails.
+TEST_CASE("Preprocessing kernels match the scalar path")
+{
+    const float mean[4] = {123.7f, 116.3f, 103.5f, 128.0f};
+    const float stddev[4] = {58.4f, 57.1f, 57.4f, 64.0f};
+
+    SUBCASE("Convert")
+    {
+        auto src = pixels(1001);
+        std::vector<float> fast(src.size()), reference(src.size());
+        preprocess::convert(src.data(), src.size(), fast.data(), 2.0f / 255.0f, -1.0f);
+        preprocess::scalar::convert(src.data(), src.size(), reference.data(), 2.0f / 255.0f, -1.0f);
+        REQUIRE(close(fast, reference));
+        REQUIRE(reference[0] == doctest::Approx(src[0] * 2.0f / 255.0f - 1.0f));
+    }
+    SUBCASE("Normalize")
+    {
+        for (auto channels = 1; channels <= 5; ++channels)
+        {
+            const std::size_t count = 333;
+            const float wideMean[5] = {mean[0], mean[1], mean[2], mean[3], 100.0f};
+            const float wideStddev[5] = {stddev[0], stddev[1], stddev[2], stddev[3], 50.0f};
+            auto src = pixels(count * channels);
+            std::vector<float> fast(src.size()), reference(src.size());
+            preprocess::normalize(src.data(), count, channels, wideMean, wideStddev, fast.data());
+            preprocess::scalar::normalize(src.data(), count, channels, wideMean, wideStddev, reference.data());
+            REQUIRE(close(fast, reference));
+
+            // From floats, in place
+            std::vector<float> floats(src.begin(), src.end());
+            preprocess::normalize(floats.data(), count, channels, wideMean, wideStddev, floats.data());
+            REQUIRE(close(floats, reference));
+        }
+    }
+    SUBCASE("Bilinear resize")
+    {
+        const int channels = 3;
+        auto src = pixels(37 * 53 * channels);
+        for (auto size : {std::pair<int, int>{17, 29}, {37, 53}, {64, 96}})
+        {
+            std::vector<float> fast(size.first * size.second * channels), reference(fast.size());
+            preprocess::resize_bilinear(src.data(), 37, 53, channels, fast.data(), size.first, size.second);
+            preprocess::scalar::resize_bilinear(src.data(), 37, 53, channels, reference.data(), size.first, size.second);
+            REQUIRE(close(fast, reference));
+        }
+        // Same size is a copy
+        std::vector<float> copy(src.size());
+        preprocess::resize_bilinear(src.data(), 37, 53, channels, copy.data(), 37, 53);
+        REQUIRE(copy[100] == src[100]);
+    }
+    SUBCASE("Bilinear resize samples like tf.js")
+    {
+        // 2x2 to 4x4 without alignCorners: rows and columns at 0, 0.5, 1, 1.5
+        const std::uint8_t src[] = {0, 100, 200, 40};
+        float dst[16];
+        preprocess::resize_bilinear(src, 2, 2, 1, dst, 4, 4);
+        REQUIRE(dst[0] == doctest::Approx(0));
+        REQUIRE(dst[1] == doctest::Approx(50));
+        REQUIRE(dst[3] == doctest::Approx(100));
+        REQUIRE(dst[5] == doctest::Approx(85));
+        REQUIRE(dst[15] == doctest::Approx(40));
+    }
+    SUBCASE("HWC to CHW")
+    {
+        for (auto channels = 1; channels <= 5; ++channels)
+        {
+            auto src = pixels(13 * 7 * channels);
+            std::vector<float> floats(src.begin(), src.end());
+            std::vector<float> fast(floats.size()), reference(floats.size());
+            preprocess::hwc_to_chw(floats.data(), 13, 7, channels, fast.data());
+            preprocess::scalar::hwc_to_chw(floats.data(), 13, 7, channels, reference.data());
+            REQUIRE(fast == reference);
+            REQUIRE(reference[(channels - 1) * 13 * 7 + 5] == floats[5 * channels + channels - 1]);
+        }
+    }
+}
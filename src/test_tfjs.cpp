@@ -1,9 +1,17 @@
 #include "doctest/doctest.h"
 #include "js_includes.hpp"
 #include "proxying_sync_to_async.hpp"
+#include "sharded_sync_to_async.hpp"
 #include "js_includes.hpp"
 #include "tfjs.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <thread>
 
@@ -36,6 +44,75 @@ TEST_CASE("Call to javascript")
     }
 }
 
+TEST_CASE("Call to javascript through the js_executor pool")
+{
+    SUBCASE("Multiple calls reuse the pool")
+    {
+        for (auto i = 0; i < 100; ++i)
+        {
+            auto executionStatus = Utils::js_executor(log_data, "Hello World from the pool");
+            REQUIRE(executionStatus == 0);
+        }
+    }
+    SUBCASE("Error status is preserved")
+    {
+        auto executionStatus = Utils::js_executor(error_func);
+        REQUIRE(executionStatus == 1);
+    }
+    SUBCASE("Calls from more threads than workers")
+    {
+        std::vector<std::thread> workers;
+        for (auto i = 0; i < 2 * SYNC_TO_ASYNC_POOL_SIZE; ++i)
+        {
+            workers.emplace_back(std::thread(
+                    []
+                    {
+                        auto executionStatus = Utils::js_executor(noop_func);
+                        REQUIRE(executionStatus == 0);
+                    }));
+        }
+        for (auto& t : workers)
+        {
+            t.join();
+        }
+    }
+}
+
+TEST_CASE("Dispatch modes")
+{
+    for (auto dispatch : {Utils::Dispatch::TIMEOUT, Utils::Dispatch::MESSAGE_CHANNEL, Utils::Dispatch::MICROTASK})
+    {
+        Utils::SyncToAsyncPool pool(2, dispatch);
+        REQUIRE(pool.dispatch() == dispatch);
+        for (auto i = 0; i < 20; ++i)
+        {
+            REQUIRE(Utils::js_executor_on(pool, noop_func) == Utils::OK);
+        }
+        REQUIRE(Utils::js_executor_on(pool, echo_status, 7) == 7);
+        // Resumed later from the event loop, after the dispatch returned
+        REQUIRE(Utils::js_executor_on(pool, long_running_func, 10) == Utils::OK);
+    }
+    REQUIRE(Utils::SyncToAsyncPool::getPool().dispatch() == Utils::Dispatch::TIMEOUT);
+    REQUIRE_FALSE(Utils::SyncToAsyncPool::setDefaultDispatch(Utils::Dispatch::MICROTASK));
+}
+
+TEST_CASE("Idle workers keep running their event loop")
+{
+    // A timer started by the last call fires while nobody invokes the worker.
+    Utils::SyncToAsync worker;
+    std::atomic<bool> fired{false};
+    worker.invoke([&fired](Utils::SyncToAsync::Callback resume) {
+        emscripten_async_call([](void *flag) { static_cast<std::atomic<bool> *>(flag)->store(true); }, &fired, 10);
+        (*resume)();
+    });
+    for (auto i = 0; i < 1000 && !fired; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(fired);
+    REQUIRE(worker.idle());
+}
+
 TEST_CASE("Calling a Js function that returns error")
 {
     auto executionResult = Utils::queued_js_executor(error_func);
@@ -67,12 +144,359 @@ TEST_CASE("Calling a longer running Js function")
     REQUIRE(executionResult == 0);
 }
 
+// tf.js only exists in the Emscripten build, the host backend has no Javascript.
+#ifdef __EMSCRIPTEN__
 TEST_CASE("Importing tfjs")
 {
     auto executionResult = Utils::queued_js_executor(import_tfjs);
     REQUIRE(executionResult == 0);
 }
 
+TEST_CASE("Initialising tfjs")
+{
+    REQUIRE(tfjs::init() == 0);
+    auto imports = tfjs::imports();
+    REQUIRE(imports >= 1);
+    // The second call is answered from the cached import state
+    REQUIRE(tfjs::init() == 0);
+    REQUIRE(tfjs::imports() == imports);
+}
+
+TEST_CASE("Selecting the tfjs backend")
+{
+    SUBCASE("cpu")
+    {
+        REQUIRE(tfjs::set_backend(tfjs::Backend::CPU) == 0);
+        REQUIRE(tfjs::backend().value == "cpu");
+    }
+    SUBCASE("wasm from the build directory")
+    {
+        REQUIRE(tfjs::set_backend(tfjs::Backend::WASM) == 0);
+        REQUIRE(tfjs::backend().value == "wasm");
+        // The other tests expect the default backend
+        REQUIRE(tfjs::set_backend(tfjs::Backend::CPU) == 0);
+    }
+}
+#endif
+
+TEST_CASE("tfjs model handles")
+{
+    SUBCASE("Empty handles are rejected")
+    {
+        tfjs::Model model;
+        std::vector<float> input(4), output(2);
+        REQUIRE_FALSE(model.valid());
+        REQUIRE(tfjs::predict(model, input, {1, 4}, output) == 1);
+        REQUIRE(tfjs::dispose(model) == 1);
+        REQUIRE(tfjs::warmup(model).status == 1);
+        REQUIRE(tfjs::output_shape(model).status == 1);
+    }
+    SUBCASE("Empty tensor handles are rejected")
+    {
+        tfjs::Model model;
+        tfjs::TensorHandle tensor;
+        float output[2];
+        REQUIRE_FALSE(tfjs::predict(model, tensor).valid());
+        REQUIRE(tfjs::predict(model, tensor).status() == 1);
+        REQUIRE(tfjs::crop_and_resize(tensor, {{0, 0, 1, 1}}, 2, 2).status() == 1);
+        REQUIRE(tfjs::download(tensor, output, 2) == 1);
+        REQUIRE(tfjs::shape(tensor).status == 1);
+        REQUIRE(tensor.dispose() == 1);
+    }
+    SUBCASE("Unknown model type")
+    {
+        auto model = tfjs::load_file("model.json", "unknown");
+        REQUIRE_FALSE(model.valid());
+        REQUIRE(model.status() == 1);
+    }
+}
+
+TEST_CASE("Model bundles")
+{
+    SUBCASE("Missing and foreign files are rejected")
+    {
+        REQUIRE(tfjs::load_bundle("no_such.tfjsbundle", "layer").status() == 1);
+        {
+            std::ofstream out("foreign.tfjsbundle", std::ios::binary);
+            out << "not a bundle";
+        }
+        REQUIRE_FALSE(tfjs::load_bundle("foreign.tfjsbundle", "layer").valid());
+        std::remove("foreign.tfjsbundle");
+    }
+    SUBCASE("Sizes in the header are checked against the file")
+    {
+        unsigned char header[40] = {'T', 'F', 'J', 'S', 'B', 'N', 'D', 'L', 1};
+        const std::uint64_t huge = std::uint64_t(1) << 40;
+        std::memcpy(header + 16, &huge, sizeof(huge));
+        {
+            std::ofstream out("truncated.tfjsbundle", std::ios::binary);
+            out.write(reinterpret_cast<const char *>(header), sizeof(header));
+        }
+        REQUIRE(tfjs::load_bundle("truncated.tfjsbundle", "layer").status() == 1);
+        std::remove("truncated.tfjsbundle");
+    }
+    SUBCASE("Empty handles are not saved")
+    {
+        tfjs::Model model;
+        REQUIRE(tfjs::save_bundle(model, "empty.tfjsbundle") == 1);
+        std::ifstream in("empty.tfjsbundle");
+        REQUIRE_FALSE(in);
+    }
+}
+
+#ifdef __EMSCRIPTEN__
+// Dense layer with 4 inputs and 2 outputs. The kernel and the bias are stored
+// in separate weight files.
+static const char *kTinyDenseModel =
+        R"({"modelTopology":{"class_name":"Sequential","config":{"name":"tiny","layers":[)"
+        R"({"class_name":"Dense","config":{"name":"dense","units":2,"activation":"linear","use_bias":true,)"
+        R"("dtype":"float32","batch_input_shape":[null,4]}}]},"keras_version":"tfjs-layers","backend":"tensor_flow.js"},)"
+        R"("weightsManifest":[{"paths":["kernel.bin"],"weights":[{"name":"dense/kernel","shape":[4,2],"dtype":"float32"}]},)"
+        R"({"paths":["bias.bin"],"weights":[{"name":"dense/bias","shape":[2],"dtype":"float32"}]}]})";
+
+TEST_CASE("Loading a tfjs model from buffers")
+{
+    std::vector<float> kernel = {1, 0, 0, 1, 1, 0, 0, 1};
+    std::vector<float> bias = {0.5f, -0.5f};
+    std::vector<tfjs::WeightShard> shards = {
+            {reinterpret_cast<const unsigned char *>(kernel.data()), kernel.size() * sizeof(float)},
+            {reinterpret_cast<const unsigned char *>(bias.data()), bias.size() * sizeof(float)}};
+
+    auto model = tfjs::load_buffer(kTinyDenseModel, shards, "layer");
+    REQUIRE(model.valid());
+    REQUIRE(model.status() == 0);
+
+    auto other = tfjs::load_buffer(kTinyDenseModel, shards, "layer");
+    REQUIRE(other.valid());
+    REQUIRE(other.id() != model.id());
+
+    SUBCASE("float32 in, float32 out")
+    {
+        std::vector<float> input = {1, 2, 3, 4};
+        std::vector<float> output(2);
+        REQUIRE(tfjs::predict(model, input, {1, 4}, output) == 0);
+        REQUIRE(output[0] == doctest::Approx(4.5));
+        REQUIRE(output[1] == doctest::Approx(5.5));
+    }
+    SUBCASE("uint8 in, int32 out")
+    {
+        std::vector<std::uint8_t> input = {1, 2, 3, 4};
+        std::int32_t output[2] = {0, 0};
+        tfjs::TensorView<const std::uint8_t> view{input.data(), input.size(), {1, 4}};
+        REQUIRE(tfjs::predict(model, view, output, 2) == 0);
+        REQUIRE(output[0] == 4);
+        REQUIRE(output[1] == 5);
+    }
+    SUBCASE("uint8 outputs are clamped and the written count is returned")
+    {
+        std::vector<float> input = {200, -3, 200, 0};
+        std::uint8_t output[4] = {7, 7, 7, 7};
+        std::size_t written = 0;
+        tfjs::TensorView<const float> view{input.data(), input.size(), {1, 4}};
+        REQUIRE(tfjs::predict(model, view, output, 4, &written) == 0);
+        REQUIRE(written == 2);
+        REQUIRE(output[0] == 255);
+        REQUIRE(output[1] == 0);
+        REQUIRE(output[2] == 7);
+    }
+    SUBCASE("Output buffer too small")
+    {
+        std::vector<float> input = {1, 2, 3, 4};
+        float output[1];
+        tfjs::TensorView<const float> view{input.data(), input.size(), {1, 4}};
+        REQUIRE(tfjs::predict(model, view, output, 1) == 1);
+    }
+
+    SUBCASE("Predicting in place in a staging slot")
+    {
+        auto slot = tfjs::staging().borrow();
+        REQUIRE(slot);
+        float input[] = {1, 2, 3, 4};
+        std::copy(input, input + 4, slot.input());
+        slot.set_shape({1, 4});
+        REQUIRE(tfjs::predict(model, slot, 4, 2) == 0);
+        REQUIRE(slot.output()[0] == doctest::Approx(4.5));
+        REQUIRE(slot.output()[1] == doctest::Approx(5.5));
+
+        // Requests past the slot's capacity are rejected, with a model that
+        // would otherwise run them.
+        slot.output()[0] = 0;
+        REQUIRE(tfjs::predict(model, slot, slot.input_capacity() + 1, 2) == Utils::ERROR);
+        REQUIRE(tfjs::predict(model, slot, 4, slot.output_capacity() + 1) == Utils::ERROR);
+        REQUIRE(slot.output()[0] == 0);
+        tfjs::StagingArena::Slot empty;
+        REQUIRE(tfjs::predict(model, empty, 4, 2) == Utils::ERROR);
+    }
+    SUBCASE("Batched predictions are scattered back to their callers")
+    {
+        tfjs::BatchingPredictor batcher(model, {std::chrono::milliseconds(50), 8});
+        std::vector<std::thread> callers;
+        std::atomic<int> correct{0};
+        for (auto i = 0; i < 8; ++i)
+        {
+            callers.emplace_back([&batcher, &correct, i] {
+                std::vector<float> input = {float(i), 0, 0, 0};
+                std::vector<float> output(2);
+                if (batcher.predict(input, {1, 4}, output) == Utils::OK && output[0] == doctest::Approx(i + 0.5f) &&
+                    output[1] == doctest::Approx(-0.5f))
+                {
+                    correct++;
+                }
+            });
+        }
+        for (auto &caller : callers)
+        {
+            caller.join();
+        }
+        REQUIRE(correct == 8);
+        REQUIRE(batcher.stats().requests == 8);
+        REQUIRE(batcher.stats().batches < 8);
+        REQUIRE(batcher.stats().fallbacks == 0);
+    }
+    SUBCASE("Batches that can't be split run one request at a time")
+    {
+        // Room for 3 values where the model writes 2
+        tfjs::BatchingPredictor batcher(model, {std::chrono::milliseconds(50), 8});
+        std::vector<std::thread> callers;
+        std::atomic<int> correct{0};
+        for (auto i = 0; i < 8; ++i)
+        {
+            callers.emplace_back([&batcher, &correct, i] {
+                std::vector<float> input = {float(i), 0, 0, 0};
+                std::vector<float> output(3, 100.0f);
+                if (batcher.predict(input, {1, 4}, output) == Utils::OK && output[0] == doctest::Approx(i + 0.5f) &&
+                    output[1] == doctest::Approx(-0.5f) && output[2] == 100.0f)
+                {
+                    correct++;
+                }
+            });
+        }
+        for (auto &caller : callers)
+        {
+            caller.join();
+        }
+        REQUIRE(correct == 8);
+        REQUIRE(batcher.stats().fallbacks >= 1);
+    }
+    SUBCASE("Warm up reports first run and steady state latency")
+    {
+        auto info = tfjs::warmup(model, {1, 4}, 5);
+        REQUIRE(info.ok());
+        REQUIRE(info.value.firstRun.count() >= 0);
+        REQUIRE(info.value.steadyState.count() >= 0);
+        // The input shape can be taken from the model
+        REQUIRE(tfjs::warmup(model).ok());
+        REQUIRE(tfjs::warmup(model, {1, 3}).status == 1);
+    }
+    SUBCASE("Saved bundles load the same model")
+    {
+        REQUIRE(tfjs::save_bundle(model, "tiny.tfjsbundle") == 0);
+        auto copy = tfjs::load_bundle("tiny.tfjsbundle", "layer");
+        REQUIRE(copy.valid());
+        std::vector<float> input = {1, 2, 3, 4};
+        std::vector<float> output(2);
+        REQUIRE(tfjs::predict(copy, input, {1, 4}, output) == 0);
+        REQUIRE(output[0] == doctest::Approx(4.5));
+        REQUIRE(output[1] == doctest::Approx(5.5));
+        std::remove("tiny.tfjsbundle");
+    }
+    SUBCASE("Cached bundles are dropped when a weight file changes")
+    {
+        auto write = [](const char *file, const std::vector<float> &values) {
+            std::ofstream out(file, std::ios::binary);
+            out.write(reinterpret_cast<const char *>(values.data()),
+                      static_cast<std::streamsize>(values.size() * sizeof(float)));
+        };
+        {
+            std::ofstream out("model.json");
+            out << kTinyDenseModel;
+        }
+        write("kernel.bin", kernel);
+        write("bias.bin", bias);
+        REQUIRE(tfjs::save_cached(model, "model.json", ".") == 0);
+        std::vector<float> input = {1, 2, 3, 4};
+        std::vector<float> output(2);
+        auto cached = tfjs::load_cached("model.json", "layer", ".");
+        REQUIRE(cached.valid());
+        REQUIRE(tfjs::predict(cached, input, {1, 4}, output) == 0);
+        REQUIRE(output[0] == doctest::Approx(4.5));
+
+        // Same model.json, retrained weights: the bundle no longer matches.
+        // Whether tf.js can then load from the path depends on the
+        // environment, but the old weights must not come back.
+        write("kernel.bin", {2, 0, 0, 2, 2, 0, 0, 2});
+        auto reloaded = tfjs::load_cached("model.json", "layer", ".");
+        if (reloaded.valid()) {
+            REQUIRE(tfjs::predict(reloaded, input, {1, 4}, output) == 0);
+            REQUIRE(output[0] == doctest::Approx(8.5));
+        }
+        std::remove(tfjs::cached_bundle("model.json", ".").c_str());
+        std::remove("model.json");
+        std::remove("kernel.bin");
+        std::remove("bias.bin");
+    }
+    SUBCASE("Tensors stay in tf.js between stages")
+    {
+        auto before = tfjs::memory().value.numTensors;
+        {
+            std::vector<float> input = {1, 2, 3, 4};
+            auto x = tfjs::upload(tfjs::TensorView<const float>{input.data(), input.size(), {1, 4}});
+            REQUIRE(x.valid());
+            auto y = tfjs::predict(model, x);
+            REQUIRE(y.valid());
+            REQUIRE(y.shard() == x.shard());
+            REQUIRE(tfjs::shape(y).value == std::vector<int>{1, 2});
+            float output[2];
+            REQUIRE(tfjs::download(y, output, 2) == 0);
+            REQUIRE(output[0] == doctest::Approx(4.5));
+            REQUIRE(output[1] == doctest::Approx(5.5));
+            REQUIRE(tfjs::download(y, output, 1) == 1);
+        }
+        // The handles took their tensors with them
+        REQUIRE(tfjs::memory().value.numTensors == before);
+    }
+    SUBCASE("Uploaded tensors own their values")
+    {
+        std::vector<float> input = {1, 2, 3, 4};
+        auto x = tfjs::upload(tfjs::TensorView<const float>{input.data(), input.size(), {1, 4}});
+        REQUIRE(x.valid());
+        std::fill(input.begin(), input.end(), 100.0f);
+        input.clear();
+        input.shrink_to_fit();
+        auto y = tfjs::predict(model, x);
+        float output[2];
+        REQUIRE(tfjs::download(y, output, 2) == 0);
+        REQUIRE(output[0] == doctest::Approx(4.5));
+        REQUIRE(output[1] == doctest::Approx(5.5));
+    }
+    SUBCASE("Crops of an image tensor")
+    {
+        std::vector<std::uint8_t> pixels = {1, 2, 3, 4};
+        auto image = tfjs::upload(tfjs::TensorView<const std::uint8_t>{pixels.data(), pixels.size(), {1, 2, 2, 1}});
+        auto crops = tfjs::crop_and_resize(image, {{0, 0, 1, 1}, {0, 0, 0.5f, 0.5f}}, 2, 2);
+        REQUIRE(tfjs::shape(crops).value == std::vector<int>{2, 2, 2, 1});
+        std::int32_t values[8];
+        REQUIRE(tfjs::download(crops, values, 8) == 0);
+        REQUIRE(values[0] == 1);
+        REQUIRE(values[3] == 4);
+    }
+    SUBCASE("Output shape and memory in one call each")
+    {
+        auto shape = tfjs::output_shape(model);
+        REQUIRE(shape.ok());
+        REQUIRE(shape.value == std::vector<int>{-1, 2});
+        auto memory = tfjs::memory();
+        REQUIRE(memory.ok());
+        REQUIRE(memory.value.numTensors > 0);
+        REQUIRE(memory.value.numBytes > 0);
+    }
+
+    REQUIRE(model.dispose() == 0);
+    REQUIRE_FALSE(model.valid());
+    REQUIRE(tfjs::output_shape(model).status == Utils::ERROR);
+}
+#endif
+
 TEST_CASE("Call to javascript while other threads are running")
 {
     SUBCASE("There are remaining threads")
@@ -218,3 +642,611 @@ TEST_CASE("Calling long running js function from different C++ threads")
         t.join();
     }
 }
+
+TEST_CASE("Long running js functions from different C++ threads overlap")
+{
+    // Every call has its own completion slot, so the returner can have all of
+    // the promises outstanding at once instead of running them one after another.
+    const auto callers = 15;
+    auto delay = std::chrono::milliseconds(1000);
+    std::vector<std::thread> workers;
+    auto t1 = std::chrono::steady_clock::now();
+    for (auto i = 0; i < callers; ++i)
+    {
+        workers.emplace_back(std::thread(
+                [&]
+                {
+                    auto executionResult = Utils::queued_js_executor(
+                            long_running_func, delay.count());
+                    REQUIRE(executionResult == 0);
+                }));
+    }
+
+    for (auto& t : workers)
+    {
+        t.join();
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    REQUIRE((t2 - t1) >= delay);
+    REQUIRE((t2 - t1) < delay * (callers / 3));
+}
+
+TEST_CASE("Completion waits")
+{
+    SUBCASE("Callers can spin before sleeping")
+    {
+        auto spin = Utils::wait_spin();
+        Utils::set_wait_spin(std::chrono::microseconds(200));
+        REQUIRE(Utils::wait_spin() == std::chrono::microseconds(200));
+        REQUIRE(Utils::queued_js_executor(noop_func) == Utils::OK);
+        REQUIRE(Utils::js_executor(noop_func) == Utils::OK);
+        // Longer than the spin, so the callers sleep too
+        REQUIRE(Utils::queued_js_executor(long_running_func, 20) == Utils::OK);
+        REQUIRE(Utils::js_executor(long_running_func, 20) == Utils::OK);
+        Utils::set_wait_spin(spin);
+    }
+    SUBCASE("Each of many waiters gets its own completion")
+    {
+        // Calls finish in the reverse order they started, so every wake up
+        // has to reach one particular caller.
+        std::vector<std::thread> callers;
+        std::atomic<int> finished{0};
+        for (auto i = 0; i < 15; ++i)
+        {
+            callers.emplace_back([&, i]
+                                 {
+                                     auto delay = 150 - 10 * i;
+                                     auto status = i % 2 ? Utils::queued_js_executor(long_running_func, delay)
+                                                         : Utils::js_executor(long_running_func, delay);
+                                     REQUIRE(status == Utils::OK);
+                                     finished++;
+                                 });
+        }
+        for (auto &caller : callers)
+        {
+            caller.join();
+        }
+        REQUIRE(finished == 15);
+    }
+}
+
+TEST_CASE("Submitting js functions without blocking")
+{
+    auto delay = std::chrono::milliseconds(1000);
+
+    SUBCASE("wait returns the status")
+    {
+        auto handle = Utils::queued_js_submit(error_func);
+        REQUIRE(Utils::wait(handle) == 1);
+        REQUIRE(handle.ready());
+        REQUIRE(handle.wait() == 1);
+    }
+
+    SUBCASE("wait_all overlaps the calls")
+    {
+        auto t1 = std::chrono::steady_clock::now();
+        std::vector<Utils::JsCallHandle> handles;
+        for (auto i = 0; i < 3; ++i)
+        {
+            handles.push_back(Utils::queued_js_submit(long_running_func, delay.count()));
+        }
+        handles.push_back(Utils::queued_js_submit(log_data, "Hello World while waiting!"));
+        Utils::wait_all(handles);
+        auto t2 = std::chrono::steady_clock::now();
+        REQUIRE((t2 - t1) >= delay);
+        REQUIRE((t2 - t1) < delay * 2);
+        for (auto& handle : handles)
+        {
+            REQUIRE(handle.wait() == 0);
+        }
+    }
+
+    SUBCASE("wait_any returns the first call to finish")
+    {
+        std::vector<Utils::JsCallHandle> handles;
+        handles.push_back(Utils::queued_js_submit(long_running_func, delay.count()));
+        handles.push_back(Utils::queued_js_submit(log_data, "Hello World first!"));
+        REQUIRE(Utils::wait_any(handles) == 1);
+        REQUIRE(handles[1].wait() == 0);
+        REQUIRE(handles[0].wait() == 0);
+    }
+
+    SUBCASE("wait_any visits every call once")
+    {
+        std::vector<Utils::JsCallHandle> handles;
+        handles.push_back(Utils::queued_js_submit(long_running_func, 200));
+        handles.push_back(Utils::queued_js_submit(error_func));
+        handles.push_back(Utils::queued_js_submit(log_data, "Hello World collected!"));
+        handles.push_back(Utils::queued_js_submit(long_running_func, 100));
+        REQUIRE(handles[2].wait() == 0);
+        std::vector<std::size_t> order;
+        for (auto i = 0; i < 10; ++i)
+        {
+            auto found = Utils::wait_any(handles);
+            if (found == handles.size())
+            {
+                break;
+            }
+            order.push_back(found);
+        }
+        std::sort(order.begin(), order.end());
+        REQUIRE((order == std::vector<std::size_t>{0, 1, 3}));
+        REQUIRE(handles[1].wait() == 1);
+        REQUIRE(Utils::wait_any(handles) == handles.size());
+    }
+
+    SUBCASE("wait_for times out on a slow call")
+    {
+        auto handle = Utils::queued_js_submit(long_running_func, delay.count());
+        REQUIRE_FALSE(Utils::wait_for(handle, std::chrono::milliseconds(10)));
+        REQUIRE(Utils::wait_for(handle, delay * 5));
+        REQUIRE(handle.wait() == 0);
+    }
+
+    SUBCASE("Dropping a handle does not leak its slot")
+    {
+        for (auto i = 0; i < 2 * QUEUED_SYNC_TO_ASYNC_MAX_IN_FLIGHT; ++i)
+        {
+            Utils::queued_js_submit(noop_func);
+        }
+        REQUIRE(Utils::queued_js_executor(noop_func) == 0);
+    }
+}
+
+TEST_CASE("Calls with a deadline")
+{
+    auto timeout = std::chrono::milliseconds(50);
+    auto delay = std::chrono::milliseconds(500);
+
+    SUBCASE("Fast calls finish normally")
+    {
+        REQUIRE(Utils::queued_js_executor_for(timeout * 20, noop_func) == Utils::OK);
+        REQUIRE(Utils::queued_js_executor_for(timeout * 20, error_func) == Utils::ERROR);
+        REQUIRE(Utils::js_executor_for(timeout * 20, noop_func) == Utils::OK);
+        REQUIRE(Utils::js_executor_for(timeout * 20, error_func) == Utils::ERROR);
+    }
+    SUBCASE("Queued calls time out and the late resume is discarded")
+    {
+        auto t1 = std::chrono::steady_clock::now();
+        REQUIRE(Utils::queued_js_executor_for(timeout, long_running_func, delay.count()) == Utils::TIMEOUT);
+        REQUIRE((std::chrono::steady_clock::now() - t1) < delay);
+        // Not blocked by the call that is still running
+        REQUIRE(Utils::queued_js_executor(noop_func) == Utils::OK);
+        std::this_thread::sleep_for(delay * 2);
+        REQUIRE(Utils::queued_js_executor(noop_func) == Utils::OK);
+    }
+    SUBCASE("Timed out pool workers are replaced")
+    {
+        auto &pool = Utils::SyncToAsyncPool::getPool();
+        auto t1 = std::chrono::steady_clock::now();
+        // More stuck calls than workers
+        for (std::size_t i = 0; i < pool.size() + 1; ++i)
+        {
+            REQUIRE(Utils::js_executor_for(timeout, long_running_func, delay.count()) == Utils::TIMEOUT);
+        }
+        REQUIRE(Utils::js_executor(noop_func) == Utils::OK);
+        REQUIRE((std::chrono::steady_clock::now() - t1) < delay * 2);
+        REQUIRE(pool.retired() > 0);
+        // Retired workers go away once Javascript resumes them
+        std::this_thread::sleep_for(delay * 2);
+        REQUIRE(pool.retired() == 0);
+        REQUIRE(Utils::js_executor(noop_func) == Utils::OK);
+    }
+}
+
+TEST_CASE("Backpressure")
+{
+    SUBCASE("A full invoker turns calls away")
+    {
+        Utils::QueuedSyncToAsync invoker;
+        invoker.setMaxInFlight(2);
+        auto first = invoker.submit(long_running_func, 300);
+        auto second = invoker.submit(long_running_func, 300);
+        REQUIRE(invoker.try_invoke(noop_func) == Utils::BUSY);
+        REQUIRE(invoker.queueStats().inFlight == 2);
+
+        // One caller may wait for a slot, the next one is shed
+        invoker.setMaxWaiting(1);
+        std::thread waiter([&] { REQUIRE(invoker.invoke(noop_func) == Utils::OK); });
+        while (invoker.queueStats().waiting < 1)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        REQUIRE(invoker.invoke(noop_func) == Utils::BUSY);
+        REQUIRE(invoker.submit(noop_func).wait() == Utils::BUSY);
+        REQUIRE(invoker.call<std::int64_t>(scale_i64, 1, 1).status == Utils::BUSY);
+
+        REQUIRE(first.wait() == Utils::OK);
+        REQUIRE(second.wait() == Utils::OK);
+        waiter.join();
+        auto stats = invoker.queueStats();
+        REQUIRE(stats.inFlight == 0);
+        REQUIRE(stats.waiting == 0);
+        REQUIRE(stats.peakWaiting == 1);
+        REQUIRE(stats.rejected == 4);
+        REQUIRE(invoker.try_invoke(noop_func) == Utils::OK);
+    }
+    SUBCASE("try_js_executor does not wait for a worker")
+    {
+        auto &pool = Utils::SyncToAsyncPool::getPool();
+        auto rejected = pool.stats().rejected;
+        std::vector<std::thread> callers;
+        for (std::size_t i = 0; i < pool.size(); ++i)
+        {
+            callers.emplace_back([] { REQUIRE(Utils::js_executor(long_running_func, 300) == Utils::OK); });
+        }
+        while (pool.stats().inFlight < pool.size())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        REQUIRE(Utils::try_js_executor(noop_func) == Utils::BUSY);
+        REQUIRE(pool.stats().rejected == rejected + 1);
+        for (auto &caller : callers)
+        {
+            caller.join();
+        }
+        REQUIRE(Utils::try_js_executor(noop_func) == Utils::OK);
+    }
+    SUBCASE("Sharded calls go to a shard with room")
+    {
+        Utils::ShardedSyncToAsync sharded(2, Utils::ShardPolicy::ROUND_ROBIN);
+        sharded.shard(1).setMaxInFlight(1);
+        auto busy = sharded.shard(1).submit(long_running_func, 300);
+        for (auto i = 0; i < 4; ++i)
+        {
+            REQUIRE(sharded.try_invoke(noop_func) == Utils::OK);
+        }
+        REQUIRE(sharded.shard(1).queueStats().rejected == 2);
+        REQUIRE(busy.wait() == Utils::OK);
+    }
+}
+
+TEST_CASE("Calls that return a value")
+{
+    SUBCASE("64 bit integers")
+    {
+        auto big = Utils::queued_js_call<std::int64_t>(scale_i64, 3, 40);
+        REQUIRE(big.ok());
+        REQUIRE(big.value == (std::int64_t{3} << 40));
+        auto negative = Utils::js_call<std::int64_t>(scale_i64, -5, 33);
+        REQUIRE(negative.ok());
+        REQUIRE(negative.value == -(std::int64_t{5} << 33));
+    }
+    SUBCASE("Doubles")
+    {
+        auto half = Utils::queued_js_call<double>(half_f64, 7);
+        REQUIRE(half.ok());
+        REQUIRE(half.value == 3.5);
+        REQUIRE(Utils::js_call<double>(half_f64, -1).value == -0.5);
+        // Integers convert to double, but not the other way round
+        REQUIRE(Utils::queued_js_call<double>(scale_i64, 1, 2).value == 4.0);
+        REQUIRE(Utils::queued_js_call<std::int64_t>(half_f64, 2).status == Utils::ERROR);
+    }
+    SUBCASE("Strings and bytes go to the caller's arena")
+    {
+        Utils::JsArena arena(64);
+        auto text = Utils::queued_js_call<std::string>(arena, repeat_text, "ab", 3);
+        REQUIRE(text.ok());
+        REQUIRE(text.value == "ababab");
+        auto bytes = Utils::js_call<Utils::JsBytes>(arena, repeat_text, std::string("xyz"), 2);
+        REQUIRE(bytes.ok());
+        REQUIRE(bytes.value.data == arena.data());
+        REQUIRE(std::string(reinterpret_cast<const char *>(bytes.value.data), bytes.value.size) == "xyzxyz");
+        REQUIRE(Utils::queued_js_call<std::string>(arena, repeat_text, "ab", 0).value.empty());
+    }
+    SUBCASE("Payloads that don't fit report the size they need")
+    {
+        Utils::JsArena arena(8);
+        auto text = Utils::queued_js_call<std::string>(arena, repeat_text, "abcd", 4);
+        REQUIRE(text.status == Utils::ERROR);
+        REQUIRE(arena.required() == 16);
+        arena.reserve(arena.required());
+        text = Utils::queued_js_call<std::string>(arena, repeat_text, "abcd", 4);
+        REQUIRE(text.ok());
+        REQUIRE(text.value == "abcdabcdabcdabcd");
+        REQUIRE(arena.required() == 0);
+    }
+    SUBCASE("Errors carry no value")
+    {
+        Utils::JsArena arena;
+        auto text = Utils::queued_js_call<std::string>(arena, repeat_text, "ab", -1);
+        REQUIRE(text.status == Utils::ERROR);
+        REQUIRE(text.value.empty());
+    }
+}
+
+TEST_CASE("Sharded returners")
+{
+    Utils::ShardedSyncToAsync sharded(3, Utils::ShardPolicy::ROUND_ROBIN);
+    REQUIRE(sharded.size() == 3);
+    REQUIRE(&sharded.shard(0) == &Utils::QueuedSyncToAsync::getInvoker());
+
+    SUBCASE("Broadcast runs everywhere")
+    {
+        REQUIRE(sharded.broadcast(log_data, std::string("Hello every shard")) == Utils::OK);
+        REQUIRE(sharded.broadcast(error_func) == Utils::ERROR);
+    }
+    SUBCASE("Round robin visits every shard")
+    {
+        std::vector<Utils::QueuedSyncToAsync *> picked;
+        for (auto i = 0; i < 6; ++i)
+        {
+            picked.push_back(&sharded.pick());
+        }
+        for (std::size_t i = 0; i < 3; ++i)
+        {
+            REQUIRE(picked[i] != picked[(i + 1) % 3]);
+            REQUIRE(picked[i] == picked[i + 3]);
+        }
+        REQUIRE(sharded.invoke(noop_func) == Utils::OK);
+    }
+    SUBCASE("Least outstanding avoids busy shards")
+    {
+        Utils::ShardedSyncToAsync leastBusy(3, Utils::ShardPolicy::LEAST_OUTSTANDING);
+        auto first = leastBusy.shard(0).submit(long_running_func, 300);
+        auto second = leastBusy.shard(1).submit(long_running_func, 300);
+        for (auto i = 0; i < 3; ++i)
+        {
+            REQUIRE(&leastBusy.pick() == &leastBusy.shard(2));
+        }
+        REQUIRE(first.wait() == Utils::OK);
+        REQUIRE(second.wait() == Utils::OK);
+        REQUIRE(leastBusy.shard(1).outstanding() == 0);
+    }
+}
+
+TEST_CASE("Priority lanes")
+{
+    // Hold the returner with a 100ms call, queue `bulkCalls` 20ms BULK calls
+    // behind it and then an INTERACTIVE one. Returns the order in which the
+    // queued calls started, with 0 for the INTERACTIVE call.
+    auto startOrder = [](Utils::QueuedSyncToAsync &invoker, int bulkCalls)
+    {
+        std::mutex orderMutex;
+        std::vector<int> order;
+        auto started = [&](int call)
+        {
+            std::lock_guard<std::mutex> lock(orderMutex);
+            order.push_back(call);
+        };
+        std::vector<std::thread> callers;
+        callers.emplace_back([&] { REQUIRE(invoker.invoke(busy_func, 100000) == Utils::OK); });
+        while (invoker.laneStats(Utils::Lane::INTERACTIVE).started < 1)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for (auto i = 1; i <= bulkCalls; ++i)
+        {
+            callers.emplace_back([&, i]
+                                 {
+                                     Utils::ScopedLane bulk(Utils::Lane::BULK);
+                                     auto handle = invoker.submit(busy_func, 20000);
+                                     started(i);
+                                     REQUIRE(handle.wait() == Utils::OK);
+                                 });
+        }
+        while (invoker.laneStats(Utils::Lane::BULK).depth < static_cast<std::size_t>(bulkCalls))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        callers.emplace_back([&]
+                             {
+                                 auto handle = invoker.submit(noop_func);
+                                 started(0);
+                                 REQUIRE(handle.wait() == Utils::OK);
+                             });
+        for (auto &caller : callers)
+        {
+            caller.join();
+        }
+        return order;
+    };
+
+    SUBCASE("Interactive calls start before waiting bulk calls")
+    {
+        Utils::QueuedSyncToAsync invoker;
+        invoker.setBulkAging(std::chrono::seconds(10));
+        auto order = startOrder(invoker, 3);
+        REQUIRE(order.size() == 4);
+        REQUIRE(order.front() == 0);
+        auto bulk = invoker.laneStats(Utils::Lane::BULK);
+        REQUIRE(bulk.depth == 0);
+        REQUIRE(bulk.maxDepth == 3);
+        REQUIRE(bulk.started == 3);
+        REQUIRE(bulk.aged == 0);
+        REQUIRE(invoker.laneStats(Utils::Lane::INTERACTIVE).started == 2);
+    }
+    SUBCASE("Bulk calls that waited too long go first")
+    {
+        Utils::QueuedSyncToAsync invoker;
+        invoker.setBulkAging(std::chrono::milliseconds(1));
+        startOrder(invoker, 1);
+        auto bulk = invoker.laneStats(Utils::Lane::BULK);
+        REQUIRE(bulk.started == 1);
+        REQUIRE(bulk.aged == 1);
+        REQUIRE(bulk.maxWait >= std::chrono::milliseconds(1));
+    }
+    SUBCASE("Deadlines count the time spent in the lane")
+    {
+        Utils::QueuedSyncToAsync invoker;
+        std::thread holder([&] { REQUIRE(invoker.invoke(busy_func, 100000) == Utils::OK); });
+        while (invoker.laneStats(Utils::Lane::INTERACTIVE).started < 1)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        {
+            Utils::ScopedLane bulk(Utils::Lane::BULK);
+            REQUIRE(invoker.invoke_for(std::chrono::milliseconds(10), noop_func) == Utils::TIMEOUT);
+        }
+        holder.join();
+        auto bulk = invoker.laneStats(Utils::Lane::BULK);
+        REQUIRE(bulk.expired == 1);
+        REQUIRE(bulk.started == 0);
+        REQUIRE(invoker.queueStats().inFlight == 0);
+    }
+    SUBCASE("Long lanes drain over several returner tasks")
+    {
+        Utils::QueuedSyncToAsync invoker;
+        const int calls = 3 * QUEUED_SYNC_TO_ASYNC_DRAIN_BATCH;
+        std::vector<std::thread> callers;
+        std::atomic<int> finished{0};
+        callers.emplace_back([&] { REQUIRE(invoker.invoke(busy_func, 50000) == Utils::OK); });
+        while (invoker.laneStats(Utils::Lane::INTERACTIVE).started < 1)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for (auto i = 0; i < calls; ++i)
+        {
+            callers.emplace_back([&] { finished += invoker.invoke(noop_func) == Utils::OK; });
+        }
+        for (auto &caller : callers)
+        {
+            caller.join();
+        }
+        REQUIRE(finished == calls);
+        REQUIRE(invoker.laneStats(Utils::Lane::INTERACTIVE).started == calls + 1);
+    }
+    SUBCASE("The lane is per thread and scoped")
+    {
+        REQUIRE(Utils::current_lane() == Utils::Lane::INTERACTIVE);
+        {
+            Utils::ScopedLane bulk(Utils::Lane::BULK);
+            REQUIRE(Utils::current_lane() == Utils::Lane::BULK);
+            std::thread([] { REQUIRE(Utils::current_lane() == Utils::Lane::INTERACTIVE); }).join();
+            REQUIRE(Utils::queued_js_executor(noop_func) == Utils::OK);
+        }
+        REQUIRE(Utils::current_lane() == Utils::Lane::INTERACTIVE);
+    }
+}
+
+TEST_CASE("Batching predictions")
+{
+    // Without tf.js every prediction fails, which still shows how they are grouped.
+    tfjs::Model model;
+    SUBCASE("Concurrent samples share a batch")
+    {
+        tfjs::BatchingPredictor batcher(model, {std::chrono::milliseconds(200), 16});
+        std::vector<std::thread> callers;
+        std::atomic<int> failed{0};
+        for (auto i = 0; i < 8; ++i)
+        {
+            callers.emplace_back([&] {
+                std::vector<float> input(4, 1.0f);
+                std::vector<float> output(2);
+                failed += batcher.predict(input, {1, 4}, output) == Utils::ERROR;
+            });
+        }
+        for (auto &caller : callers)
+        {
+            caller.join();
+        }
+        REQUIRE(failed == 8);
+        REQUIRE(batcher.stats().requests == 8);
+        REQUIRE(batcher.stats().batches < 8);
+    }
+    SUBCASE("Batches are cut at the maximum size")
+    {
+        tfjs::BatchingPredictor batcher(model, {std::chrono::seconds(10), 2});
+        auto t1 = std::chrono::steady_clock::now();
+        std::vector<std::thread> callers;
+        for (auto i = 0; i < 4; ++i)
+        {
+            callers.emplace_back([&] {
+                std::vector<float> input(4, 1.0f);
+                std::vector<float> output(2);
+                batcher.predict(input, {1, 4}, output);
+            });
+        }
+        for (auto &caller : callers)
+        {
+            caller.join();
+        }
+        // Full batches don't wait for the window
+        REQUIRE((std::chrono::steady_clock::now() - t1) < std::chrono::seconds(5));
+        REQUIRE(batcher.stats().batches == 2);
+    }
+    SUBCASE("Other shapes run on their own")
+    {
+        tfjs::BatchingPredictor batcher(model, {std::chrono::milliseconds(0), 16});
+        std::vector<float> input(8, 1.0f);
+        std::vector<float> output(2);
+        REQUIRE(batcher.predict(input, {2, 4}, output) == Utils::ERROR);
+        REQUIRE(batcher.stats().batches == 1);
+    }
+}
+
+TEST_CASE("Staging arena")
+{
+    auto &arena = tfjs::staging();
+    REQUIRE(arena.status() == Utils::OK);
+    REQUIRE_FALSE(tfjs::set_staging({}));
+
+    SUBCASE("Slots run out and come back")
+    {
+        std::vector<tfjs::StagingArena::Slot> slots;
+        for (std::size_t i = 0; i < arena.slots(); ++i)
+        {
+            slots.push_back(arena.try_borrow());
+            REQUIRE(slots.back());
+        }
+        REQUIRE_FALSE(arena.try_borrow());
+        auto index = slots.front().index();
+        slots.front().release();
+        auto slot = arena.try_borrow();
+        REQUIRE(slot);
+        REQUIRE(slot.index() == index);
+        REQUIRE(slot.output() == slot.input() + slot.input_capacity());
+    }
+    SUBCASE("borrow waits for a slot to come back")
+    {
+        std::vector<tfjs::StagingArena::Slot> slots;
+        for (std::size_t i = 0; i < arena.slots(); ++i)
+        {
+            slots.push_back(arena.try_borrow());
+        }
+        std::atomic<bool> borrowed{false};
+        std::size_t index = arena.slots();
+        std::thread borrower([&] {
+            auto slot = arena.borrow();
+            index = slot.index();
+            borrowed = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        REQUIRE_FALSE(borrowed);
+        auto returned = slots.back().index();
+        slots.back().release();
+        borrower.join();
+        REQUIRE(borrowed);
+        REQUIRE(index == returned);
+    }
+    SUBCASE("A slot has one borrower at a time")
+    {
+        std::vector<std::thread> borrowers;
+        std::atomic<int> clashes{0};
+        for (auto i = 0; i < 8; ++i)
+        {
+            borrowers.emplace_back([&arena, &clashes, i] {
+                for (auto j = 0; j < 2000; ++j)
+                {
+                    auto slot = arena.borrow();
+                    slot.input()[0] = static_cast<float>(i);
+                    std::this_thread::yield();
+                    clashes += slot.input()[0] != static_cast<float>(i);
+                }
+            });
+        }
+        for (auto &borrower : borrowers)
+        {
+            borrower.join();
+        }
+        REQUIRE(clashes == 0);
+    }
+    SUBCASE("Slot shapes are limited to kMaxRank")
+    {
+        auto slot = arena.borrow();
+        REQUIRE(slot.set_shape({1, 4}));
+        REQUIRE(slot.rank() == 2);
+        REQUIRE_FALSE(slot.set_shape(std::vector<int>(tfjs::StagingArena::kMaxRank + 1, 1)));
+        REQUIRE(slot.rank() == 2);
+    }
+}
@@ -1,48 +1,864 @@
 #include "tfjs.hpp"
+#include "completion_wait.hpp"
+#include "proxying_sync_to_async.hpp"
+#include "sharded_sync_to_async.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include <iostream>
+#include <mutex>
+
+namespace {
+    // tf.js lives in the global scope of each shard's worker, so one import
+    // per shard is enough for the lifetime of the runtime.
+    std::mutex gImportMutex;
+    std::atomic<bool> gImported{false};
+    // Guarded by gImportMutex
+    std::size_t gImports = 0;
+
+    std::mutex gShardsMutex;
+    std::size_t gShardCount = 1;
+    Utils::ShardPolicy gShardPolicy = Utils::ShardPolicy::LEAST_OUTSTANDING;
+    bool gShardsCreated = false;
+
+    // Every tfjs call goes through here. Models are loaded on every shard and
+    // predictions go to one of them.
+    Utils::ShardedSyncToAsync &executor() {
+        static Utils::ShardedSyncToAsync instance([]() {
+            std::lock_guard<std::mutex> lock(gShardsMutex);
+            gShardsCreated = true;
+            return gShardCount;
+        }(), gShardPolicy);
+        return instance;
+    }
+
+    // Ids of a Javascript table. Freed ids are reused so the table stays dense.
+    class IdTable {
+    public:
+        int acquire() {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mFree.empty()) {
+                return mNext++;
+            }
+            auto id = mFree.back();
+            mFree.pop_back();
+            return id;
+        }
+
+        void release(int id) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mFree.push_back(id);
+        }
+
+    private:
+        std::mutex mMutex;
+        std::vector<int> mFree;
+        int mNext = 0;
+    };
+
+    // Models are in the same slot on every shard. A tensor is on one shard
+    // only, but its id is unique across all of them.
+    IdTable gModelIds;
+    IdTable gTensorIds;
+
+    std::mutex gStagingMutex;
+    tfjs::StagingArena::Options gStagingOptions;
+    bool gStagingCreated = false;
+
+    // Small results of the query functions. Their values are copied out before
+    // returning, so one arena per thread is enough.
+    Utils::JsArena &queryArena() {
+        thread_local Utils::JsArena arena(256);
+        return arena;
+    }
+
+    const char *backend_name(tfjs::Backend backend) {
+        switch (backend) {
+            case tfjs::Backend::WASM:
+                return "wasm";
+            case tfjs::Backend::WEBGL:
+                return "webgl";
+            default:
+                return "cpu";
+        }
+    }
+
+    // Layout of a model bundle file, followed by the topology JSON and the
+    // weights. Written and read as is, wasm and the hosts we build for are all
+    // little endian.
+    struct BundleHeader {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t topologySize;
+        std::uint64_t weightsSize;
+        // Hash of the model.json and the weight files the bundle was made
+        // from, 0 if unknown.
+        std::uint64_t sourceHash;
+        // Hash of the topology and the weights.
+        std::uint64_t payloadHash;
+    };
+    constexpr char kBundleMagic[8] = {'T', 'F', 'J', 'S', 'B', 'N', 'D', 'L'};
+    constexpr std::uint32_t kBundleVersion = 1;
+
+    // FNV-1a over 8 byte words, so hashing the weights of a large model costs
+    // little next to reading them.
+    std::uint64_t hash_bytes(const unsigned char *data, std::size_t size, std::uint64_t hash = 14695981039346656037ull) {
+        constexpr std::uint64_t prime = 1099511628211ull;
+        std::size_t i = 0;
+        for (; i + sizeof(std::uint64_t) <= size; i += sizeof(std::uint64_t)) {
+            std::uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            hash = (hash ^ word) * prime;
+        }
+        for (; i < size; ++i) {
+            hash = (hash ^ data[i]) * prime;
+        }
+        return hash;
+    }
+
+    std::uint64_t hash_string(const std::string &text) {
+        return hash_bytes(reinterpret_cast<const unsigned char *>(text.data()), text.size());
+    }
+
+    // Weight files listed in the "paths" of the weightsManifest of a
+    // model.json, in order. A plain scan, the converter writes them as simple
+    // string arrays.
+    std::vector<std::string> weight_paths(const std::string &json) {
+        std::vector<std::string> paths;
+        auto at = json.find("\"weightsManifest\"");
+        while (at != std::string::npos && (at = json.find("\"paths\"", at)) != std::string::npos) {
+            auto open = json.find('[', at);
+            auto close = json.find(']', open);
+            if (open == std::string::npos || close == std::string::npos) {
+                break;
+            }
+            for (auto quote = json.find('"', open); quote < close;) {
+                auto end = json.find('"', quote + 1);
+                if (end == std::string::npos || end > close) {
+                    break;
+                }
+                paths.push_back(json.substr(quote + 1, end - quote - 1));
+                quote = json.find('"', end + 1);
+            }
+            at = close;
+        }
+        return paths;
+    }
+
+    // Hash of the model.json at `path` and of the weight files it lists, next
+    // to it, if the filesystem can read it, never 0 then, and 0 otherwise, e.g.
+    // for URLs. A retrained model often keeps its model.json, so the weights
+    // have to be part of it.
+    std::uint64_t source_hash(const std::string &path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            return 0;
+        }
+        std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        auto hash = hash_string(content);
+        auto slash = path.find_last_of('/');
+        auto dir = slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+        std::vector<char> chunk(1 << 20);
+        for (const auto &shard : weight_paths(content)) {
+            hash = hash_bytes(reinterpret_cast<const unsigned char *>(shard.data()), shard.size(), hash);
+            // A missing shard hashes as its name only, the load from path fails anyway.
+            std::ifstream weights(dir + shard, std::ios::binary);
+            while (weights) {
+                weights.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+                hash = hash_bytes(reinterpret_cast<const unsigned char *>(chunk.data()),
+                                  static_cast<std::size_t>(weights.gcount()), hash);
+            }
+        }
+        return hash | 1;
+    }
+
+    Utils::JsResultStatus write_bundle(const tfjs::Model &model, const std::string &file, std::uint64_t sourceHash) {
+        if (!model.valid()) {
+            return Utils::ERROR;
+        }
+        // The weights of a model are rarely known up front. If they don't fit
+        // Javascript reports the size and the bundle is made again, once.
+        Utils::ScopedLane bulk(Utils::Lane::BULK);
+        Utils::JsArena arena;
+        auto payload = executor().shard(0).call<Utils::JsBytes>(arena, model_bundle, model.id());
+        if (!payload && arena.required() > 0) {
+            arena.reserve(arena.required());
+            payload = executor().shard(0).call<Utils::JsBytes>(arena, model_bundle, model.id());
+        }
+        std::uint32_t topologySize;
+        if (!payload || payload.value.size < sizeof(topologySize)) {
+            return payload ? Utils::ERROR : payload.status;
+        }
+        std::memcpy(&topologySize, payload.value.data, sizeof(topologySize));
+        const auto *body = payload.value.data + sizeof(topologySize);
+        const auto bodySize = payload.value.size - sizeof(topologySize);
+        if (topologySize > bodySize) {
+            return Utils::ERROR;
+        }
+
+        BundleHeader header{};
+        std::memcpy(header.magic, kBundleMagic, sizeof(kBundleMagic));
+        header.version = kBundleVersion;
+        header.topologySize = topologySize;
+        header.weightsSize = bodySize - topologySize;
+        header.sourceHash = sourceHash;
+        header.payloadHash = hash_bytes(body, bodySize);
+        // Written next to the target and renamed, so a reader never sees half a bundle.
+        auto partial = file + ".partial";
+        {
+            std::ofstream out(partial, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char *>(body), static_cast<std::streamsize>(bodySize));
+            if (!out) {
+                std::remove(partial.c_str());
+                return Utils::ERROR;
+            }
+        }
+        if (std::rename(partial.c_str(), file.c_str()) != 0) {
+            std::remove(partial.c_str());
+            return Utils::ERROR;
+        }
+        return Utils::OK;
+    }
+
+    // sourceHash 0 accepts a bundle made from any source.
+    tfjs::Model read_bundle(const std::string &file, const std::string &type, std::uint64_t sourceHash) {
+        std::ifstream in(file, std::ios::binary);
+        BundleHeader header{};
+        if (!in || !in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, kBundleMagic, sizeof(kBundleMagic)) != 0 || header.version != kBundleVersion ||
+            (sourceHash != 0 && header.sourceHash != sourceHash)) {
+            return tfjs::Model{-1, Utils::ERROR};
+        }
+        // Check the sizes against the file before trusting them with an allocation.
+        auto start = in.tellg();
+        in.seekg(0, std::ios::end);
+        auto available = static_cast<std::uint64_t>(in.tellg() - start);
+        in.seekg(start);
+        if (available != header.topologySize + header.weightsSize) {
+            return tfjs::Model{-1, Utils::ERROR};
+        }
+        std::vector<unsigned char> body(header.topologySize + header.weightsSize);
+        if (!in.read(reinterpret_cast<char *>(body.data()), static_cast<std::streamsize>(body.size())) ||
+            hash_bytes(body.data(), body.size()) != header.payloadHash) {
+            return tfjs::Model{-1, Utils::ERROR};
+        }
+        std::string topology(reinterpret_cast<const char *>(body.data()), header.topologySize);
+        return tfjs::load_buffer(topology, std::vector<tfjs::WeightShard>{{body.data() + header.topologySize, header.weightsSize}}, type);
+    }
+
+    template<typename Func, typename... Args>
+    tfjs::Model load_model(Func &&func, Args... args) {
+        auto imported = tfjs::init();
+        if (imported != Utils::OK) {
+            return tfjs::Model{-1, imported};
+        }
+        // Loads can take seconds, don't hold up predictions meanwhile.
+        Utils::ScopedLane bulk(Utils::Lane::BULK);
+        auto id = gModelIds.acquire();
+        auto status = executor().broadcast(std::forward<Func>(func), id, args...);
+        if (status != Utils::OK) {
+            // Drop the replicas that did load
+            executor().broadcast(dispose_model, id);
+            gModelIds.release(id);
+            return tfjs::Model{-1, status};
+        }
+        return tfjs::Model{id, status};
+    }
+
+    // Run func on `shard` with a new tensor id as its last argument, which
+    // the function stores its result under, and hand it out if that worked.
+    template<typename Func, typename... Args>
+    tfjs::TensorHandle make_tensor(std::size_t shard, Func &&func, Args... args) {
+        auto id = gTensorIds.acquire();
+        auto status = executor().shard(shard).invoke(std::forward<Func>(func), args..., id);
+        if (status != Utils::OK) {
+            gTensorIds.release(id);
+            return tfjs::TensorHandle{-1, shard, status};
+        }
+        return tfjs::TensorHandle{id, shard, status};
+    }
+}// namespace
 
 Utils::JsResultStatus tfjs::import() {
-    auto isPreJs = Utils::js_executor(check_pretfjs);
-    if (isPreJs == Utils::JsResultStatus::ERROR) {
-        auto isThread = Utils::js_executor(check_if_on_thread);
-        if (isThread == Utils::JsResultStatus::OK) {
-            return Utils::js_executor(import_tfjs);
+    Utils::ScopedLane bulk(Utils::Lane::BULK);
+    auto &shards = executor();
+    for (std::size_t i = 0; i < shards.size(); ++i) {
+        auto &shard = shards.shard(i);
+        auto status = shard.invoke(check_pretfjs);
+        if (status == Utils::JsResultStatus::ERROR) {
+            status = shard.invoke(check_if_on_thread);
+            if (status == Utils::JsResultStatus::OK) {
+                status = shard.invoke(import_tfjs);
+            }
+        }
+        if (status != Utils::JsResultStatus::OK) {
+            return status;
         }
-        return isThread;
     }
-    return isPreJs;
+    return Utils::JsResultStatus::OK;
 }
 
-Utils::JsResultStatus tfjs::predict(const std::vector<float> &input, const std::vector<int> &input_shape, std::vector<float> &output) {
-    import();
-    return Utils::js_executor(predict_in_js, "123", input.data(), input.size(), input_shape.data(), output.data(), output.size());
+bool tfjs::set_shards(std::size_t count, Utils::ShardPolicy policy) {
+    std::lock_guard<std::mutex> lock(gShardsMutex);
+    if (gShardsCreated || count == 0) {
+        return false;
+    }
+    gShardCount = count;
+    gShardPolicy = policy;
+    return true;
+}
+
+std::size_t tfjs::shards() {
+    return executor().size();
+}
+
+Utils::JsResultStatus tfjs::init() {
+    if (gImported.load(std::memory_order_acquire)) {
+        return Utils::OK;
+    }
+    std::lock_guard<std::mutex> lock(gImportMutex);
+    if (gImported.load(std::memory_order_relaxed)) {
+        return Utils::OK;
+    }
+    gImports++;
+    auto status = import();
+    if (status == Utils::OK) {
+        gImported.store(true, std::memory_order_release);
+    }
+    return status;
+}
+
+std::size_t tfjs::imports() {
+    std::lock_guard<std::mutex> lock(gImportMutex);
+    return gImports;
+}
+
+tfjs::Model::Model(Model &&other) noexcept : mId{other.mId}, mStatus{other.mStatus} {
+    other.mId = -1;
+}
+
+tfjs::Model &tfjs::Model::operator=(Model &&other) noexcept {
+    if (this != &other) {
+        dispose();
+        mId = other.mId;
+        mStatus = other.mStatus;
+        other.mId = -1;
+    }
+    return *this;
+}
+
+tfjs::Model::~Model() {
+    dispose();
+}
+
+Utils::JsResultStatus tfjs::Model::dispose() {
+    if (!valid()) {
+        return Utils::ERROR;
+    }
+    auto status = executor().broadcast(dispose_model, mId);
+    gModelIds.release(mId);
+    mId = -1;
+    return status;
+}
+
+Utils::JsResultStatus tfjs::predict(const Model &model,
+                                    const void *input, DType input_dtype, std::size_t input_size, const std::vector<int> &input_shape,
+                                    void *output, DType output_dtype, std::size_t output_size, std::size_t *written) {
+    if (!model.valid()) {
+        return Utils::ERROR;
+    }
+    int count = 0;
+    auto status = executor().invoke(predict_in_js, model.id(),
+                                    input, static_cast<int>(input_dtype), static_cast<int>(input_size),
+                                    input_shape.data(), static_cast<int>(input_shape.size()),
+                                    output, static_cast<int>(output_dtype), static_cast<int>(output_size), &count);
+    if (written != nullptr) {
+        *written = status == Utils::OK ? static_cast<std::size_t>(count) : 0;
+    }
+    return status;
+}
+
+Utils::JsResultStatus tfjs::predict(const Model &model, const std::vector<float> &input, const std::vector<int> &input_shape, std::vector<float> &output) {
+    return predict(model, TensorView<const float>{input.data(), input.size(), input_shape}, output.data(), output.size());
 }
 
-Utils::JsResultStatus tfjs::dispose(const std::string &model_name) {
-    import();
-    return Utils::js_executor(dispose_model, "123");
+Utils::JsResultStatus tfjs::dispose(Model &model) {
+    return model.dispose();
+}
+
+tfjs::TensorHandle::TensorHandle(TensorHandle &&other) noexcept : mId{other.mId}, mShard{other.mShard}, mStatus{other.mStatus} {
+    other.mId = -1;
+}
+
+tfjs::TensorHandle &tfjs::TensorHandle::operator=(TensorHandle &&other) noexcept {
+    if (this != &other) {
+        dispose();
+        mId = other.mId;
+        mShard = other.mShard;
+        mStatus = other.mStatus;
+        other.mId = -1;
+    }
+    return *this;
+}
+
+tfjs::TensorHandle::~TensorHandle() {
+    dispose();
+}
+
+Utils::JsResultStatus tfjs::TensorHandle::dispose() {
+    if (!valid()) {
+        return Utils::ERROR;
+    }
+    auto status = executor().shard(mShard).invoke(dispose_tensor, mId);
+    gTensorIds.release(mId);
+    mId = -1;
+    return status;
+}
+
+tfjs::TensorHandle tfjs::upload(const void *input, DType input_dtype, std::size_t input_size, const std::vector<int> &input_shape) {
+    auto imported = init();
+    if (imported != Utils::OK) {
+        return TensorHandle{-1, 0, imported};
+    }
+    return make_tensor(executor().pickIndex(), upload_tensor, input, static_cast<int>(input_dtype), static_cast<int>(input_size),
+                       input_shape.data(), static_cast<int>(input_shape.size()));
+}
+
+tfjs::TensorHandle tfjs::predict(const Model &model, const TensorHandle &input) {
+    if (!model.valid() || !input.valid()) {
+        return TensorHandle{-1, 0, Utils::ERROR};
+    }
+    return make_tensor(input.shard(), predict_tensor, model.id(), input.id());
+}
+
+tfjs::TensorHandle tfjs::crop_and_resize(const TensorHandle &image, const std::vector<std::array<float, 4>> &boxes, int height, int width) {
+    if (!image.valid() || boxes.empty() || height <= 0 || width <= 0) {
+        return TensorHandle{-1, 0, Utils::ERROR};
+    }
+    return make_tensor(image.shard(), crop_and_resize_tensor, image.id(), boxes.front().data(),
+                       static_cast<int>(boxes.size()), height, width);
+}
+
+Utils::JsResult<std::vector<int>> tfjs::shape(const TensorHandle &tensor) {
+    Utils::JsResult<std::vector<int>> result;
+    if (!tensor.valid()) {
+        result.status = Utils::ERROR;
+        return result;
+    }
+    auto bytes = executor().shard(tensor.shard()).call<Utils::JsBytes>(queryArena(), tensor_shape, tensor.id());
+    result.status = bytes.status;
+    if (bytes) {
+        result.value.resize(bytes.value.size / sizeof(std::int32_t));
+        std::memcpy(result.value.data(), bytes.value.data, result.value.size() * sizeof(std::int32_t));
+    }
+    return result;
+}
+
+Utils::JsResultStatus tfjs::download(const TensorHandle &tensor, void *output, DType output_dtype, std::size_t output_size) {
+    if (!tensor.valid()) {
+        return Utils::ERROR;
+    }
+    return executor().shard(tensor.shard()).invoke(download_tensor, tensor.id(), output,
+                                                   static_cast<int>(output_dtype), static_cast<int>(output_size));
 }
-Utils::JsResultStatus tfjs::load_file(const std::string& path, const std::string& type) {
-    import();
+
+tfjs::Model tfjs::load_file(const std::string& path, const std::string& type) {
     if (type == "graph")
     {
-        return Utils::js_executor(load_graph_model_from_path, "123", path.c_str());
+        return load_model(load_graph_model_from_path, path.c_str());
     }
     else if(type == "layer")
     {
-        return Utils::js_executor(load_layer_model_from_path, "123", path.c_str());
+        return load_model(load_layer_model_from_path, path.c_str());
     }
-    return Utils::ERROR;
+    return Model{-1, Utils::ERROR};
+}
+
+tfjs::Model tfjs::load_buffer(const std::string& topology, const std::vector<unsigned char>& weights, const std::string& type) {
+    return load_buffer(topology, std::vector<WeightShard>{{weights.data(), weights.size()}}, type);
 }
-Utils::JsResultStatus tfjs::load_buffer(const std::string& topology, const std::vector<unsigned char>& weights, const std::string& type) {
-    import();
+
+tfjs::Model tfjs::load_buffer(const std::string& topology, const std::vector<WeightShard>& shards, const std::string& type) {
+    // Layout read by tfjs_model_artifacts in js_functions.js
+    struct JsWeightShard {
+        const unsigned char *data;
+        int size;
+    };
+    std::vector<JsWeightShard> jsShards;
+    jsShards.reserve(shards.size());
+    for (const auto &shard : shards) {
+        jsShards.push_back({shard.data, static_cast<int>(shard.size)});
+    }
     if (type == "graph")
     {
-        return Utils::js_executor(load_graph_model_from_buffer, "123", topology.c_str(), weights.data(), weights.size());
+        return load_model(load_graph_model_from_buffers, topology.c_str(), jsShards.data(), static_cast<int>(jsShards.size()));
     }
     else if(type == "layer")
     {
-        return Utils::js_executor(load_layer_model_from_buffer, "123", topology.c_str(), weights.data(), weights.size());
+        return load_model(load_layer_model_from_buffers, topology.c_str(), jsShards.data(), static_cast<int>(jsShards.size()));
+    }
+    return Model{-1, Utils::ERROR};
+}
+
+Utils::JsResultStatus tfjs::save_bundle(const Model &model, const std::string &file) {
+    return write_bundle(model, file, 0);
+}
+
+tfjs::Model tfjs::load_bundle(const std::string &file, const std::string &type) {
+    return read_bundle(file, type, 0);
+}
+
+std::string tfjs::cached_bundle(const std::string &path, const std::string &cache_dir) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.tfjsbundle", static_cast<unsigned long long>(hash_string(path)));
+    return cache_dir + "/" + name;
+}
+
+Utils::JsResultStatus tfjs::save_cached(const Model &model, const std::string &path, const std::string &cache_dir) {
+    return write_bundle(model, cached_bundle(path, cache_dir), source_hash(path));
+}
+
+tfjs::Model tfjs::load_cached(const std::string &path, const std::string &type, const std::string &cache_dir) {
+    auto file = cached_bundle(path, cache_dir);
+    auto sourceHash = source_hash(path);
+    auto model = read_bundle(file, type, sourceHash);
+    if (model) {
+        return model;
+    }
+    model = load_file(path, type);
+    if (model) {
+        // The model is usable without its bundle, the next start loads it from path again.
+        write_bundle(model, file, sourceHash);
+    }
+    return model;
+}
+
+Utils::JsResult<std::vector<int>> tfjs::output_shape(const Model &model) {
+    Utils::JsResult<std::vector<int>> result;
+    if (!model.valid()) {
+        result.status = Utils::ERROR;
+        return result;
+    }
+    auto bytes = executor().shard(0).call<Utils::JsBytes>(queryArena(), model_output_shape, model.id());
+    result.status = bytes.status;
+    if (bytes) {
+        result.value.resize(bytes.value.size / sizeof(std::int32_t));
+        std::memcpy(result.value.data(), bytes.value.data, result.value.size() * sizeof(std::int32_t));
+    }
+    return result;
+}
+
+Utils::JsResult<tfjs::MemoryInfo> tfjs::memory() {
+    Utils::JsResult<MemoryInfo> result;
+    auto imported = init();
+    if (imported != Utils::OK) {
+        result.status = imported;
+        return result;
+    }
+    auto bytes = executor().shard(0).call<Utils::JsBytes>(queryArena(), tfjs_memory);
+    result.status = bytes.status;
+    double values[3];
+    if (bytes && bytes.value.size == sizeof(values)) {
+        std::memcpy(values, bytes.value.data, sizeof(values));
+        result.value = MemoryInfo{static_cast<std::int64_t>(values[0]),
+                                  static_cast<std::int64_t>(values[1]),
+                                  static_cast<std::int64_t>(values[2])};
+    } else if (bytes) {
+        result.status = Utils::ERROR;
+    }
+    return result;
+}
+
+Utils::JsResultStatus tfjs::set_backend(Backend backend, const BackendOptions &options) {
+    auto imported = init();
+    if (imported != Utils::OK) {
+        return imported;
+    }
+    auto path = options.wasmPath;
+    if (!path.empty() && path.back() != '/') {
+        path += '/';
+    }
+    return executor().broadcast(set_tfjs_backend, backend_name(backend), path.c_str(),
+                                static_cast<int>(options.simd), static_cast<int>(options.threads));
+}
+
+Utils::JsResult<std::string> tfjs::backend() {
+    auto imported = init();
+    if (imported != Utils::OK) {
+        return {imported, {}};
+    }
+    return executor().shard(0).call<std::string>(queryArena(), tfjs_backend_name);
+}
+
+Utils::JsResult<tfjs::WarmupInfo> tfjs::warmup(const Model &model, const std::vector<int> &input_shape, std::size_t runs) {
+    Utils::JsResult<WarmupInfo> result;
+    if (!model.valid()) {
+        result.status = Utils::ERROR;
+        return result;
+    }
+    // One shard after the other, each replica has its own kernels to compile.
+    Utils::ScopedLane bulk(Utils::Lane::BULK);
+    auto &shards = executor();
+    double firstMs = 0;
+    double steadyMs = 0;
+    for (std::size_t i = 0; i < shards.size(); ++i) {
+        auto bytes = shards.shard(i).call<Utils::JsBytes>(queryArena(), warmup_model, model.id(),
+                                                          input_shape.data(), static_cast<int>(input_shape.size()),
+                                                          static_cast<int>(runs));
+        double times[2];
+        if (!bytes || bytes.value.size != sizeof(times)) {
+            result.status = bytes ? Utils::ERROR : bytes.status;
+            return result;
+        }
+        std::memcpy(times, bytes.value.data, sizeof(times));
+        firstMs = std::max(firstMs, times[0]);
+        steadyMs += times[1];
+    }
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+    result.status = Utils::OK;
+    result.value.firstRun = std::chrono::duration_cast<std::chrono::microseconds>(Milliseconds(firstMs));
+    result.value.steadyState = std::chrono::duration_cast<std::chrono::microseconds>(Milliseconds(steadyMs / shards.size()));
+    return result;
+}
+
+Utils::JsResultStatus tfjs::BatchingPredictor::predict(const float *input, std::size_t input_size, const std::vector<int> &input_shape,
+                                                       float *output, std::size_t output_size) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mStats.requests++;
+    if (input_shape.empty() || input_shape[0] != 1 ||
+        (mOpen && (mOpen->shape != input_shape || mOpen->inputSize != input_size || mOpen->outputSize != output_size))) {
+        mStats.batches++;
+        lock.unlock();
+        return tfjs::predict(mModel, TensorView<const float>{input, input_size, input_shape}, output, output_size);
+    }
+
+    auto leader = !mOpen;
+    if (leader) {
+        mOpen = std::make_shared<Batch>();
+        mOpen->shape = input_shape;
+        mOpen->inputSize = input_size;
+        mOpen->outputSize = output_size;
+        mOpen->requests.reserve(mOptions.maxBatch);
+    }
+    auto batch = mOpen;
+    batch->requests.push_back({input, output});
+    if (batch->requests.size() >= mOptions.maxBatch) {
+        // Full, the next request starts a new batch.
+        mOpen.reset();
+        batch->full.notify_one();
+    }
+
+    if (!leader) {
+        batch->finished.wait(lock, [&]() { return batch->done; });
+        return batch->status;
+    }
+
+    batch->full.wait_for(lock, mOptions.window, [&]() { return mOpen != batch; });
+    if (mOpen == batch) {
+        mOpen.reset();
+    }
+    mStats.batches++;
+    lock.unlock();
+    // Nobody adds to the batch any more, so it can be read without the lock.
+    auto status = run(*batch);
+    lock.lock();
+    batch->status = status;
+    batch->done = true;
+    batch->finished.notify_all();
+    return status;
+}
+
+Utils::JsResultStatus tfjs::BatchingPredictor::predict(const std::vector<float> &input, const std::vector<int> &input_shape, std::vector<float> &output) {
+    return predict(input.data(), input.size(), input_shape, output.data(), output.size());
+}
+
+tfjs::BatchingPredictor::Stats tfjs::BatchingPredictor::stats() const {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mStats;
+}
+
+Utils::JsResultStatus tfjs::BatchingPredictor::run(Batch &batch) {
+    const auto count = batch.requests.size();
+    if (count == 1) {
+        const auto &request = batch.requests.front();
+        return tfjs::predict(mModel, TensorView<const float>{request.input, batch.inputSize, batch.shape},
+                             request.output, batch.outputSize);
+    }
+    std::vector<float> inputs(count * batch.inputSize);
+    std::vector<float> outputs(count * batch.outputSize);
+    for (std::size_t i = 0; i < count; ++i) {
+        std::memcpy(inputs.data() + i * batch.inputSize, batch.requests[i].input, batch.inputSize * sizeof(float));
+    }
+    auto shape = batch.shape;
+    shape[0] = static_cast<int>(count);
+    std::size_t written = 0;
+    auto status = tfjs::predict(mModel, TensorView<const float>{inputs.data(), inputs.size(), shape},
+                                outputs.data(), outputs.size(), &written);
+    if (status == Utils::OK && written != outputs.size()) {
+        // output_size is not the model's output size, so the rows can't be
+        // told apart. Give every request the result of its own predict.
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStats.fallbacks++;
+        }
+        shape[0] = 1;
+        for (const auto &request : batch.requests) {
+            auto single = tfjs::predict(mModel, TensorView<const float>{request.input, batch.inputSize, shape},
+                                        request.output, batch.outputSize);
+            if (single != Utils::OK) {
+                status = single;
+            }
+        }
+        return status;
+    }
+    if (status == Utils::OK) {
+        for (std::size_t i = 0; i < count; ++i) {
+            std::memcpy(batch.requests[i].output, outputs.data() + i * batch.outputSize, batch.outputSize * sizeof(float));
+        }
+    }
+    return status;
+}
+
+tfjs::StagingArena::StagingArena(int id, Options options)
+    : mId{id}, mOptions{options},
+      mMemory{new float[options.slots * (options.inputFloats + options.outputFloats)]()},
+      mShapes{new SlotShape[options.slots]},
+      mBusy{new std::atomic<bool>[options.slots]} {
+    for (std::size_t i = 0; i < mOptions.slots; ++i) {
+        mBusy[i].store(false, std::memory_order_relaxed);
+    }
+    // Every shard keeps its own views of the arena.
+    mStatus = executor().broadcast(register_staging_arena, mId, mMemory.get(), static_cast<int>(mOptions.slots),
+                                   static_cast<int>(mOptions.inputFloats), static_cast<int>(mOptions.outputFloats));
+}
+
+tfjs::StagingArena::Slot tfjs::StagingArena::try_borrow() {
+    // Start where the last borrow left off, so the slots are used in turn.
+    auto start = mCursor.fetch_add(1, std::memory_order_relaxed);
+    for (std::size_t i = 0; i < mOptions.slots; ++i) {
+        auto index = (start + i) % mOptions.slots;
+        if (!mBusy[index].load(std::memory_order_relaxed) &&
+            !mBusy[index].exchange(true, std::memory_order_acquire)) {
+            return Slot{this, index};
+        }
+    }
+    return Slot{};
+}
+
+tfjs::StagingArena::Slot tfjs::StagingArena::borrow() {
+    auto slot = try_borrow();
+    if (slot) {
+        return slot;
+    }
+    mSleepers++;
+    for (;;) {
+        // Read before looking for a slot, so a return in between changes it
+        // and the wait below doesn't sleep through it.
+        auto returns = mReturns.load();
+        slot = try_borrow();
+        if (slot) {
+            break;
+        }
+        Utils::detail::wait_while(mReturns, returns);
+    }
+    mSleepers--;
+    return slot;
+}
+
+tfjs::StagingArena::Slot &tfjs::StagingArena::Slot::operator=(Slot &&other) noexcept {
+    if (this != &other) {
+        release();
+        mArena = other.mArena;
+        mIndex = other.mIndex;
+        other.mArena = nullptr;
+    }
+    return *this;
+}
+
+float *tfjs::StagingArena::Slot::input() const {
+    const auto &options = mArena->mOptions;
+    return mArena->mMemory.get() + mIndex * (options.inputFloats + options.outputFloats);
+}
+
+std::size_t tfjs::StagingArena::Slot::input_capacity() const {
+    return mArena->mOptions.inputFloats;
+}
+
+float *tfjs::StagingArena::Slot::output() const {
+    return input() + mArena->mOptions.inputFloats;
+}
+
+std::size_t tfjs::StagingArena::Slot::output_capacity() const {
+    return mArena->mOptions.outputFloats;
+}
+
+bool tfjs::StagingArena::Slot::set_shape(const int *dims, std::size_t rank) {
+    if (rank > kMaxRank) {
+        return false;
+    }
+    auto &slotShape = mArena->mShapes[mIndex];
+    std::copy(dims, dims + rank, slotShape.dims.begin());
+    slotShape.rank = rank;
+    return true;
+}
+
+const int *tfjs::StagingArena::Slot::shape() const {
+    return mArena->mShapes[mIndex].dims.data();
+}
+
+std::size_t tfjs::StagingArena::Slot::rank() const {
+    return mArena->mShapes[mIndex].rank;
+}
+
+void tfjs::StagingArena::Slot::release() {
+    if (mArena) {
+        mArena->mBusy[mIndex].store(false, std::memory_order_release);
+        mArena->mReturns++;
+        if (mArena->mSleepers.load() != 0) {
+            Utils::detail::wake_one(mArena->mReturns);
+        }
+        mArena = nullptr;
+    }
+}
+
+bool tfjs::set_staging(StagingArena::Options options) {
+    std::lock_guard<std::mutex> lock(gStagingMutex);
+    if (gStagingCreated || options.slots == 0) {
+        return false;
+    }
+    gStagingOptions = options;
+    return true;
+}
+
+tfjs::StagingArena &tfjs::staging() {
+    static StagingArena instance(0, []() {
+        std::lock_guard<std::mutex> lock(gStagingMutex);
+        gStagingCreated = true;
+        return gStagingOptions;
+    }());
+    return instance;
+}
+
+Utils::JsResultStatus tfjs::predict(const Model &model, const StagingArena::Slot &slot, std::size_t input_size, std::size_t output_size,
+                                    std::size_t *written) {
+    if (!model.valid() || !slot || slot.rank() == 0 ||
+        input_size > slot.input_capacity() || output_size > slot.output_capacity()) {
+        return Utils::ERROR;
+    }
+    const auto &arena = staging();
+    if (arena.status() != Utils::OK) {
+        return arena.status();
+    }
+    int count = 0;
+    auto status = executor().invoke(predict_staged, model.id(), arena.id(), static_cast<int>(slot.index()),
+                                    static_cast<int>(input_size), slot.shape(), static_cast<int>(slot.rank()),
+                                    static_cast<int>(output_size), &count);
+    if (written != nullptr) {
+        *written = status == Utils::OK ? static_cast<std::size_t>(count) : 0;
     }
-    return Utils::ERROR;
+    return status;
 }